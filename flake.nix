@@ -252,6 +252,9 @@
         meson
         ninja
         boost
+        liburing
+        xdp-tools
+        libbpf
         gdb
         bpftrace
         numactl
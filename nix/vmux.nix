@@ -59,6 +59,10 @@ pkgs.clangStdenv.mkDerivation {
 
     pkg-config
 
+    # XDP program of the AF_XDP driver
+    llvmPackages.clang-unwrapped
+    xxd
+
     # dependencies for nic-emu
     rustc
     cargo
@@ -72,6 +76,9 @@ pkgs.clangStdenv.mkDerivation {
     libpcap
     (boost.override { enableStatic = true; enableShared = false; })
     flakepkgs.dpdk23
+    liburing
+    xdp-tools # libxdp
+    libbpf
 
     json_c
     cmocka
@@ -4,16 +4,23 @@
 #include "interrupts/simbricks.hpp"
 #include "libsimbricks/simbricks/nicbm/nicbm.h"
 #include "libvfio-user.h"
+#include "local-switch.hpp"
 #include "sims/nic/e810_bm/e810_bm.h"
 #include "sims/nic/e810_bm/e810_ptp.h"
 #include "src/devices/vmux-device.hpp"
 #include "util.hpp"
 #include "vfio-consumer.hpp"
 #include "vfio-server.hpp"
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 #include <ctime>
 
 #define NUM_MSIX_IRQs 16 // choose small to avoid unneccessary polling in processAllPollTimers
@@ -32,11 +39,29 @@ private:
   const uint8_t mac_addr[6] = {};
 
   epoll_callback tapCallback;
+  std::vector<epoll_callback> queueCallbacks; // one per driver->queue_fds
   int efd = 0; // if non-null: eventfd registered for this->tap->fd
                
   std::vector<std::shared_ptr<InterruptThrottlerSimbricks>> irqThrottle;
 
+  // frames of other local devices that could not be received right away
+  // (see local_rx). Many producers (under localLock), consumer is local_cb.
+  static const uint32_t LOCAL_SLOTS = 256;
+  std::unique_ptr<char[]> localBufs; // LOCAL_SLOTS * Driver::MAX_BUF
+  uint32_t localLen[LOCAL_SLOTS];
+  std::atomic<uint32_t> localHead = 0;
+  std::atomic<uint32_t> localTail = 0;
+  std::mutex localLock;
+  epoll_callback localCallback;
+
+  epoll_callback modeCallback = {}; // fifo to switch between emulation and mediation
+  std::string modePath;
+
   void registerDriverEpoll(std::shared_ptr<Driver> driver, int efd) {
+    if (!driver->queue_fds.empty()) {
+      this->registerDriverQueuesEpoll(driver, efd);
+      return;
+    }
     if (driver->fd == 0)
       return;
       // die("E1000 only supports drivers that offer fds to wait on")
@@ -54,6 +79,24 @@ private:
     this->efd = efd;
   }
 
+  // every queue fd wakes up only the poll of its own queue
+  void registerDriverQueuesEpoll(std::shared_ptr<Driver> driver, int efd) {
+    this->queueCallbacks.resize(driver->queue_fds.size()); // must not move after epoll_ctl
+    for (size_t q = 0; q < driver->queue_fds.size(); q++) {
+      this->queueCallbacks[q].fd = q;
+      this->queueCallbacks[q].callback = E810EmulatedDevice::driver_queue_cb;
+      this->queueCallbacks[q].ctx = this;
+      struct epoll_event e;
+      e.events = EPOLLIN;
+      e.data.ptr = &this->queueCallbacks[q];
+
+      if (0 != epoll_ctl(efd, EPOLL_CTL_ADD, driver->queue_fds[q], &e))
+        die("could not register driver queue fd to epoll");
+    }
+
+    this->efd = efd;
+  }
+
 public:
   std::shared_ptr<e810::e810_bm> model;
 
@@ -115,20 +158,174 @@ public:
   }
 
   // forward rx event callback from tap to this E1000EmulatedDevice
-  static void driver_cb(int vm_number, void *this__) {
+  static void driver_cb(int _fd, void *this__) {
     E810EmulatedDevice *this_ = (E810EmulatedDevice*) this__;
     this_->processAllPollTimers();
-    this_->driver->recv(vm_number); // recv assumes the Device does not handle packet of other VMs until recv_consumed()!
-    // for (uint16_t ) {}
-		for (int q_idx = 0; q_idx < 4; q_idx++) { // TODO hardcoded max_queues_per_vm
-			int queue_id = vm_number * 4 + q_idx;// TODO this_->get_rx_queue_id(vm_id, q_idx);
-			for (uint16_t i = queue_id * 32; i < (queue_id * 32+ this_->driver->nb_bufs_used[queue_id]); i++) { // TODO 32 = BURST_SIZE
-        this_->vfu_ctx_mutex.lock();
-        this_->model->EthRx(0, this_->driver->rxBuf_queue[i], this_->driver->rxBufs[i], this_->driver->rxBuf_used[i]); // hardcode port 0
-        this_->vfu_ctx_mutex.unlock();
-			}
-		}
-    this_->driver->recv_consumed(vm_number);
+    this_->driver->recv(this_->device_id); // recv assumes the Device does not handle packet of other VMs until recv_consumed()!
+    for (int q_idx = 0; q_idx < Driver::MAX_QUEUES_PER_VM; q_idx++) {
+      this_->rx_queue_bufs(q_idx);
+    }
+    this_->driver->recv_consumed(this_->device_id);
+  }
+
+  static void driver_queue_cb(int q_idx, void *this__) {
+    E810EmulatedDevice *this_ = (E810EmulatedDevice*) this__;
+    this_->poll_rx_queue(q_idx);
+  }
+
+  // pass what the driver received on queue q_idx to the model
+  void rx_queue_bufs(uint16_t q_idx) {
+    size_t queue_id = this->driver->rx_buf_queue(this->device_id, q_idx);
+    size_t first = queue_id * this->driver->per_queue_bufs;
+    size_t nb = this->driver->nb_bufs_used[queue_id];
+    if (nb == 0)
+      return;
+    // one burst per lock
+    std::lock_guard guard(this->vfu_ctx_mutex);
+    this->model->EthRxBurst(0, &this->driver->rxBuf_queue[first], &this->driver->rxBufs[first], &this->driver->rxBuf_used[first], &this->driver->rxBuf_ptype[first], &this->driver->rxBuf_hash[first], &this->driver->rxBuf_csum[first], nb); // hardcode port 0
+  }
+
+  uint16_t nr_rx_queues() { return Driver::MAX_QUEUES_PER_VM; }
+
+  // Switch frames to other local devices with sw, and receive theirs.
+  // Frames that can't be received right away are queued and received by
+  // the main thread (efd).
+  void enable_local_switch(std::shared_ptr<LocalSwitch> sw, int efd) {
+    this->localBufs = std::make_unique<char[]>((size_t)LOCAL_SLOTS * Driver::MAX_BUF);
+    this->localCallback.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->localCallback.fd < 0)
+      die("Cannot create eventfd");
+    this->localCallback.callback = E810EmulatedDevice::local_cb;
+    this->localCallback.ctx = this;
+    struct epoll_event e;
+    e.events = EPOLLIN;
+    e.data.ptr = &this->localCallback;
+    if (0 != epoll_ctl(efd, EPOLL_CTL_ADD, this->localCallback.fd, &e))
+      die("could not register local switch eventfd to epoll");
+
+    this->localSwitch = sw;
+    sw->add_device(this, this->mac_addr);
+  }
+
+  // Called by the runner of the sending device, which holds its own
+  // vfu_ctx_mutex. We only try to take ours, so two devices sending to each
+  // other can't deadlock.
+  bool local_rx(const void *data, size_t len) {
+    if (len > Driver::MAX_BUF || !this->callbacks)
+      return false;
+    // receive right away: single copy from the sender's frame into the guest
+    if (this->localHead.load() == this->localTail.load() && this->vfu_ctx_mutex.try_lock()) {
+      this->model->EthRx(0, std::nullopt, data, len); // hardcode port 0
+      this->vfu_ctx_mutex.unlock();
+      return true;
+    }
+    {
+      std::lock_guard guard(this->localLock);
+      uint32_t head = this->localHead.load(std::memory_order_relaxed);
+      if (head - this->localTail.load(std::memory_order_acquire) == LOCAL_SLOTS)
+        return false;
+      uint32_t slot = head % LOCAL_SLOTS;
+      memcpy(&this->localBufs[(size_t)slot * Driver::MAX_BUF], data, len);
+      this->localLen[slot] = len;
+      this->localHead.store(head + 1, std::memory_order_release);
+    }
+    uint64_t one = 1;
+    if (write(this->localCallback.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      die("Cannot signal local switch eventfd");
+    return true;
+  }
+
+  static void local_cb(int fd, void *this__) {
+    E810EmulatedDevice *this_ = (E810EmulatedDevice*) this__;
+    uint64_t events;
+    if (read(fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+      die("Cannot read local switch eventfd");
+    std::lock_guard guard(this_->vfu_ctx_mutex);
+    uint32_t tail = this_->localTail.load(std::memory_order_relaxed);
+    uint32_t head = this_->localHead.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      uint32_t slot = tail % LOCAL_SLOTS;
+      this_->model->EthRx(0, std::nullopt, &this_->localBufs[(size_t)slot * Driver::MAX_BUF], this_->localLen[slot]);
+    }
+    this_->localTail.store(tail, std::memory_order_release);
+  }
+
+  /**
+   * Move the data path of the running device between emulation (the model
+   * steers) and mediation (the NIC steers by the guest's rules). Frames the
+   * NIC received before are still steered by the model (see FlowRules), and
+   * PTP continues from the current time with the other clock.
+   */
+  bool set_mediation(bool on) {
+    std::lock_guard guard(this->vfu_ctx_mutex); // between bursts and register accesses
+    bool ok = on ? this->driver->mediation_enable(this->device_id)
+                 : this->driver->mediation_disable(this->device_id);
+    if (!ok) {
+      printf("WARN: vmux%d: the driver cannot switch to %s\n", this->device_id, on ? "mediation" : "emulation");
+      return false;
+    }
+    this->model->UseNicClock(on);
+    printf("vmux%d: switched to %s\n", this->device_id, on ? "mediation" : "emulation");
+    return true;
+  }
+
+  // Operators switch the running device with "echo mediation > path" (or
+  // emulation). The fifo is read by the main thread (efd).
+  void enable_mode_control(const std::string &path, int efd) {
+    unlink(path.c_str());
+    if (mkfifo(path.c_str(), 0600) != 0)
+      die("Cannot create mode fifo %s", path.c_str());
+    // read and write, so that the fifo doesn't hang up when writers close it
+    this->modeCallback.fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (this->modeCallback.fd < 0)
+      die("Cannot open mode fifo %s", path.c_str());
+    this->modeCallback.callback = E810EmulatedDevice::mode_cb;
+    this->modeCallback.ctx = this;
+    struct epoll_event e;
+    e.events = EPOLLIN;
+    e.data.ptr = &this->modeCallback;
+    if (0 != epoll_ctl(efd, EPOLL_CTL_ADD, this->modeCallback.fd, &e))
+      die("could not register mode fifo to epoll");
+    this->modePath = path;
+  }
+
+  static void mode_cb(int fd, void *this__) {
+    E810EmulatedDevice *this_ = (E810EmulatedDevice*) this__;
+    char buf[256];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    if (len <= 0)
+      return;
+    buf[len] = 0;
+    char *save;
+    for (char *cmd = strtok_r(buf, " \n", &save); cmd != NULL; cmd = strtok_r(NULL, " \n", &save)) {
+      if (strcmp(cmd, "mediation") == 0)
+        this_->set_mediation(true);
+      else if (strcmp(cmd, "emulation") == 0)
+        this_->set_mediation(false);
+      else
+        printf("WARN: vmux%d: unknown mode %s\n", this_->device_id, cmd);
+    }
+  }
+
+  ~E810EmulatedDevice() {
+    if (this->modeCallback.fd > 0) {
+      close(this->modeCallback.fd);
+      unlink(this->modePath.c_str());
+    }
+  }
+
+  // like driver_cb, but for a single queue
+  void poll_rx_queue(uint16_t q_idx) {
+    if (q_idx == 0)
+      this->processAllPollTimers();
+    this->driver->recv_queue(this->device_id, q_idx);
+    this->rx_queue_bufs(q_idx);
+    this->driver->recv_consumed_queue(this->device_id, q_idx);
+  }
+
+  int rx_queue_vector(uint16_t q_idx) {
+    std::lock_guard guard(this->vfu_ctx_mutex);
+    return this->model->QueueVector(q_idx);
   }
 
   void init_pci_ids() {
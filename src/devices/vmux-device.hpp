@@ -7,6 +7,7 @@
 #include <memory>
 
 class VfioUserServer;
+class LocalSwitch;
 
 // /** Number of PCI bars */
 // #define SIMBRICKS_PROTO_PCIE_NBARS 6
@@ -73,12 +74,28 @@ public:
 
   callback_fn rx_callback;
 
+  // if set, frames to other devices of this process are switched locally
+  std::shared_ptr<LocalSwitch> localSwitch;
+
   virtual void setup_vfu(std::shared_ptr<VfioUserServer> vfu) = 0;
 
   VmuxDevice(int device_id, std::shared_ptr<Driver> driver) : driver(driver), device_id(device_id), rx_callback(NULL) {};
 
   virtual ~VmuxDevice() = default;
 
+  // Number of rx queues that can be polled separately with poll_rx_queue().
+  // 0 if the device can only be polled as a whole with rx_callback.
+  virtual uint16_t nr_rx_queues() { return 0; }
+
+  virtual void poll_rx_queue(uint16_t queue) {}
+
+  // Interrupt vector the guest assigned to queue. -1 if unknown.
+  virtual int rx_queue_vector(uint16_t queue) { return -1; }
+
+  // Receive a frame another device of this process sent (see LocalSwitch).
+  // May be called by any thread. false if the frame was dropped.
+  virtual bool local_rx(const void *data, size_t len) { return false; }
+
   inline bool isMediating() {
     return this->driver->is_mediating(this->device_id);
   }
@@ -4,10 +4,14 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <format>
 #include <fcntl.h>
+#include <memory>
 #include <rte_mbuf_ptype.h>
 #include <rte_memcpy.h>
 #include <stdint.h>
@@ -18,19 +22,34 @@
 #include <rte_cycles.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_ring.h>
+#include <rte_spinlock.h>
+#include <rte_version.h>
+#include <rte_eth_bond.h>
+#include <map>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 #include "sims/nic/e810_bm/e810_ptp.h"
 #include "src/util.hpp"
 #include "src/drivers/driver.hpp"
 #include "src/drivers/flow_blocks.hpp"
+#include "src/drivers/flow_rules.hpp"
+#include "src/drivers/mempools.hpp"
 #include <unistd.h>
 
 #define RX_RING_SIZE 1024
 #define TX_RING_SIZE 1024
 
-#define NUM_MBUFS 256 // queue size
-#define MBUF_CACHE_SIZE 250
 #define BURST_SIZE 32
 
+// the flows the NIC hashes, like the e810 model (lan::rss_steering): ipv4
+// tcp and udp by 4-tuple, other ipv4 and fragments by 2-tuple
+#define RSS_TYPES (RTE_ETH_RSS_IPV4 | RTE_ETH_RSS_FRAG_IPV4 | \
+		RTE_ETH_RSS_NONFRAG_IPV4_TCP | RTE_ETH_RSS_NONFRAG_IPV4_UDP | \
+		RTE_ETH_RSS_NONFRAG_IPV4_OTHER)
+
 // from dpdk/app/test/packet_burst_generator.c
 static void
 copy_buf_to_pkt_segs(void *buf, unsigned len, struct rte_mbuf *pkt,
@@ -70,8 +89,9 @@ copy_buf_to_pkt(void *buf, unsigned len, struct rte_mbuf *pkt, unsigned offset)
 }
 
 /* Port initialization used in flow filtering. 8< */
+// rss: hash received frames and report the hash (Dpdk::set_rss)
 static void
-filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte_mempool*> &rx_mbuf_pools, std::vector<struct rte_mempool*> &tx_mbuf_pools)
+filtering_init_port(uint16_t port_id, uint16_t nr_queues, uint16_t nr_tx_queues, MbufPools &mbuf_pools, bool rss)
 {
 	int ret;
 	uint16_t i;
@@ -79,7 +99,8 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 	struct rte_eth_conf port_conf = {
 		.rxmode = {
 			.offloads = 
-				RTE_ETH_RX_OFFLOAD_TIMESTAMP
+				RTE_ETH_RX_OFFLOAD_TIMESTAMP |
+				RTE_ETH_RX_OFFLOAD_CHECKSUM
 		},
 		.txmode = {
 			.offloads =
@@ -104,10 +125,17 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 			"Error during getting device (port %u) info: %s\n",
 			port_id, strerror(-ret));
 
+	if (rss) {
+		// frames without rte_flow rule are spread by the redirection table
+		port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+		port_conf.rxmode.offloads |= RTE_ETH_RX_OFFLOAD_RSS_HASH;
+		port_conf.rx_adv_conf.rss_conf.rss_hf = RSS_TYPES & dev_info.flow_type_rss_offloads;
+	}
+	port_conf.rxmode.offloads &= dev_info.rx_offload_capa;
 	port_conf.txmode.offloads &= dev_info.tx_offload_capa;
 	printf(":: initializing port: %d\n", port_id);
 	ret = rte_eth_dev_configure(port_id,
-				nr_queues, nr_queues, &port_conf);
+				nr_queues, nr_tx_queues, &port_conf);
 	if (ret < 0) {
 		rte_exit(EXIT_FAILURE,
 			":: cannot configure device: err=%d, port=%u\n",
@@ -119,18 +147,22 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 	/* >8 End of ethernet port configured with default settings. */
 
 	/* Configuring number of RX and TX queues connected to single port. 8< */
-	struct rte_mempool *rx_pool;
-	size_t magic = 36; // when we set the PTP capability on the pNIC, bigger rx bursts can cause problems that look like as if the pool was exhausted (leaked mbufs). This magic threashold fixes it. Decrement by one to get the error again.
+	uint16_t nb_rxd = RX_RING_SIZE;
+	uint16_t nb_txd = TX_RING_SIZE;
+	ret = rte_eth_dev_adjust_nb_rx_tx_desc(port_id, &nb_rxd, &nb_txd);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE,
+			":: cannot adjust number of descriptors: err=%d, port=%u\n",
+			ret, port_id);
+	mbuf_pools.set_ring_sizes(nb_rxd, nb_txd);
+
+	// all rx queues share one pool on the socket of the NIC
+	struct rte_mempool *rx_pool = mbuf_pools.get(rte_eth_dev_socket_id(port_id), MbufPools::RX);
+	if (rx_pool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create rx mbuf pool\n");
+	mbuf_pools.add_rx_port(rte_eth_dev_socket_id(port_id), port_id);
 	for (i = 0; i < nr_queues; i++) {
-		size_t rx_buffers = NUM_MBUFS + magic;
-		// TODO allocate these elsewhere
-		rx_pool = rte_pktmbuf_pool_create(std::format("RX_MBUF_POOL_{}", i).c_str(), rx_buffers ,
-			64, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id()); // TODO constant for cache
-		if (rx_pool == NULL)
-			rte_exit(EXIT_FAILURE, "Cannot create rx mbuf pool %d\n", i);
-		rx_mbuf_pools.push_back(rx_pool);
-
-		ret = rte_eth_rx_queue_setup(port_id, i, NUM_MBUFS,
+		ret = rte_eth_rx_queue_setup(port_id, i, nb_rxd,
 				     rte_eth_dev_socket_id(port_id),
 				     &rxq_conf,
 				     rx_pool);
@@ -144,17 +176,8 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 	txq_conf = dev_info.default_txconf;
 	txq_conf.offloads = port_conf.txmode.offloads;
 
-	struct rte_mempool *tx_pool;
-	for (i = 0; i < nr_queues; i++) {
-		size_t tx_buffers = NUM_MBUFS; // TODO
-		// TODO allocate these elsewhere
-		tx_pool = rte_pktmbuf_pool_create(std::format("TX_MBUF_POOL_{}", i).c_str(), tx_buffers ,
-			64, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id()); // TODO constant for cache
-		if (tx_pool == NULL)
-			rte_exit(EXIT_FAILURE, "Cannot create tx mbuf pool %d\n", i);
-		tx_mbuf_pools.push_back(tx_pool);
-
-		ret = rte_eth_tx_queue_setup(port_id, i, NUM_MBUFS,
+	for (i = 0; i < nr_tx_queues; i++) {
+		ret = rte_eth_tx_queue_setup(port_id, i, nb_txd,
 				rte_eth_dev_socket_id(port_id),
 				&txq_conf);
 		if (ret < 0) {
@@ -163,6 +186,15 @@ filtering_init_port(uint16_t port_id, uint16_t nr_queues, std::vector<struct rte
 				ret, port_id);
 		}
 	}
+
+	// tx pools: one on the NIC socket and one on each socket with enabled lcores
+	if (mbuf_pools.get(rte_eth_dev_socket_id(port_id), MbufPools::TX) == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create tx mbuf pool\n");
+	unsigned lcore_id;
+	RTE_LCORE_FOREACH(lcore_id) {
+		if (mbuf_pools.get(rte_lcore_to_socket_id(lcore_id), MbufPools::TX) == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create tx mbuf pool\n");
+	}
 	/* >8 End of Configuring RX and TX queues connected to single port. */
 
 	/* Setting the RX port to promiscuous mode. 8< */
@@ -346,38 +378,200 @@ static void lcore_init_checks() {
 
 class Dpdk : public Driver {
 private:
-	const static uint16_t max_queues_per_vm = 4;
+	const static uint16_t max_queues_per_vm = MAX_QUEUES_PER_VM;
 
-	// struct rte_mempool *mbuf_pool;
-	std::vector<struct rte_mempool*> tx_mbuf_pools;
-	std::vector<struct rte_mempool*> rx_mbuf_pools;
+	std::unique_ptr<MbufPools> mbuf_pools; // shared by all queues
 	struct rte_mbuf **bufs; // list of rte_mbuf pointers
-	uint16_t port_id;
+	std::vector<uint16_t> ports; // initialized ports (the bond port replaces its members)
+	std::vector<uint16_t> bond_members; // physical ports aggregated by the bond port
+	std::vector<uint16_t> vm_port; // per VM: port the VM is assigned to
+	std::vector<uint16_t> vm_slot; // per VM: index of the VM among all VMs on its port
 	std::vector<bool> mediate; // per VM
+	std::vector<std::array<uint8_t, 6>> vm_mac; // per VM
+	std::vector<bool> owns_port; // per VM: the only VM on its port
+	std::unique_ptr<std::atomic<bool>[]> rss_mirrored; // per VM: the NIC hashes with the guest's key
+	std::vector<struct rte_flow*> vm_flows; // per VM: steers its MAC to its queues
+	std::vector<std::vector<uint8_t>> vm_flow_keys; // per VM: rss key of its vm_flows rule
+	std::unique_ptr<FlowRules> flow_rules; // steering rules of the guests
+
+	// Broadcast and multicast frames arrive on one VM's queue only. They are
+	// replicated (mbuf refcount) into the rings of the other VMs on the port
+	// that want them and received with their queue 0.
+	std::vector<struct rte_ring*> repl_rings; // per VM
+	std::vector<std::set<uint64_t>> mc_groups; // per VM: joined multicast MACs
+	std::shared_mutex mc_lock; // protects mc_groups
+	std::atomic<uint64_t> repl_drops = 0;
+
+	// Every thread (lcore) gets its own tx queue on every port. The last tx
+	// queue is shared by all threads that didn't get one and is locked.
+	uint16_t tx_queues; // per port
+	std::atomic<uint16_t> next_tx_queue = 0;
+	int32_t lcore_tx_queue[RTE_MAX_LCORE]; // -1: use shared queue
+	rte_spinlock_t shared_tx_queue_lock[RTE_MAX_ETHPORTS];
+
+
+	// get queue id of native queue (on the port of the VM)
+	uint16_t get_rx_queue_id(int vm, int queue) {
+		return this->vm_slot[vm] * this->max_queues_per_vm + queue;
+	}
+
+	uint16_t get_shared_tx_queue_id() {
+		return this->tx_queues - 1;
+	}
 
+	// get the tx queue exclusively owned by the calling lcore (or the shared one)
+	uint16_t get_tx_queue_id() {
+		unsigned lcore = rte_lcore_id();
+		if (lcore >= RTE_MAX_LCORE || this->lcore_tx_queue[lcore] < 0)
+			return this->get_shared_tx_queue_id();
+		return this->lcore_tx_queue[lcore];
+	}
 
-	// get queue id of native queue
-	uint16_t get_rx_queue_id(int vm, int queue) {
-		return vm * this->max_queues_per_vm + queue;
+	void assign_tx_queue(unsigned lcore) {
+		if (this->lcore_tx_queue[lcore] >= 0)
+			return; // a previous thread with this lcore id had one already
+		uint16_t queue = this->next_tx_queue.fetch_add(1);
+		if (queue >= this->get_shared_tx_queue_id()) {
+			printf("WARN: Dpdk: out of tx queues. lcore %u uses the shared tx queue.\n", lcore);
+			return;
+		}
+		this->lcore_tx_queue[lcore] = queue;
+		if_log_level(LOG_INFO, printf("Dpdk: lcore %u (socket %u) uses tx queue %u\n",
+				lcore, rte_lcore_to_socket_id(lcore), queue));
 	}
 
-	uint16_t get_tx_queue_id(int vm, int queue) {
+	// get index into rxBufs/bufs lists (global across all ports)
+	uint16_t get_buf_queue_id(int vm, int queue) {
 		return vm * this->max_queues_per_vm + queue;
 	}
 
+	// the checksums the NIC verified (NONE: the checksum is not correct, but the data is)
+	static uint8_t rx_csum(uint64_t ol_flags) {
+		uint8_t csum = 0;
+		switch (ol_flags & RTE_MBUF_F_RX_IP_CKSUM_MASK) {
+		case RTE_MBUF_F_RX_IP_CKSUM_GOOD:
+		case RTE_MBUF_F_RX_IP_CKSUM_NONE:
+			csum |= VMUX_RX_CSUM_L3_GOOD;
+			break;
+		case RTE_MBUF_F_RX_IP_CKSUM_BAD:
+			csum |= VMUX_RX_CSUM_L3_BAD;
+			break;
+		}
+		switch (ol_flags & RTE_MBUF_F_RX_L4_CKSUM_MASK) {
+		case RTE_MBUF_F_RX_L4_CKSUM_GOOD:
+		case RTE_MBUF_F_RX_L4_CKSUM_NONE:
+			csum |= VMUX_RX_CSUM_L4_GOOD;
+			break;
+		case RTE_MBUF_F_RX_L4_CKSUM_BAD:
+			csum |= VMUX_RX_CSUM_L4_BAD;
+			break;
+		}
+		return csum;
+	}
+
+	static uint64_t mac_key(const uint8_t mac[6]) {
+		uint64_t key = 0;
+		memcpy(&key, mac, 6);
+		return key;
+	}
+
+	// hand copies of the broadcast/multicast frames among bufs to the other VMs on the port
+	void replicate(int vm_id, struct rte_mbuf **bufs, uint16_t nb_rx) {
+		std::shared_lock guard(this->mc_lock);
+		for (uint16_t i = 0; i < nb_rx; i++) {
+			struct rte_ether_hdr *eth = rte_pktmbuf_mtod(bufs[i], struct rte_ether_hdr*);
+			if (likely(!rte_is_multicast_ether_addr(&eth->dst_addr)))
+				continue;
+			bool broadcast = rte_is_broadcast_ether_addr(&eth->dst_addr);
+			uint64_t key = mac_key(eth->dst_addr.addr_bytes);
+			for (size_t vm = 0; vm < this->repl_rings.size(); vm++) {
+				if ((int)vm == vm_id || this->vm_port[vm] != this->vm_port[vm_id])
+					continue;
+				if (!broadcast && !this->mc_groups[vm].contains(key))
+					continue;
+				rte_mbuf_refcnt_update(bufs[i], 1);
+				if (rte_ring_mp_enqueue(this->repl_rings[vm], bufs[i]) != 0) {
+					rte_pktmbuf_free(bufs[i]);
+					uint64_t drops = ++this->repl_drops;
+					if ((drops & (drops - 1)) == 0) // log at powers of two
+						printf("WARN: Dpdk: replication ring of VM %zu full. Dropped %lu packets\n", vm, drops);
+				}
+			}
+		}
+	}
+
+	// port to use for PTP: bonding ports don't do timesync, use the first member
+	uint16_t ptp_port() {
+		if (!this->bond_members.empty())
+			return this->bond_members[0];
+		return this->ports[0];
+	}
+
+	static int parse_bond_mode(const std::string &mode) {
+		if (mode == "802.3ad")
+			return BONDING_MODE_8023AD;
+		if (mode == "balance-xor")
+			return BONDING_MODE_BALANCE;
+		die("Unsupported bonding mode %s. Use 802.3ad or balance-xor.", mode.c_str());
+		return -1;
+	}
+
+	// aggregate all available ports into one bonding port
+	uint16_t create_bond(const std::string &mode) {
+		int bond_mode = parse_bond_mode(mode);
+		uint16_t port;
+		std::vector<uint16_t> members;
+		RTE_ETH_FOREACH_DEV(port)
+			members.push_back(port);
+		if (members.size() < 2)
+			rte_exit(EXIT_FAILURE, "Error: bonding needs at least 2 ports. Have %zu.\n", members.size());
+
+		int bond_port = rte_eth_bond_create("net_bonding_vmux", bond_mode,
+				rte_eth_dev_socket_id(members[0]));
+		if (bond_port < 0)
+			rte_exit(EXIT_FAILURE, "Cannot create bonding port: %s\n", rte_strerror(-bond_port));
+
+		for (uint16_t member : members) {
+#if RTE_VERSION >= RTE_VERSION_NUM(23, 11, 0, 0)
+			int ret = rte_eth_bond_member_add(bond_port, member);
+#else
+			int ret = rte_eth_bond_slave_add(bond_port, member);
+#endif
+			if (ret != 0)
+				rte_exit(EXIT_FAILURE, "Cannot add port %u to bonding port %d\n", member, bond_port);
+			this->bond_members.push_back(member);
+		}
+		// spread flows over members by their L3/L4 headers
+		if (rte_eth_bond_xmit_policy_set(bond_port, BALANCE_XMIT_POLICY_LAYER34) != 0)
+			rte_exit(EXIT_FAILURE, "Cannot set transmit policy of bonding port %d\n", bond_port);
+
+		printf(":: bonded %zu ports into port %d (mode %s)\n", members.size(), bond_port, mode.c_str());
+		return bond_port;
+	}
+
 public:
-	Dpdk(int num_vms, const uint8_t (*mac_addr)[6], int argc, char *argv[]) {
-		this->alloc_rx_lists(this->max_queues_per_vm * num_vms, BURST_SIZE);
+	/**
+	 * num_vms: number of emulated devices served by this driver
+	 * vm_ports: DPDK port each VM is assigned to (default: 0). Ignored when bonding.
+	 * bond_mode: if not empty, aggregate all ports into one bonding port ("802.3ad" or "balance-xor")
+	 */
+	Dpdk(int num_vms, const uint8_t (*mac_addr)[6], std::vector<uint16_t> vm_ports, std::string bond_mode, int argc, char *argv[]) {
+		this->alloc_rx_lists(num_vms, BURST_SIZE);
     this->bufs = (struct rte_mbuf **) malloc(this->max_queues_per_vm * BURST_SIZE * num_vms * sizeof(struct rte_mbuf*));
 		this->mediate = std::vector<bool>(num_vms, false);
+		this->mc_groups.resize(num_vms);
+		for (int vm = 0; vm < num_vms; vm++) {
+			std::array<uint8_t, 6> mac;
+			memcpy(mac.data(), mac_addr, 6);
+			Util::intcrement_mac(mac.data(), vm);
+			this->vm_mac.push_back(mac);
+		}
 
 		/*
  	 	 * The main function, which does initialization and calls the per-lcore
  	 	 * functions.
  	 	 */
-		struct rte_mempool *mbuf_pool;
 		unsigned nb_ports;
-		uint16_t portid;
 
 		/* Initializion the Environment Abstraction Layer (EAL). 8< */
 		int ret = rte_eal_init(argc, argv);
@@ -388,47 +582,83 @@ public:
 		argc -= ret;
 		argv += ret;
 
-		/* Check that there is an even number of ports to send/receive on. */
 		nb_ports = rte_eth_dev_count_avail();
-		if (nb_ports != 1)
-			rte_exit(EXIT_FAILURE, "Error: number of ports must be 1. Is %d.\n", nb_ports);
-
-		/* Creates a new mempool in memory to hold the mbufs. */
-
-		// /* Allocates mempool to hold the mbufs. 8< */
-		// size_t rx_buffers = NUM_MBUFS * nb_ports * num_vms * this->max_queues_per_vm;
-		// size_t tx_buffers = rx_buffers; // TODO remove
-		// mbuf_pool = rte_pktmbuf_pool_create("MBUF_POOL", rx_buffers + tx_buffers ,
-		// 	MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-		// this->mbuf_pool = mbuf_pool;
-		// /* >8 End of allocating mempool to hold mbuf. */
-		//
-		// if (mbuf_pool == NULL)
-		// 	rte_exit(EXIT_FAILURE, "Cannot create mbuf pool\n");
-
-		static uint16_t port_id = 0;
-		static uint16_t nr_queues = num_vms * this->max_queues_per_vm;
+		if (nb_ports < 1)
+			rte_exit(EXIT_FAILURE, "Error: no ports available.\n");
+
+		// assign VMs to ports
+		if (!bond_mode.empty()) {
+			if (!vm_ports.empty())
+				printf("WARN: bonding all ports. Ignoring per VM port assignments.\n");
+			uint16_t bond_port = this->create_bond(bond_mode);
+			vm_ports = std::vector<uint16_t>(num_vms, bond_port);
+		}
+		vm_ports.resize(num_vms, 0); // unassigned VMs use port 0
+		std::map<uint16_t, uint16_t> vms_per_port;
+		for (int vm = 0; vm < num_vms; vm++) {
+			uint16_t port = vm_ports[vm];
+			if (!rte_eth_dev_is_valid_port(port))
+				rte_exit(EXIT_FAILURE, "Error: VM %d assigned to invalid port %u.\n", vm, port);
+			this->vm_port.push_back(port);
+			this->vm_slot.push_back(vms_per_port[port]++);
+		}
+		for (int vm = 0; vm < num_vms; vm++) {
+			std::string name = std::format("vmux_repl_{}", vm);
+			struct rte_ring *ring = rte_ring_create(name.c_str(), 1024,
+					rte_eth_dev_socket_id(this->vm_port[vm]), RING_F_SC_DEQ);
+			if (ring == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot create replication ring: %s\n", rte_strerror(rte_errno));
+			this->repl_rings.push_back(ring);
+		}
+		this->flow_rules = std::make_unique<FlowRules>(this->vm_port);
+		this->rss_mirrored.reset(new std::atomic<bool>[num_vms]);
+		for (int vm = 0; vm < num_vms; vm++) {
+			this->owns_port.push_back(vms_per_port[this->vm_port[vm]] == 1);
+			this->rss_mirrored[vm].store(false);
+		}
+
 		struct rte_flow *flow;
 		struct rte_flow_error error;
-		this->port_id = port_id;
+
+		// tx queues for: up to one rx thread per queue (affinity mode) and one
+		// runner thread per VM, the main lcore and the shared queue
+		this->tx_queues = (this->max_queues_per_vm + 1) * num_vms + 2;
+		for (auto [port_id, nr_vms] : vms_per_port) {
+			struct rte_eth_dev_info dev_info;
+			if (rte_eth_dev_info_get(port_id, &dev_info) == 0)
+				this->tx_queues = std::min(this->tx_queues, dev_info.max_tx_queues);
+		}
+		for (unsigned lcore = 0; lcore < RTE_MAX_LCORE; lcore++)
+			this->lcore_tx_queue[lcore] = -1;
+		for (unsigned port = 0; port < RTE_MAX_ETHPORTS; port++)
+			rte_spinlock_init(&this->shared_tx_queue_lock[port]);
 
 		/* Initializing all ports. 8< */
-		filtering_init_port(port_id, nr_queues, this->rx_mbuf_pools, this->tx_mbuf_pools);
-		// RTE_ETH_FOREACH_DEV(portid)
-		// 	if (port_init(portid, mbuf_pool) != 0)
-		// 		rte_exit(EXIT_FAILURE, "Cannot init port %" PRIu16 "\n",
-		// 				portid);
+		size_t nr_rx_queues = num_vms * this->max_queues_per_vm;
+		size_t nr_tx_queues = vms_per_port.size() * this->tx_queues;
+		// each thread may register as lcore and keep a mempool cache
+		this->mbuf_pools = std::make_unique<MbufPools>(nr_rx_queues, nr_tx_queues, BURST_SIZE,
+				rte_lcore_count() + this->tx_queues);
+		for (auto [port_id, nr_vms] : vms_per_port) {
+			uint16_t nr_queues = nr_vms * this->max_queues_per_vm;
+			filtering_init_port(port_id, nr_queues, this->tx_queues, *this->mbuf_pools, nr_vms == 1);
+			this->ports.push_back(port_id);
+
+			/* closing and releasing resources */
+			ret = rte_flow_flush(port_id, &error);
+			if (ret != 0) {
+				printf("Flow can't be flushed %d message: %s\n",
+					error.type,
+					error.message ? error.message : "(no stated reason)");
+				rte_exit(EXIT_FAILURE, "error in flushing flows");
+			}
+		}
+		if (nb_ports > this->ports.size() + this->bond_members.size())
+			printf("WARN: %u ports available, but only %zu used.\n", nb_ports,
+					this->ports.size() + this->bond_members.size());
 		/* >8 End of initializing all ports. */
 
 		/* Create flow for send packet with. 8< */
-		/* closing and releasing resources */
-		ret = rte_flow_flush(this->port_id, &error);
-		if (ret != 0) {
-			printf("Flow can't be flushed %d message: %s\n",
-				error.type,
-				error.message ? error.message : "(no stated reason)");
-			rte_exit(EXIT_FAILURE, "error in flushing flows");
-		}
 
 #define SRC_IP ((0<<24) + (0<<16) + (0<<8) + 0) /* src ip = 0.0.0.0 */
 #define DEST_IP ((192<<24) + (168<<16) + (1<<8) + 1) /* dest ip = 192.168.1.1 */
@@ -444,11 +674,12 @@ public:
 		// rte_ether_unformat_addr("52:54:00:fa:00:60", &dest_mac);
 		rte_ether_unformat_addr("FF:FF:FF:FF:FF:FF", &dest_mask);
 
-		for (int queue_nb = 0; queue_nb < num_vms; queue_nb++) {
+		for (int vm = 0; vm < num_vms; vm++) {
 			memcpy(&dest_mac, mac_addr, 6);
-			Util::intcrement_mac((uint8_t*)&dest_mac, queue_nb);
+			Util::intcrement_mac((uint8_t*)&dest_mac, vm);
 			// send all VM traffic to the first queue of each VM by default
-			flow = generate_eth_flow(port_id, this->get_rx_queue_id(queue_nb, 0),
+			// (on a bonding port, the PMD installs the rule on all members)
+			flow = generate_eth_flow(this->vm_port[vm], this->get_rx_queue_id(vm, 0),
 						&src_mac, &src_mask,
 						&dest_mac, &dest_mask, &error);
 			/* >8 End of create flow and the flow rule. */
@@ -458,12 +689,42 @@ public:
 				error.message ? error.message : "(no stated reason)");
 			rte_exit(EXIT_FAILURE, "error in creating flow");
 			}
+			this->vm_flows.push_back(flow);
+			this->vm_flow_keys.emplace_back();
 			/* >8 End of creating flow for send packet with. */
 		}
 
 
+		// the main lcore may send as well (if we poll in the main thread)
+		this->assign_tx_queue(rte_lcore_id());
 		if (rte_lcore_count() > 1)
-			printf("\nWARNING: Too many lcores enabled. Only 1 used.\n");
+			printf("\nWARNING: Too many lcores enabled. vMux only uses the main lcore and registers its own threads as lcores.\n");
+	}
+
+	virtual void register_thread() {
+		if (rte_lcore_id() == LCORE_ID_ANY) {
+			if (rte_thread_register() != 0) {
+				printf("WARN: Dpdk: cannot register thread as lcore: %s\n", rte_strerror(rte_errno));
+				return; // use the shared tx queue and no mempool caches
+			}
+		}
+		this->assign_tx_queue(rte_lcore_id());
+
+		// threads may be placed on other sockets than the lcores at init
+		int socket = rte_socket_id();
+		if (socket != SOCKET_ID_ANY && !this->mbuf_pools->exists(socket, MbufPools::TX)) {
+			printf("Dpdk: creating tx mbuf pool for lcore %u on socket %d\n", rte_lcore_id(), socket);
+			this->mbuf_pools->get(socket, MbufPools::TX);
+		}
+	}
+
+	virtual int numa_node(int vm_id) {
+		return rte_eth_dev_socket_id(this->vm_port[vm_id]);
+	}
+
+	virtual void unregister_thread() {
+		// the tx queue stays reserved for the lcore id
+		rte_thread_unregister();
 	}
 
 	virtual ~Dpdk() {
@@ -472,17 +733,27 @@ public:
 		int ret;
 
 		/* closing and releasing resources */
-		rte_flow_flush(this->port_id, &error);
-    	rte_eth_timesync_disable(this->port_id);   
-		
-    	ret = rte_eth_dev_stop(this->port_id);
-	
-  		if (ret < 0) {
-			printf("Failed to stop port %u: %s",
-		       	 this->port_id, rte_strerror(-ret));
-    	}
+		this->mbuf_pools->update_rx_failures(); // for dump_stats(), ports are closed then
+		rte_eth_timesync_disable(this->ptp_port());
+		for (uint16_t port_id : this->ports) {
+			rte_flow_flush(port_id, &error);
+
+			ret = rte_eth_dev_stop(port_id);
+			if (ret < 0) {
+				printf("Failed to stop port %u: %s",
+					port_id, rte_strerror(-ret));
+			}
 
-		rte_eth_dev_close(this->port_id);
+			rte_eth_dev_close(port_id);
+		}
+		for (struct rte_ring *ring : this->repl_rings) {
+			struct rte_mbuf *buf;
+			while (rte_ring_sc_dequeue(ring, (void**)&buf) == 0)
+				rte_pktmbuf_free(buf);
+			rte_ring_free(ring);
+		}
+		this->mbuf_pools->dump_stats();
+		this->mbuf_pools.reset();
 		/* clean up the EAL */
 		rte_eal_cleanup();
 	}
@@ -499,97 +770,127 @@ public:
 
 	virtual void send(int vm_id, const char *buf, const size_t len) {
 		// lcore_init_checks(); ignore cpu locality for now
-		uint16_t port;
-		RTE_ETH_FOREACH_DEV(port) {
-			// prepare packet buffer
-			uint16_t queue = this->get_tx_queue_id(vm_id, 0);
-			struct rte_mbuf *pkt;
-			pkt = rte_pktmbuf_alloc(this->tx_mbuf_pools[queue]);
-			if (pkt == NULL) {
-				printf("WARN: Dpdk::send: alloc failed\n");
-				return; // drop packet
-			}
-			pkt->data_len = len;
-			pkt->pkt_len = len;
-			pkt->nb_segs = 1;
+		uint16_t port = this->vm_port[vm_id];
+
+		// prepare packet buffer
+		uint16_t queue = this->get_tx_queue_id();
+		struct rte_mbuf *pkt;
+		int socket = rte_socket_id();
+		if (socket == SOCKET_ID_ANY || !this->mbuf_pools->exists(socket, MbufPools::TX))
+			socket = rte_eth_dev_socket_id(port);
+		pkt = this->mbuf_pools->alloc_tx(socket);
+		if (pkt == NULL) {
+			return; // drop packet (counted and reported by alloc_tx)
+		}
+		pkt->data_len = len;
+		pkt->pkt_len = len;
+		pkt->nb_segs = 1;
 
-			// TODO	
-			pkt->ol_flags |= RTE_MBUF_F_TX_IEEE1588_TMST; 
+		// TODO	
+		pkt->ol_flags |= RTE_MBUF_F_TX_IEEE1588_TMST; 
+	
+		copy_buf_to_pkt((void*)buf, len, pkt, 0);
 		
-			copy_buf_to_pkt((void*)buf, len, pkt, 0);
-			
-			/* Send burst of TX packets. */
-			const uint16_t nb_tx = rte_eth_tx_burst(port, queue,
-					&pkt, 1);
-			if (nb_tx != 1) {
-				printf("\nWARNING: Sending packet failed. \n");
-			}
-			if_log_level(LOG_DEBUG, printf("send: "));
-			if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
-
-			/* Free packets. */
+		/* Send burst of TX packets. */
+		bool shared = queue == this->get_shared_tx_queue_id();
+		if (unlikely(shared))
+			rte_spinlock_lock(&this->shared_tx_queue_lock[port]);
+		const uint16_t nb_tx = rte_eth_tx_burst(port, queue,
+				&pkt, 1);
+		if (unlikely(shared))
+			rte_spinlock_unlock(&this->shared_tx_queue_lock[port]);
+		if_log_level(LOG_DEBUG, printf("send: "));
+		if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+		/* The PMD frees sent packets. Free unsent ones. */
+		if (nb_tx != 1) {
+			printf("\nWARNING: Sending packet failed. \n");
 			rte_pktmbuf_free(pkt);
 		}
 	}
 
 	// each recv(vm) call must be followed up with a recv_consumed(vm) call. No other VMs may receive in between. Otherwise it is unclear which VM owns which buffers
   virtual void recv(int vm_id) {
+		for (int q_idx = 0; q_idx < this->max_queues_per_vm; q_idx++)
+			this->recv_queue(vm_id, q_idx);
+  }
+
+  virtual void recv_queue(int vm_id, uint16_t q_idx) {
 		// lcore_init_checks(); ignore cpu locality for now
-		uint16_t port = 0;
+		uint16_t port = this->vm_port[vm_id];
+		this->mbuf_pools->check_watermarks();
 
 		/*
 	 	 * Receive packets on a port and forward them on the same
 	 	 * port.
 	 	 */
-		for (int q_idx = 0; q_idx < this->max_queues_per_vm; q_idx++) {
-			int queue_id = this->get_rx_queue_id(vm_id, q_idx);
+		int queue_id = this->get_rx_queue_id(vm_id, q_idx);
+		int buf_queue = this->get_buf_queue_id(vm_id, q_idx);
 
-			/* Get burst of RX packets, from first port of pair. */
-			const uint16_t nb_rx = rte_eth_rx_burst(port, queue_id,
-					&(this->bufs[queue_id * BURST_SIZE]), BURST_SIZE);
+		/* Get burst of RX packets, from first port of pair. */
+		struct rte_mbuf **bufs = &(this->bufs[buf_queue * BURST_SIZE]);
+		uint16_t nb_rx = rte_eth_rx_burst(port, queue_id, bufs, BURST_SIZE);
+		bool steered = this->flow_rules->steers(vm_id, q_idx, nb_rx < BURST_SIZE);
+		// frames replicated from other VMs were hashed with their key
+		uint16_t nb_hashed = this->rss_mirrored[vm_id].load(std::memory_order_relaxed) ? nb_rx : 0;
+		if (nb_rx > 0 && this->repl_rings.size() > 1)
+			this->replicate(vm_id, bufs, nb_rx);
+
+		// frames other VMs received for us
+		if (q_idx == 0 && nb_rx < BURST_SIZE)
+			nb_rx += rte_ring_sc_dequeue_burst(this->repl_rings[vm_id],
+					(void**)&bufs[nb_rx], BURST_SIZE - nb_rx, NULL);
 
-			if (unlikely(nb_rx == 0))
-				continue;
-				// continue;
-
-			// pass pointers to packet buffers via rxBufs to behavioral model
-			for (uint16_t i = queue_id * BURST_SIZE; i < (queue_id * BURST_SIZE + nb_rx); i++) {
-				struct rte_mbuf* buf = this->bufs[i]; // we checked before that there is at least one packet
-				char* pkt = rte_pktmbuf_mtod(buf, char*);
-				if (buf->nb_segs != 1)
-					die("This rx buffer has multiple segments. Unimplemented.");
-				if (buf->pkt_len >= this->MAX_BUF)
-					die("Cant handle packets of size %d", buf->pkt_len);
-				// rte_memcpy(this->rxBufs[i], pkt, buf->pkt_len);
-				this->rxBufs[i] = pkt;
-				this->rxBuf_used[i] = buf->pkt_len;
-				if (this->mediate[vm_id]) {
-					this->rxBuf_queue[i] = q_idx;
-				} else {
-					// make the behavioral model emulate the switching
-					this->rxBuf_queue[i] = {};
-				}
-				if_log_level(LOG_DEBUG, printf("recv queue %d: ", queue_id));
-				if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[i], this->rxBuf_used[i]));
+		if (unlikely(nb_rx == 0))
+			return;
+
+		// pass pointers to packet buffers via rxBufs to behavioral model
+		for (uint16_t i = buf_queue * BURST_SIZE; i < (buf_queue * BURST_SIZE + nb_rx); i++) {
+			bool hashed = i - buf_queue * BURST_SIZE < nb_hashed;
+			struct rte_mbuf* buf = this->bufs[i]; // we checked before that there is at least one packet
+			char* pkt = rte_pktmbuf_mtod(buf, char*);
+			if (buf->nb_segs != 1)
+				die("This rx buffer has multiple segments. Unimplemented.");
+			if (buf->pkt_len >= this->MAX_BUF)
+				die("Cant handle packets of size %d", buf->pkt_len);
+			// rte_memcpy(this->rxBufs[i], pkt, buf->pkt_len);
+			this->rxBufs[i] = pkt;
+			this->rxBuf_used[i] = buf->pkt_len;
+			this->rxBuf_ptype[i] = buf->packet_type;
+			this->rxBuf_hash[i] = hashed && (buf->ol_flags & RTE_MBUF_F_RX_RSS_HASH) ? buf->hash.rss : 0;
+			this->rxBuf_csum[i] = rx_csum(buf->ol_flags);
+			if (steered) {
+				this->rxBuf_queue[i] = q_idx;
+			} else {
+				// make the behavioral model emulate the switching (also while
+				// rules of a mediated VM don't fit into the NIC)
+				this->rxBuf_queue[i] = {};
 			}
-			this->nb_bufs_used[queue_id] = nb_rx;
+			if_log_level(LOG_DEBUG, printf("recv port %u queue %d: ", port, queue_id));
+			if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[i], this->rxBuf_used[i]));
 		}
+		this->nb_bufs_used[buf_queue] = nb_rx;
   }
 
   virtual void recv_consumed(int vm_id) {
+		for (int q_idx = 0; q_idx < this->max_queues_per_vm; q_idx++)
+			this->recv_consumed_queue(vm_id, q_idx);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t q_idx) {
     // free pkt
-		for (int q_idx = 0; q_idx < this->max_queues_per_vm; q_idx++) {
-			int queue_id = this->get_rx_queue_id(vm_id, q_idx);
-			for (uint16_t i = queue_id * BURST_SIZE; i < (queue_id * BURST_SIZE + this->nb_bufs_used[queue_id]); i++) {
-				rte_pktmbuf_free(this->bufs[i]);
-			}
-			this->nb_bufs_used[queue_id] = 0;
+		int buf_queue = this->get_buf_queue_id(vm_id, q_idx);
+		for (uint16_t i = buf_queue * BURST_SIZE; i < (buf_queue * BURST_SIZE + this->nb_bufs_used[buf_queue]); i++) {
+			rte_pktmbuf_free(this->bufs[i]);
 		}
+		this->nb_bufs_used[buf_queue] = 0;
   }
  
+  // PTP: the emulated port 0 is backed by ptp_port(). Ports of one E810 share their clock.
+
   /* Enables Timesync / PTP */
-  virtual void enableTimesync(uint16_t port) {
-	uint32_t retval = rte_eth_timesync_enable(port);
+  virtual void enableTimesync(uint16_t _port) {
+	int retval = rte_eth_timesync_enable(this->ptp_port());
 	if (retval < 0) {
 		perror("Could not enable Timesync");
 	}
@@ -599,17 +900,17 @@ public:
   struct timespec readCurrentTimestamp() {
 
 	struct timespec ts = { .tv_sec=0, .tv_nsec=0 };
-    if(rte_eth_timesync_read_time(0, &ts)) {
+    if(rte_eth_timesync_read_time(this->ptp_port(), &ts)) {
 		perror("Dpdk current time failed!");
 	}
     
 	return ts;
   }
 
-  uint64_t readTxTimestamp(uint16_t portid) {
+  uint64_t readTxTimestamp(uint16_t _portid) {
 	struct timespec ts = { .tv_sec=0, .tv_nsec=0 };
 
-	if(rte_eth_timesync_read_tx_timestamp(portid, &ts)) {
+	if(rte_eth_timesync_read_tx_timestamp(this->ptp_port(), &ts)) {
 		perror("Dpdk TX timestamp failed!");
 	}
 
@@ -618,10 +919,10 @@ public:
 	return tstamp;
   };
   
-  uint64_t readRxTimestamp(uint16_t portid) {
+  uint64_t readRxTimestamp(uint16_t _portid) {
 	struct timespec ts = { .tv_sec=0, .tv_nsec=0 };
 
-	if(rte_eth_timesync_read_rx_timestamp(portid, &ts, 0)) {
+	if(rte_eth_timesync_read_rx_timestamp(this->ptp_port(), &ts, 0)) {
 		perror("Dpdk RX timestamp failed!");
 	}
 
@@ -632,52 +933,188 @@ public:
   };
 
   virtual bool add_switch_rule(int vm_id, uint8_t dst_addr[6], uint16_t dst_queue) {
-  	if (!this->mediate[vm_id]) {
-  		// for emulation we ignore switch rules.
-  		// Because we don't send queue hints to the behavioral model, it emulates the switch then.
-  		return true;
-  	}
+		struct vmux_flow_rule rule;
+		rule.dst_mac.emplace();
+		memcpy(rule.dst_mac->data(), dst_addr, 6);
+		rule.queue = dst_queue;
+		return this->add_flow_rule(vm_id, rule);
+  }
 
-  	printf("dpdk add switch rule\n");
+  // the rule as installed for vm_id: rules without a MAC match the VM's MAC
+  struct vmux_flow_rule vm_rule(int vm_id, const struct vmux_flow_rule &guest_rule) {
+		struct vmux_flow_rule rule = guest_rule;
+		if (!rule.dst_mac)
+			rule.dst_mac = this->vm_mac[vm_id];
+		return rule;
+  }
 
-		struct rte_flow_error error;
-  		struct rte_flow* flow;
-		struct rte_ether_addr src_mac;
-		struct rte_ether_addr src_mask;
-		struct rte_ether_addr dest_mac;
-		struct rte_ether_addr dest_mask;
-		char fmt[20];
-		uint16_t queue_id = this->get_rx_queue_id(vm_id, dst_queue);
+  /*
+   * Several VMs share a port, so a VM's rule must not catch frames of other
+   * VMs: rules without a destination MAC only match the VM's own MAC, and
+   * the MACs of other VMs on the port are refused.
+   * Rules of VMs that are not mediated are kept until they are.
+   */
+  virtual bool add_flow_rule(int vm_id, const struct vmux_flow_rule &guest_rule) {
+		uint16_t port_id = this->vm_port[vm_id];
+		FlowRules::Rule rule;
+		rule.rule = this->vm_rule(vm_id, guest_rule);
+		if (guest_rule.dst_mac && !(rule.rule.dst_mac->at(0) & 1)) {
+			for (size_t vm = 0; vm < this->vm_mac.size(); vm++) {
+				if ((int)vm != vm_id && this->vm_port[vm] == port_id && this->vm_mac[vm] == *rule.rule.dst_mac) {
+					printf("WARN: Dpdk: VM %d may not steer the MAC of VM %zu\n", vm_id, vm);
+					return false;
+				}
+			}
+		}
 
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mac);
-		rte_ether_unformat_addr("00:00:00:00:00:00", &src_mask);
-		// rte_ether_unformat_addr("52:54:00:fa:00:60", &dest_mac);
-		rte_ether_unformat_addr("FF:FF:FF:FF:FF:FF", &dest_mask);
+		// guest queues -> queues of the VM on the port
+		uint16_t first = guest_rule.nr_queues == 0 ? 0 : guest_rule.queue;
+		uint16_t nb_queues = guest_rule.nr_queues == 0 ? this->max_queues_per_vm : guest_rule.nr_queues;
+		if (first >= this->max_queues_per_vm) {
+			printf("WARN: Dpdk: VM %d steers to queue %u, but only has %u\n", vm_id, first, this->max_queues_per_vm);
+			return false;
+		}
+		nb_queues = std::min<uint16_t>(nb_queues, this->max_queues_per_vm - first);
+		for (uint16_t q = 0; q < nb_queues; q++)
+			rule.queues.push_back(this->get_rx_queue_id(vm_id, first + q));
 
-		memcpy(dest_mac.addr_bytes, dst_addr, 6);
-		flow = generate_eth_flow(port_id, queue_id,
-					&src_mac, &src_mask,
-					&dest_mac, &dest_mask, &error);
-		if (!flow) {
-			printf("Flow can't be created %d message: %s\n",
-				error.type,
-				error.message ? error.message : "(no stated reason)");
+		this->flow_rules->add(vm_id, rule);
+		return true; // the nic or the model steers it
+  }
+
+  virtual bool del_flow_rule(int vm_id, const struct vmux_flow_rule &guest_rule) {
+		return this->flow_rules->del(vm_id, this->vm_rule(vm_id, guest_rule));
+  }
+
+  virtual bool add_multicast(int vm_id, uint8_t mac_addr[6]) {
+		uint16_t port_id = this->vm_port[vm_id];
+		std::vector<struct rte_ether_addr> addrs;
+		{
+			std::unique_lock guard(this->mc_lock);
+			this->mc_groups[vm_id].insert(mac_key(mac_addr));
+			std::set<uint64_t> port_groups; // of all VMs on the port
+			for (size_t vm = 0; vm < this->mc_groups.size(); vm++) {
+				if (this->vm_port[vm] == port_id)
+					port_groups.insert(this->mc_groups[vm].begin(), this->mc_groups[vm].end());
+			}
+			for (uint64_t key : port_groups) {
+				struct rte_ether_addr addr;
+				memcpy(addr.addr_bytes, &key, 6);
+				addrs.push_back(addr);
+			}
+		}
+
+		// let the NIC accept the groups (or all multicast if its filter is too small)
+		int ret = rte_eth_dev_set_mc_addr_list(port_id, addrs.data(), addrs.size());
+		if (ret != 0) {
+			ret = rte_eth_allmulticast_enable(port_id);
+			if (ret != 0) {
+				printf("WARN: Dpdk: port %u cannot receive multicast: %s\n", port_id, rte_strerror(-ret));
+				return false;
+			}
+		}
+		return true;
+  }
+
+  /**
+   * The NIC hashes with the guest's key and spreads frames without rte_flow
+   * rule with its lut. Key and redirection table belong to the port, so only
+   * a VM that has its port to itself gets them. On shared ports, the rule
+   * steering the VM's MAC spreads over its queues with the guest's key
+   * instead, and the model applies the lut (see set_vm_flow_rss).
+   */
+  virtual bool set_rss(int vm_id, const uint8_t *key, size_t key_len, const uint8_t *lut, size_t lut_len) {
+		uint16_t port = this->vm_port[vm_id];
+		struct rte_eth_dev_info dev_info;
+		if (rte_eth_dev_info_get(port, &dev_info) != 0 || dev_info.hash_key_size == 0)
+			return false;
+		if (!this->owns_port[vm_id])
+			return this->set_vm_flow_rss(vm_id, key, std::min<size_t>(key_len, dev_info.hash_key_size));
+
+		std::vector<uint8_t> port_key(key, key + std::min<size_t>(key_len, dev_info.hash_key_size));
+		struct rte_eth_rss_conf conf;
+		memset(&conf, 0, sizeof(conf));
+		conf.rss_key = port_key.data();
+		conf.rss_key_len = port_key.size();
+		conf.rss_hf = RSS_TYPES & dev_info.flow_type_rss_offloads;
+		int ret = rte_eth_dev_rss_hash_update(port, &conf);
+		this->rss_mirrored[vm_id].store(ret == 0);
+		if (ret != 0) {
+			printf("WARN: Dpdk: cannot set the rss key of port %u: %s. Hashing in software\n", port, rte_strerror(-ret));
 			return false;
 		}
-		rte_ether_format_addr(fmt, sizeof(fmt), &dest_mac);
-  	printf("added rule dst_mac %s -> queue %d\n", fmt, queue_id);
 
-  	return true;
+		if (lut_len > 0 && dev_info.reta_size > 0) {
+			// the guest's lut repeated over the (power of two sized) table
+			std::vector<struct rte_eth_rss_reta_entry64> reta(
+					(dev_info.reta_size + RTE_ETH_RETA_GROUP_SIZE - 1) / RTE_ETH_RETA_GROUP_SIZE);
+			memset(reta.data(), 0, reta.size() * sizeof(reta[0]));
+			for (uint16_t i = 0; i < dev_info.reta_size; i++) {
+				struct rte_eth_rss_reta_entry64 &group = reta[i / RTE_ETH_RETA_GROUP_SIZE];
+				group.mask |= 1ULL << (i % RTE_ETH_RETA_GROUP_SIZE);
+				group.reta[i % RTE_ETH_RETA_GROUP_SIZE] =
+					this->get_rx_queue_id(vm_id, lut[i % lut_len] % this->max_queues_per_vm);
+			}
+			ret = rte_eth_dev_rss_reta_update(port, reta.data(), dev_info.reta_size);
+			if (ret != 0)
+				printf("WARN: Dpdk: cannot set the redirection table of port %u: %s\n", port, rte_strerror(-ret));
+		}
+		return true;
   }
 
+  /**
+   * Replaces the rule steering the VM's MAC to its first queue with one
+   * spreading over all of its queues by rss with the guest's key. The NIC
+   * doesn't know the guest's lut, so frames land on a queue the lut may not
+   * pick. The model takes the NIC's hash and applies the lut.
+   */
+  bool set_vm_flow_rss(int vm_id, const uint8_t *key, size_t key_len) {
+		if (this->max_queues_per_vm < 2)
+			return false;
+		std::vector<uint8_t> new_key(key, key + key_len);
+		if (this->rss_mirrored[vm_id].load() && new_key == this->vm_flow_keys[vm_id])
+			return true; // only the lut changed
+		uint16_t port = this->vm_port[vm_id];
+		struct vmux_flow_rule rule;
+		rule.dst_mac = this->vm_mac[vm_id];
+		std::vector<uint16_t> queues;
+		for (int q_idx = 0; q_idx < this->max_queues_per_vm; q_idx++)
+			queues.push_back(this->get_rx_queue_id(vm_id, q_idx));
+		struct rte_flow_error error;
+
+		// both rules match the same frames, so the old one goes first
+		this->rss_mirrored[vm_id].store(false);
+		if (this->vm_flows[vm_id] != NULL)
+			rte_flow_destroy(port, this->vm_flows[vm_id], &error);
+		this->vm_flows[vm_id] = generate_flow(port, rule, queues.data(), queues.size(), &error,
+				key, key_len, RSS_TYPES);
+		if (this->vm_flows[vm_id] != NULL) {
+			this->vm_flow_keys[vm_id] = new_key;
+			this->rss_mirrored[vm_id].store(true);
+			return true;
+		}
+		printf("WARN: Dpdk: cannot spread the frames of VM %d by rss: %s. Hashing in software\n", vm_id,
+				error.message ? error.message : "(no stated reason)");
+		this->vm_flows[vm_id] = generate_flow(port, rule, queues.data(), 1, &error);
+		if (this->vm_flows[vm_id] == NULL)
+			printf("WARN: Dpdk: cannot steer the frames of VM %d to it anymore: %s\n", vm_id,
+					error.message ? error.message : "(no stated reason)");
+		return false;
+  }
+
+  // may be called while the VM runs: frames received before are still
+  // steered in software (see FlowRules)
   virtual bool mediation_enable(int vm_id) {
 		this->mediate[vm_id] = true;
+		this->flow_rules->set_hardware(vm_id, true);
 		return true;
   }
 
+  // the model steers the VM's frames again. It has all rules of the guest.
   virtual bool mediation_disable(int vm_id) {
-		// die("unimplemented: you need to flush switch rules from the emulator to the device");
-		return false;
+		this->mediate[vm_id] = false;
+		this->flow_rules->set_hardware(vm_id, false);
+		return true;
   }
 
   virtual bool is_mediating(int vm_id) {
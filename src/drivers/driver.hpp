@@ -1,9 +1,13 @@
 #pragma once
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <optional>
+#include <vector>
 #include "util.hpp"
+#include "src/drivers/queues.h"
 
 struct vmux_descriptor {
   char *buf;
@@ -11,29 +15,92 @@ struct vmux_descriptor {
   std::optional<uint16_t> dst_queue;
 };
 
+// Work the device model leaves to the driver (see Driver::send_offload())
+struct vmux_tx_offload {
+  uint16_t queue = 0; // tx queue of the guest
+  bool l4_csum = false; // the l4 checksum field holds the pseudo header sum only
+  uint16_t csum_start = 0; // offset of the l4 header
+  uint16_t csum_offset = 0; // offset of the checksum field in the l4 header
+  uint16_t tso_mss = 0; // if non-zero: segment this TCP/IPv4 unit with this mss
+  uint16_t hdr_len = 0; // l2 + l3 + l4 headers (tso only)
+};
+
+// Checksums of a received frame the NIC (or host kernel) verified (rxBuf_csum).
+// The device model verifies the ones that are not set itself.
+enum vmux_rx_csum : uint8_t {
+  VMUX_RX_CSUM_L3_GOOD = 1 << 0, // ipv4 header (ipv6: the NIC parsed the header)
+  VMUX_RX_CSUM_L3_BAD = 1 << 1,
+  VMUX_RX_CSUM_L4_GOOD = 1 << 2, // tcp or udp
+  VMUX_RX_CSUM_L4_BAD = 1 << 3,
+  VMUX_RX_CSUM_L3 = VMUX_RX_CSUM_L3_GOOD | VMUX_RX_CSUM_L3_BAD,
+  VMUX_RX_CSUM_L4 = VMUX_RX_CSUM_L4_GOOD | VMUX_RX_CSUM_L4_BAD,
+};
+
+// A steering rule of the guest (see Driver::add_flow_rule()). Unset fields match anything.
+struct vmux_flow_rule {
+  std::optional<std::array<uint8_t, 6>> dst_mac;
+  std::optional<uint16_t> vlan; // vlan id of the outer tag
+  std::optional<uint16_t> ethertype; // after the vlan tag
+  uint8_t ip_version = 0; // 4 or 6, 0: don't match ip
+  uint8_t src_ip[16] = {}; // network byte order (ipv4: first 4 bytes)
+  uint8_t dst_ip[16] = {};
+  uint8_t src_prefix = 0; // bits of src_ip to match
+  uint8_t dst_prefix = 0;
+  uint8_t l4_proto = 0; // ip protocol (ports for IPPROTO_TCP and IPPROTO_UDP), 0: don't match l4
+  std::optional<uint16_t> src_port;
+  std::optional<uint16_t> dst_port;
+  // action: the guest queues queue .. queue + nr_queues - 1 (spread by rss),
+  // nr_queues = 0: all queues of the guest
+  uint16_t queue = 0;
+  uint16_t nr_queues = 1;
+  bool drop = false; // instead: drop the frames
+
+  bool operator==(const vmux_flow_rule &other) const = default;
+
+  // matches nothing but the destination mac
+  bool mac_only() const {
+    return dst_mac && !vlan && !ethertype && ip_version == 0 && l4_proto == 0 && !drop;
+  }
+};
+
 // Abstract class for Driver backends
 class Driver {
 public:
   static const int MAX_BUF = 9000; // should be enough even for most jumboframes
+  static const int MAX_QUEUES_PER_VM = VMUX_MAX_QUEUES_PER_VM;
 
   int fd = 0; // may be a non-null fd to poll on
+  std::vector<int> queue_fds; // may be one fd per queue to poll on (instead of fd)
   size_t nb_bufs = 0; // rxBufs allocated
+  size_t per_queue_bufs = 0; // rxBufs per queue
+  size_t nr_vms = 0; // VMs the rx lists are for
   // struct vmux_descriptor **bufs; //
   // TODO revise this: !!!
   size_t *nb_bufs_used; // rxBufs filled with data (per queue, value must be <= BURST_SIZE) (size=global queues)
   char **rxBufs; // size=global_queues * BUSRT_SIZE
   size_t *rxBuf_used; // how much each rxBuf is actually filled with data (size=global_queues * BURST_SIZE)
   std::optional<uint16_t> *rxBuf_queue; // optional hints to destination queues (size=global_queues * BURST_SIZE)
+  uint32_t *rxBuf_ptype; // packet type (RTE_PTYPE_*) if the NIC classified the packet, else 0 (size=global_queues * BURST_SIZE)
+  uint32_t *rxBuf_hash; // rss hash if the NIC computed it with the key given to set_rss(), else 0 (size=global_queues * BURST_SIZE)
+  uint8_t *rxBuf_csum; // vmux_rx_csum flags, 0: not verified (size=global_queues * BURST_SIZE)
   char txFrame[MAX_BUF];
 
-  void alloc_rx_lists(size_t global_queues, size_t per_queue_bursts) {
+  // rx lists for MAX_QUEUES_PER_VM queues of each of vms VMs. A driver that
+  // serves a single VM (vms = 1) uses the same lists for whatever its vm_id.
+  void alloc_rx_lists(size_t vms, size_t per_queue_bursts) {
+    size_t global_queues = vms * MAX_QUEUES_PER_VM;
+    this->nr_vms = vms;
     this->nb_bufs_used = (size_t*) calloc(global_queues, sizeof(size_t));
     size_t nb_bufs = global_queues * per_queue_bursts;
     this->nb_bufs = nb_bufs;
+    this->per_queue_bufs = per_queue_bursts;
     this->rxBufs = (char**) malloc(nb_bufs * sizeof(char*));
     this->rxBuf_used = (size_t*) calloc(nb_bufs, sizeof(size_t));
     this->rxBuf_queue = (std::optional<uint16_t>*) malloc(nb_bufs * sizeof(std::optional<uint16_t>));
     this->rxBuf_queue = new std::optional<uint16_t>[nb_bufs]();
+    this->rxBuf_ptype = (uint32_t*) calloc(nb_bufs, sizeof(uint32_t));
+    this->rxBuf_hash = (uint32_t*) calloc(nb_bufs, sizeof(uint32_t));
+    this->rxBuf_csum = (uint8_t*) calloc(nb_bufs, sizeof(uint8_t));
     if (!this->rxBufs)
       die("Cannot allocate rxBufs");
   }
@@ -48,10 +115,49 @@ public:
     }
   }
 
+  // Called by every thread that may call send/recv, before it does so, and
+  // once it is done. Drivers can set up per-thread state (e.g. DPDK lcores).
+  virtual void register_thread() {};
+  virtual void unregister_thread() {};
+
+  // NUMA node of the NIC serving vm_id. -1 if unknown.
+  virtual int numa_node(int vm_id) { return -1; };
+
   // vm_id can be used to serve multiple VMs with one single driver
   virtual void send(int vm_id, const char *buf, const size_t len) = 0;
+  // Drivers may batch what send() got until the device calls flush() (e.g.
+  // after processing a TX doorbell).
+  virtual void flush(int vm_id) {};
   virtual void recv(int vm_id) = 0;
   virtual void recv_consumed(int vm_id) = 0;
+
+  // Like recv/recv_consumed, but only for one queue of vm_id. Queues of a VM
+  // may be polled by different threads. Drivers with a single queue per VM
+  // serve everything on queue 0.
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue == 0)
+      this->recv(vm_id);
+  };
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue == 0)
+      this->recv_consumed(vm_id);
+  };
+
+  // Index into nb_bufs_used of queue of vm_id. Its rxBufs start at
+  // rx_buf_queue() * per_queue_bufs.
+  virtual size_t rx_buf_queue(int vm_id, uint16_t queue) {
+    return (this->nr_vms > 1 ? vm_id : 0) * MAX_QUEUES_PER_VM + queue;
+  }
+
+  // true if send_offload() can be used for vm_id
+  virtual bool tx_offloads(int vm_id) {
+    return false;
+  }
+
+  virtual void send_offload(int vm_id, const char *buf, const size_t len,
+                            const struct vmux_tx_offload &offload) {
+    die("This driver does not support tx offloads");
+  }
   
   // PTP
   virtual void enableTimesync(uint16_t port) {};
@@ -64,6 +170,35 @@ public:
     return false;
   }
 
+  // Steer frames matching rule to queues of vm_id. Drivers that can only
+  // steer by mac get the rules that match only the mac.
+  // Return false if the rule can't be installed.
+  virtual bool add_flow_rule(int vm_id, const struct vmux_flow_rule &rule) {
+    if (!rule.mac_only() || rule.nr_queues != 1)
+      return false;
+    uint8_t mac[6];
+    memcpy(mac, rule.dst_mac->data(), 6);
+    return this->add_switch_rule(vm_id, mac, rule.queue);
+  }
+
+  // Remove a rule added with add_flow_rule(). Return false if it isn't installed.
+  virtual bool del_flow_rule(int vm_id, const struct vmux_flow_rule &rule) {
+    return false;
+  }
+
+  // The guest of vm_id hashes received frames with key and spreads them
+  // over its queues with lut (empty: not set yet). Return false if the
+  // driver doesn't hash with the key of the guest.
+  virtual bool set_rss(int vm_id, const uint8_t *key, size_t key_len, const uint8_t *lut, size_t lut_len) {
+    return false;
+  }
+
+  // The guest of vm_id wants frames to the multicast (or broadcast) address
+  // mac_addr. Return false if the driver doesn't replicate multicast.
+  virtual bool add_multicast(int vm_id, uint8_t mac_addr[6]) {
+    return false;
+  }
+
   virtual bool mediation_enable(int vm_id) {
     return false;
   }
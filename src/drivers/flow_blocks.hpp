@@ -6,6 +6,8 @@
 #include <cstdint>
 #include <rte_flow.h>
 #include <rte_ether.h>
+#include <netinet/in.h>
+#include "src/drivers/driver.hpp"
 
 #define MAX_PATTERN_NUM		3
 #define MAX_ACTION_NUM		2
@@ -199,3 +201,181 @@ generate_eth_flow(uint16_t port_id, uint16_t rx_q,
 
 	return flow;
 }
+
+#define MAX_RULE_PATTERN_NUM	6 /* eth, vlan, ip, l4, end */
+
+// mask of the first prefix bits of a len byte address
+static void prefix_mask(uint8_t *mask, size_t len, uint8_t prefix)
+{
+	for (size_t i = 0; i < len; i++) {
+		int bits = prefix - (int)i * 8;
+		mask[i] = bits >= 8 ? 0xff : bits > 0 ? (uint8_t)(0xff << (8 - bits)) : 0;
+	}
+}
+
+/**
+ * create a flow rule that sends packets matching a guest steering rule to
+ * queues[0] (or spreads them over all queues by rss, or drops them).
+ *
+ * @param port_id
+ *   The selected port.
+ * @param rule
+ *   What to match. Unset fields match anything.
+ * @param queues
+ *   The target queues (on port_id).
+ * @param nb_queues
+ *   Number of queues.
+ * @param[out] error
+ *   Perform verbose error reporting if not NULL.
+ * @param rss_key
+ *   Key to spread over the queues with (rss_key_len bytes), NULL: the
+ *   port's key.
+ * @param rss_types
+ *   Flows to spread over the queues.
+ *
+ * @return
+ *   A flow if the rule could be created else return NULL.
+ */
+struct rte_flow *
+generate_flow(uint16_t port_id, const struct vmux_flow_rule &rule,
+		const uint16_t *queues, uint16_t nb_queues,
+		struct rte_flow_error *error,
+		const uint8_t *rss_key = NULL, uint32_t rss_key_len = 0,
+		uint64_t rss_types = RTE_ETH_RSS_IP | RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP)
+{
+	struct rte_flow_attr attr;
+	struct rte_flow_item pattern[MAX_RULE_PATTERN_NUM];
+	struct rte_flow_action action[MAX_ACTION_NUM];
+	struct rte_flow *flow = NULL;
+	struct rte_flow_action_queue queue = { .index = queues[0] };
+	struct rte_flow_action_rss rss;
+	struct rte_flow_item_eth eth_spec, eth_mask;
+	struct rte_flow_item_vlan vlan_spec, vlan_mask;
+	struct rte_flow_item_ipv4 ipv4_spec, ipv4_mask;
+	struct rte_flow_item_ipv6 ipv6_spec, ipv6_mask;
+	struct rte_flow_item_tcp tcp_spec, tcp_mask;
+	struct rte_flow_item_udp udp_spec, udp_mask;
+	int p = 0;
+	int res;
+
+	memset(pattern, 0, sizeof(pattern));
+	memset(action, 0, sizeof(action));
+	memset(&attr, 0, sizeof(struct rte_flow_attr));
+	attr.ingress = 1;
+
+	if (rule.drop) {
+		action[0].type = RTE_FLOW_ACTION_TYPE_DROP;
+	} else if (nb_queues > 1) {
+		memset(&rss, 0, sizeof(rss));
+		rss.func = RTE_ETH_HASH_FUNCTION_DEFAULT;
+		rss.types = rss_types;
+		rss.key = rss_key;
+		rss.key_len = rss_key ? rss_key_len : 0;
+		rss.queue_num = nb_queues;
+		rss.queue = queues;
+		action[0].type = RTE_FLOW_ACTION_TYPE_RSS;
+		action[0].conf = &rss;
+	} else {
+		action[0].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+		action[0].conf = &queue;
+	}
+	action[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+	// l2: the ethertype is matched by the last l2 item
+	memset(&eth_spec, 0, sizeof(eth_spec));
+	memset(&eth_mask, 0, sizeof(eth_mask));
+	if (rule.dst_mac) {
+		memcpy(eth_spec.dst.addr_bytes, rule.dst_mac->data(), RTE_ETHER_ADDR_LEN);
+		memset(eth_mask.dst.addr_bytes, 0xff, RTE_ETHER_ADDR_LEN);
+	}
+	pattern[p].type = RTE_FLOW_ITEM_TYPE_ETH;
+	pattern[p].spec = &eth_spec;
+	pattern[p++].mask = &eth_mask;
+	rte_be16_t *ether_type_spec = &eth_spec.type;
+	rte_be16_t *ether_type_mask = &eth_mask.type;
+	if (rule.vlan) {
+		memset(&vlan_spec, 0, sizeof(vlan_spec));
+		memset(&vlan_mask, 0, sizeof(vlan_mask));
+		vlan_spec.tci = rte_cpu_to_be_16(*rule.vlan);
+		vlan_mask.tci = rte_cpu_to_be_16(0x0fff);
+		pattern[p].type = RTE_FLOW_ITEM_TYPE_VLAN;
+		pattern[p].spec = &vlan_spec;
+		pattern[p++].mask = &vlan_mask;
+		ether_type_spec = &vlan_spec.inner_type;
+		ether_type_mask = &vlan_mask.inner_type;
+	}
+	if (rule.ethertype) {
+		*ether_type_spec = rte_cpu_to_be_16(*rule.ethertype);
+		*ether_type_mask = 0xffff;
+	}
+
+	// l3
+	if (rule.ip_version == 4) {
+		memset(&ipv4_spec, 0, sizeof(ipv4_spec));
+		memset(&ipv4_mask, 0, sizeof(ipv4_mask));
+		memcpy(&ipv4_spec.hdr.src_addr, rule.src_ip, 4);
+		memcpy(&ipv4_spec.hdr.dst_addr, rule.dst_ip, 4);
+		prefix_mask((uint8_t *)&ipv4_mask.hdr.src_addr, 4, rule.src_prefix);
+		prefix_mask((uint8_t *)&ipv4_mask.hdr.dst_addr, 4, rule.dst_prefix);
+		if (rule.l4_proto) {
+			ipv4_spec.hdr.next_proto_id = rule.l4_proto;
+			ipv4_mask.hdr.next_proto_id = 0xff;
+		}
+		pattern[p].type = RTE_FLOW_ITEM_TYPE_IPV4;
+		pattern[p].spec = &ipv4_spec;
+		pattern[p++].mask = &ipv4_mask;
+	} else if (rule.ip_version == 6) {
+		memset(&ipv6_spec, 0, sizeof(ipv6_spec));
+		memset(&ipv6_mask, 0, sizeof(ipv6_mask));
+		memcpy(&ipv6_spec.hdr.src_addr, rule.src_ip, 16);
+		memcpy(&ipv6_spec.hdr.dst_addr, rule.dst_ip, 16);
+		prefix_mask((uint8_t *)&ipv6_mask.hdr.src_addr, 16, rule.src_prefix);
+		prefix_mask((uint8_t *)&ipv6_mask.hdr.dst_addr, 16, rule.dst_prefix);
+		if (rule.l4_proto) {
+			ipv6_spec.hdr.proto = rule.l4_proto;
+			ipv6_mask.hdr.proto = 0xff;
+		}
+		pattern[p].type = RTE_FLOW_ITEM_TYPE_IPV6;
+		pattern[p].spec = &ipv6_spec;
+		pattern[p++].mask = &ipv6_mask;
+	}
+
+	// l4
+	if (rule.ip_version != 0 && rule.l4_proto == IPPROTO_TCP) {
+		memset(&tcp_spec, 0, sizeof(tcp_spec));
+		memset(&tcp_mask, 0, sizeof(tcp_mask));
+		if (rule.src_port) {
+			tcp_spec.hdr.src_port = rte_cpu_to_be_16(*rule.src_port);
+			tcp_mask.hdr.src_port = 0xffff;
+		}
+		if (rule.dst_port) {
+			tcp_spec.hdr.dst_port = rte_cpu_to_be_16(*rule.dst_port);
+			tcp_mask.hdr.dst_port = 0xffff;
+		}
+		pattern[p].type = RTE_FLOW_ITEM_TYPE_TCP;
+		pattern[p].spec = &tcp_spec;
+		pattern[p++].mask = &tcp_mask;
+	} else if (rule.ip_version != 0 && rule.l4_proto == IPPROTO_UDP) {
+		memset(&udp_spec, 0, sizeof(udp_spec));
+		memset(&udp_mask, 0, sizeof(udp_mask));
+		if (rule.src_port) {
+			udp_spec.hdr.src_port = rte_cpu_to_be_16(*rule.src_port);
+			udp_mask.hdr.src_port = 0xffff;
+		}
+		if (rule.dst_port) {
+			udp_spec.hdr.dst_port = rte_cpu_to_be_16(*rule.dst_port);
+			udp_mask.hdr.dst_port = 0xffff;
+		}
+		pattern[p].type = RTE_FLOW_ITEM_TYPE_UDP;
+		pattern[p].spec = &udp_spec;
+		pattern[p++].mask = &udp_mask;
+	}
+
+	pattern[p].type = RTE_FLOW_ITEM_TYPE_END;
+
+	res = rte_flow_validate(port_id, &attr, pattern, action, error);
+	if (!res)
+		flow = rte_flow_create(port_id, &attr, pattern, action, error);
+
+	return flow;
+}
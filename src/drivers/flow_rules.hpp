@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <rte_errno.h>
+#include <rte_ether.h>
+#include <rte_flow.h>
+#include "src/drivers/driver.hpp"
+#include "src/drivers/flow_blocks.hpp"
+
+/**
+ * The steering rules of every VM of the Dpdk driver and the rte_flow rules
+ * they are installed as.
+ *
+ * Each VM has a desired set of rules (its guest's rules, without duplicates),
+ * whether it is mediated or not. While a VM is mediated (in hardware), sync()
+ * installs the desired rules that are not installed yet, otherwise it
+ * removes the installed ones. Adding and removing single rules only touches
+ * that rule.
+ *
+ * The NIC may reject a rule (pattern not supported) or run out of entries.
+ * The rule stays desired and the VM falls back to software steering: the
+ * driver passes no queue hints anymore and the device model classifies all
+ * frames of the VM with its own copy of the rules (frames still arrive on
+ * the VM's queues by its MAC rule). Once all rules of the VM are installed
+ * again, the NIC steers. So a VM never loses steering because of rule churn.
+ *
+ * When the NIC takes over steering, the VM's queues may still hold frames that
+ * were received before (by the MAC rule, on queue 0). Every queue is classified
+ * in software until a burst found it drained.
+ *
+ * Capacity is learned: when a port runs out of entries, we don't try to
+ * install more rules on it until one of its rules is removed.
+ */
+class FlowRules {
+public:
+  struct Rule {
+    struct vmux_flow_rule rule; // as installed (dst_mac set)
+    std::vector<uint16_t> queues; // on the port of the VM
+    struct rte_flow *flow = NULL; // NULL: not installed
+    bool rejected = false; // the NIC can't install the rule. Don't try again
+  };
+
+private:
+  struct Vm {
+    uint16_t port = 0;
+    bool hardware = false; // install the rules
+    std::vector<Rule> rules; // desired
+  };
+
+  std::mutex lock; // protects vms, installed and capacity
+  std::vector<Vm> vms;
+  std::unique_ptr<std::atomic<bool>[]> steering; // per VM: the NIC steers all rules
+  std::unique_ptr<std::atomic<uint32_t>[]> draining; // per VM: bit q set: queue q not drained since
+  std::vector<size_t> installed; // per port
+  std::vector<size_t> capacity; // per port, SIZE_MAX: not known
+
+  bool install(Rule &r, uint16_t port) {
+    if (r.rejected || this->installed[port] >= this->capacity[port])
+      return false;
+    struct rte_flow_error error;
+    r.flow = generate_flow(port, r.rule, r.queues.data(), r.queues.size(), &error);
+    if (!r.flow) {
+      if (rte_errno == ENOSPC || rte_errno == ENOMEM) {
+        printf("WARN: FlowRules: port %u is full after %zu rules. Steering in software\n",
+            port, this->installed[port]);
+        this->capacity[port] = this->installed[port];
+      } else {
+        printf("WARN: FlowRules: port %u rejects a rule (%d: %s). Steering in software\n",
+            port, error.type, error.message ? error.message : "(no stated reason)");
+        r.rejected = true;
+      }
+      return false;
+    }
+    this->installed[port]++;
+
+    char fmt[RTE_ETHER_ADDR_FMT_SIZE];
+    rte_ether_format_addr(fmt, sizeof(fmt), (struct rte_ether_addr*)r.rule.dst_mac->data());
+    printf("added rule dst_mac %s vlan %d ethertype 0x%x ipv%u proto %u -> port %u queue %u (+%zu)%s\n",
+        fmt, r.rule.vlan ? *r.rule.vlan : -1, r.rule.ethertype.value_or(0), r.rule.ip_version,
+        r.rule.l4_proto, port, r.queues[0], r.queues.size() - 1, r.rule.drop ? " drop" : "");
+    return true;
+  }
+
+  void uninstall(Rule &r, uint16_t port) {
+    if (!r.flow)
+      return;
+    struct rte_flow_error error;
+    if (rte_flow_destroy(port, r.flow, &error) != 0)
+      printf("WARN: FlowRules: cannot remove a rule from port %u: %s\n", port,
+          error.message ? error.message : "(no stated reason)");
+    r.flow = NULL;
+    this->installed[port]--;
+    this->capacity[port] = SIZE_MAX; // there may be room again
+  }
+
+  void set_steering(int vm, bool on) {
+    if (on && !this->steering[vm].load())
+      this->draining[vm].store(UINT32_MAX);
+    this->steering[vm].store(on);
+  }
+
+  // install or remove the rules of vm to match its mode
+  void sync(int vm) {
+    Vm &v = this->vms[vm];
+    bool all = v.hardware;
+    for (Rule &r : v.rules) {
+      if (!v.hardware)
+        this->uninstall(r, v.port);
+      else if (!r.flow && !this->install(r, v.port))
+        all = false;
+    }
+    this->set_steering(vm, all);
+  }
+
+  // give the rules of other VMs on port that didn't fit another chance
+  void sync_port(uint16_t port) {
+    for (size_t vm = 0; vm < this->vms.size(); vm++) {
+      if (this->vms[vm].port == port && this->vms[vm].hardware && !this->steering[vm].load())
+        this->sync(vm);
+    }
+  }
+
+public:
+  // vm_port: port of each VM
+  FlowRules(const std::vector<uint16_t> &vm_port)
+    : vms(vm_port.size()), steering(new std::atomic<bool>[vm_port.size()]),
+      draining(new std::atomic<uint32_t>[vm_port.size()]) {
+    uint16_t nr_ports = 0;
+    for (size_t vm = 0; vm < vm_port.size(); vm++) {
+      this->vms[vm].port = vm_port[vm];
+      this->steering[vm].store(false);
+      this->draining[vm].store(0);
+      nr_ports = std::max<uint16_t>(nr_ports, vm_port[vm] + 1);
+    }
+    this->installed.resize(nr_ports, 0);
+    this->capacity.resize(nr_ports, SIZE_MAX);
+  }
+
+  // Returns false if the rule is desired already
+  bool add(int vm, const Rule &rule) {
+    std::lock_guard guard(this->lock);
+    Vm &v = this->vms[vm];
+    for (const Rule &r : v.rules) {
+      if (r.rule == rule.rule)
+        return false;
+    }
+    v.rules.push_back(rule);
+    v.rules.back().flow = NULL;
+    if (v.hardware) {
+      bool installed = this->install(v.rules.back(), v.port);
+      if (!installed)
+        this->set_steering(vm, false);
+    }
+    return true;
+  }
+
+  // Returns false if the rule is not desired
+  bool del(int vm, const struct vmux_flow_rule &rule) {
+    std::lock_guard guard(this->lock);
+    Vm &v = this->vms[vm];
+    for (auto r = v.rules.begin(); r != v.rules.end(); r++) {
+      if (r->rule == rule) {
+        bool freed = r->flow != NULL;
+        this->uninstall(*r, v.port);
+        v.rules.erase(r);
+        if (v.hardware)
+          this->sync(vm); // the removed rule may have been the one that didn't fit
+        if (freed)
+          this->sync_port(v.port);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // install (hardware) or remove all rules of vm
+  void set_hardware(int vm, bool hardware) {
+    std::lock_guard guard(this->lock);
+    this->vms[vm].hardware = hardware;
+    this->sync(vm);
+    if (!hardware)
+      this->sync_port(this->vms[vm].port);
+  }
+
+  /**
+   * The frames of a burst from queue q of vm may stay on the queue the NIC
+   * steered them to: all rules of vm are installed and the queue was drained
+   * since. drained: this burst emptied the queue.
+   */
+  bool steers(int vm, uint16_t q, bool drained) {
+    if (!this->steering[vm].load(std::memory_order_acquire)) // draining is set before
+      return false;
+    uint32_t bit = 1u << q;
+    if (this->draining[vm].load(std::memory_order_relaxed) & bit) {
+      if (drained)
+        this->draining[vm].fetch_and(~bit);
+      return false;
+    }
+    return true;
+  }
+};
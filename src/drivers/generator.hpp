@@ -0,0 +1,437 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Synthetic traffic for a single VM, so throughput and latency can be
+ * measured without an external load generator.
+ *
+ * Configured with a comma separated spec, e.g.
+ * "udp,flows=64,size=64,pps=1000000,reflect":
+ * - udp/tcp: generate IPv4 frames of this protocol into RX. Flows differ in
+ *   their source port. pps=0 generates as fast as the device takes them.
+ * - reflect: hand every frame the guest sends back to it with MACs swapped.
+ *
+ * Every generated frame carries a stamp (flow, per-flow sequence number,
+ * CLOCK_REALTIME at generation) at the start of its payload. A guest with a
+ * synchronized clock can compute one-way latency from it. Stamped frames
+ * the guest sends back (e.g. testpmd in macswap mode) are accounted for
+ * here: round trip latency, lost and reordered frames.
+ *
+ * Queue 0 generates (timerfd), queue 1 reflects (eventfd). fd combines both
+ * for devices that don't poll per queue.
+ */
+class Generator : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const uint32_t REFLECT_SLOTS = 256;
+  static const uint32_t STAMP_MAGIC = 0x584d5556; // "VUMX" in memory
+
+  struct stamp {
+    uint32_t magic;
+    uint32_t flow;
+    uint64_t seq;
+    uint64_t tx_ns; // CLOCK_REALTIME
+  } __attribute__((packed));
+
+private:
+  static const uint16_t GEN_QUEUE = 0;
+  static const uint16_t REFLECT_QUEUE = 1;
+  static constexpr uint8_t SRC_MAC[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  // spec
+  int proto = 0; // IPPROTO_UDP, IPPROTO_TCP or 0 for no generation
+  uint32_t flows = 1;
+  uint32_t size = 64; // frame size without FCS
+  uint64_t pps = 0;
+  bool reflect = false;
+
+  // generation
+  int timer_fd = -1;
+  std::vector<std::vector<char>> templates; // per flow
+  std::vector<uint64_t> seqs; // per flow
+  std::vector<char> gen_bufs; // BURST_SIZE frames
+  uint64_t start_ns = 0;
+  uint64_t generated = 0;
+
+  // reflection: single producer (send) single consumer (recv) ring
+  int reflect_fd = -1;
+  std::vector<char> reflect_bufs; // REFLECT_SLOTS * MAX_BUF
+  uint32_t reflect_len[REFLECT_SLOTS];
+  std::atomic<uint32_t> reflect_head = 0; // written by send
+  std::atomic<uint32_t> reflect_tail = 0; // written by recv_consumed
+  uint32_t reflect_held = 0;
+  uint64_t reflect_drops = 0;
+
+  // accounting of stamped frames sent back by the guest. Runner thread only.
+  std::vector<uint64_t> next_seqs; // per flow
+  uint64_t returned = 0;
+  uint64_t lost = 0;
+  uint64_t reordered = 0;
+  uint64_t lat_min_ns = UINT64_MAX;
+  uint64_t lat_max_ns = 0;
+  uint64_t lat_sum_ns = 0;
+  uint64_t last_report_ns = 0;
+
+  static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+  }
+
+  static uint32_t csum_add(uint32_t sum, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (; len > 1; p += 2, len -= 2)
+      sum += (p[0] << 8) | p[1];
+    if (len)
+      sum += p[0] << 8;
+    return sum;
+  }
+
+  size_t l4_hdr_len() {
+    return this->proto == IPPROTO_TCP ? sizeof(struct tcphdr) : sizeof(struct udphdr);
+  }
+
+  size_t payload_offset() {
+    return sizeof(struct ethhdr) + sizeof(struct iphdr) + this->l4_hdr_len();
+  }
+
+  // parses a decimal number up to max into value. False if it is not one.
+  static bool parse_number(const std::string &str, uint64_t max, uint64_t &value) {
+    if (str.empty() || str[0] < '0' || str[0] > '9')
+      return false;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(str.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || v > max)
+      return false;
+    value = v;
+    return true;
+  }
+
+  int parse_spec(const char *spec) {
+    std::string s(spec);
+    size_t pos = 0;
+    while (pos <= s.size()) {
+      size_t end = s.find(',', pos);
+      if (end == std::string::npos)
+        end = s.size();
+      std::string opt = s.substr(pos, end - pos);
+      pos = end + 1;
+      uint64_t value;
+      if (opt == "udp")
+        this->proto = IPPROTO_UDP;
+      else if (opt == "tcp")
+        this->proto = IPPROTO_TCP;
+      else if (opt == "reflect")
+        this->reflect = true;
+      else if (opt.rfind("flows=", 0) == 0 && parse_number(opt.substr(6), 65535 - 1024, value) && value > 0)
+        this->flows = value; // source ports 1024 + flow
+      else if (opt.rfind("size=", 0) == 0 && parse_number(opt.substr(5), MAX_BUF, value))
+        this->size = value;
+      else if (opt.rfind("pps=", 0) == 0 && parse_number(opt.substr(4), UINT64_MAX, value))
+        this->pps = value;
+      else
+        return -EINVAL;
+    }
+    return 0;
+  }
+
+  void build_templates(const uint8_t dst_mac[6]) {
+    size_t min_size = this->payload_offset() + sizeof(struct stamp);
+    if (this->size < min_size) {
+      printf("WARN: Generator: frames need %zu bytes for headers and stamp. Raising size from %u.\n", min_size, this->size);
+      this->size = min_size;
+    }
+
+    for (uint32_t flow = 0; flow < this->flows; flow++) {
+      std::vector<char> frame(this->size, 0);
+      struct ethhdr *eth = (struct ethhdr *)frame.data();
+      memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+      memcpy(eth->h_source, SRC_MAC, ETH_ALEN);
+      eth->h_proto = htons(ETH_P_IP);
+
+      struct iphdr *ip = (struct iphdr *)(eth + 1);
+      ip->version = 4;
+      ip->ihl = 5;
+      ip->tot_len = htons(this->size - sizeof(struct ethhdr));
+      ip->ttl = 64;
+      ip->protocol = this->proto;
+      ip->saddr = htonl(0x0a000001); // 10.0.0.1
+      ip->daddr = htonl(0x0a000002); // 10.0.0.2
+      ip->check = htons(csum_fold(csum_add(0, ip, sizeof(*ip))));
+
+      uint16_t sport = htons(1024 + flow);
+      uint16_t dport = htons(9); // discard
+      if (this->proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+        tcp->source = sport;
+        tcp->dest = dport;
+        tcp->doff = sizeof(*tcp) / 4;
+        tcp->ack = 1;
+        tcp->psh = 1;
+        tcp->window = htons(65535);
+      } else {
+        struct udphdr *udp = (struct udphdr *)(ip + 1);
+        udp->source = sport;
+        udp->dest = dport;
+        udp->len = htons(this->size - sizeof(struct ethhdr) - sizeof(struct iphdr));
+        udp->check = 0; // none
+      }
+      this->templates.push_back(std::move(frame));
+    }
+    this->seqs.assign(this->flows, 0);
+    this->next_seqs.assign(this->flows, 0);
+    this->gen_bufs.resize((size_t)BURST_SIZE * this->size);
+  }
+
+  // copy the template of flow into buf and stamp it
+  void generate(char *buf, uint32_t flow, uint64_t now) {
+    memcpy(buf, this->templates[flow].data(), this->size);
+    uint64_t seq = this->seqs[flow]++;
+    struct stamp st = { STAMP_MAGIC, flow, seq, now };
+    memcpy(buf + this->payload_offset(), &st, sizeof(st));
+    if (this->proto == IPPROTO_TCP) {
+      struct iphdr *ip = (struct iphdr *)(buf + sizeof(struct ethhdr));
+      struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+      tcp->seq = htonl((uint32_t)seq);
+      size_t tcp_len = this->size - sizeof(struct ethhdr) - sizeof(struct iphdr);
+      uint32_t sum = csum_add(0, &ip->saddr, 8);
+      sum += IPPROTO_TCP + tcp_len;
+      tcp->check = htons(csum_fold(csum_add(sum, tcp, tcp_len)));
+    }
+  }
+
+  uint64_t due_ns(uint64_t frame) {
+    if (this->pps == 0)
+      return this->start_ns;
+    return this->start_ns + frame * 1000000000 / this->pps;
+  }
+
+  void arm_timer(uint64_t at_ns) {
+    struct itimerspec its = {};
+    its.it_value.tv_sec = at_ns / 1000000000;
+    its.it_value.tv_nsec = at_ns % 1000000000;
+    if (timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      die("Cannot arm generator timer");
+  }
+
+  // account for a stamped frame the guest sent back
+  void account(const char *buf, size_t len) {
+    if (len < this->payload_offset() + sizeof(struct stamp))
+      return;
+    const struct ethhdr *eth = (const struct ethhdr *)buf;
+    const struct iphdr *ip = (const struct iphdr *)(eth + 1);
+    if (eth->h_proto != htons(ETH_P_IP) || ip->ihl != 5 || ip->protocol != this->proto)
+      return;
+    struct stamp st;
+    memcpy(&st, buf + this->payload_offset(), sizeof(st));
+    if (st.magic != STAMP_MAGIC || st.flow >= this->flows)
+      return;
+
+    uint64_t now = clock_ns(CLOCK_REALTIME);
+    uint64_t lat = now > st.tx_ns ? now - st.tx_ns : 0;
+    this->lat_min_ns = std::min(this->lat_min_ns, lat);
+    this->lat_max_ns = std::max(this->lat_max_ns, lat);
+    this->lat_sum_ns += lat;
+    this->returned++;
+    uint64_t &next = this->next_seqs[st.flow];
+    if (st.seq >= next) {
+      this->lost += st.seq - next;
+      next = st.seq + 1;
+    } else {
+      this->reordered++;
+      if (this->lost > 0)
+        this->lost--; // was counted as lost before
+    }
+
+    if (now - this->last_report_ns >= 1000000000) {
+      this->last_report_ns = now;
+      if_log_level(LOG_INFO, this->report());
+    }
+  }
+
+  void report() {
+    printf(":: generator: generated %lu, returned %lu, lost %lu, reordered %lu", this->generated, this->returned,
+           this->lost, this->reordered);
+    if (this->returned > 0)
+      printf(", rtt min/avg/max %.1f/%.1f/%.1f us", this->lat_min_ns / 1e3,
+             this->lat_sum_ns / 1e3 / this->returned, this->lat_max_ns / 1e3);
+    printf(", reflected %lu dropped\n", this->reflect_drops);
+  }
+
+public:
+  Generator() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs point into gen_bufs/reflect_bufs
+  }
+
+  virtual ~Generator() {
+    this->report();
+    if (this->timer_fd >= 0)
+      close(this->timer_fd);
+    if (this->reflect_fd >= 0)
+      close(this->reflect_fd);
+    if (this->fd > 0)
+      close(this->fd);
+    this->queue_fds.clear();
+  }
+
+  /**
+   * Start generating/reflecting as described by spec towards the VM with
+   * MAC dst_mac.
+   */
+  int open_generator(const char *spec, const uint8_t dst_mac[6]) {
+    if (this->parse_spec(spec) < 0)
+      return -EINVAL;
+    this->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->fd < 0)
+      return -errno;
+
+    this->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    this->reflect_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->timer_fd < 0 || this->reflect_fd < 0)
+      return -errno;
+    for (int qfd : { this->timer_fd, this->reflect_fd }) {
+      struct epoll_event e = {};
+      e.events = EPOLLIN;
+      if (epoll_ctl(this->fd, EPOLL_CTL_ADD, qfd, &e) < 0)
+        return -errno;
+      this->queue_fds.push_back(qfd);
+    }
+
+    if (this->reflect)
+      this->reflect_bufs.resize((size_t)REFLECT_SLOTS * MAX_BUF);
+    if (this->proto != 0) {
+      this->build_templates(dst_mac);
+      this->start_ns = clock_ns(CLOCK_MONOTONIC);
+      this->arm_timer(this->start_ns);
+    }
+    printf(":: generator: %s\n", spec);
+    return 0;
+  }
+
+  // the VM's runner thread is the only sender
+  void send(int vm_id, const char *buf, const size_t len) {
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+    if (this->proto != 0)
+      this->account(buf, len);
+    if (!this->reflect || len < sizeof(struct ethhdr))
+      return;
+
+    uint32_t head = this->reflect_head.load(std::memory_order_relaxed);
+    if (head - this->reflect_tail.load(std::memory_order_acquire) == REFLECT_SLOTS) {
+      this->reflect_drops++;
+      return;
+    }
+    uint32_t slot = head % REFLECT_SLOTS;
+    char *frame = this->reflect_bufs.data() + (size_t)slot * MAX_BUF;
+    size_t n = std::min<size_t>(len, MAX_BUF);
+    memcpy(frame, buf, n);
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    uint8_t tmp[ETH_ALEN];
+    memcpy(tmp, eth->h_dest, ETH_ALEN);
+    memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(eth->h_source, tmp, ETH_ALEN);
+    this->reflect_len[slot] = n;
+    this->reflect_head.store(head + 1, std::memory_order_release);
+  }
+
+  // wake up the reflection queue once per TX doorbell
+  virtual void flush(int vm_id) {
+    if (!this->reflect || this->reflect_head.load() == this->reflect_tail.load())
+      return;
+    uint64_t one = 1;
+    if (write(this->reflect_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      die("Cannot signal reflection");
+  }
+
+  void recv(int vm_id) {
+    this->recv_queue(vm_id, GEN_QUEUE);
+    this->recv_queue(vm_id, REFLECT_QUEUE);
+  }
+
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue >= MAX_QUEUES_PER_VM)
+      return;
+    uint64_t events;
+    size_t first = queue * this->per_queue_bufs;
+    size_t nb = 0;
+    if (queue == GEN_QUEUE && this->proto != 0) {
+      if (read(this->timer_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+        die("Cannot read generator timer");
+      uint64_t now = clock_ns(CLOCK_MONOTONIC);
+      uint64_t tx_ns = clock_ns(CLOCK_REALTIME);
+      while (nb < this->per_queue_bufs && this->due_ns(this->generated) <= now) {
+        char *buf = this->gen_bufs.data() + nb * this->size;
+        this->generate(buf, this->generated % this->flows, tx_ns);
+        this->rxBufs[first + nb] = buf;
+        this->rxBuf_used[first + nb] = this->size;
+        this->rxBuf_queue[first + nb] = {}; // the model does the rss
+        this->generated++;
+        nb++;
+      }
+      // fires right away if we are behind
+      this->arm_timer(this->due_ns(this->generated));
+    } else if (queue == REFLECT_QUEUE && this->reflect) {
+      if (read(this->reflect_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+        die("Cannot read reflection eventfd");
+      uint32_t tail = this->reflect_tail.load(std::memory_order_relaxed);
+      uint32_t head = this->reflect_head.load(std::memory_order_acquire);
+      while (nb < this->per_queue_bufs && tail + nb != head) {
+        uint32_t slot = (tail + nb) % REFLECT_SLOTS;
+        this->rxBufs[first + nb] = this->reflect_bufs.data() + (size_t)slot * MAX_BUF;
+        this->rxBuf_used[first + nb] = this->reflect_len[slot];
+        this->rxBuf_queue[first + nb] = {};
+        nb++;
+      }
+      this->reflect_held = nb;
+      if (tail + nb != head) {
+        // there is more: come back right away
+        uint64_t one = 1;
+        if (write(this->reflect_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+          die("Cannot signal reflection");
+      }
+    }
+    this->nb_bufs_used[queue] = nb;
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    this->recv_consumed_queue(vm_id, GEN_QUEUE);
+    this->recv_consumed_queue(vm_id, REFLECT_QUEUE);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue == REFLECT_QUEUE && this->reflect_held > 0) {
+      this->reflect_tail.fetch_add(this->reflect_held, std::memory_order_release);
+      this->reflect_held = 0;
+    }
+    if (queue < MAX_QUEUES_PER_VM)
+      this->nb_bufs_used[queue] = 0;
+  }
+};
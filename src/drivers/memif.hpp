@@ -0,0 +1,467 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * memif client: connects to a memif socket (DPDK net_memif in server role,
+ * VPP, libmemif) and serves a single VM, like Tap.
+ *
+ * The VM gets one memif region holding all rings and buffers, and one ring
+ * pair per guest queue. Every ring has exactly one producer and one consumer,
+ * so no locks are needed as long as only the VM's runner thread sends.
+ *
+ * - RX (server to client rings): frames are handed to the device as pointers
+ *   into the region. recv_consumed() gives the buffers back to the server by
+ *   moving the ring head. Chained (jumbo) frames are copied together.
+ * - TX (client to server ring 0): frames are written into the buffers of
+ *   free descriptors; the server is interrupted once per TX doorbell
+ *   (flush()), unless it polls.
+ *
+ * We wait on the interrupt eventfds of the rx rings.
+ */
+class Memif : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const uint8_t LOG2_RING_SIZE = 10; // at most, if the server allows it
+  static const uint32_t BUF_SIZE = 2048; // like DPDK net_memif
+
+private:
+  static const uint16_t VERSION = (2 << 8) | 0;
+  static const uint32_t COOKIE = 0x3E31F20;
+  static const uint16_t RING_FLAG_MASK_INT = 1;
+  static const uint16_t DESC_FLAG_NEXT = 1;
+  static const uint16_t RING_S2M = 1; // add_ring flag: client to server
+
+  enum MsgType {
+    ACK = 1,
+    HELLO = 2,
+    INIT = 3,
+    ADD_REGION = 4,
+    ADD_RING = 5,
+    CONNECT = 6,
+    CONNECTED = 7,
+    DISCONNECT = 8,
+  };
+
+  struct msg_hello {
+    uint8_t name[32];
+    uint16_t min_version;
+    uint16_t max_version;
+    uint16_t max_region;
+    uint16_t max_m2s_ring;
+    uint16_t max_s2m_ring;
+    uint8_t max_log2_ring_size;
+  } __attribute__((packed));
+  struct msg_init {
+    uint16_t version;
+    uint32_t id;
+    uint8_t mode; // 0: ethernet
+    uint8_t secret[24];
+    uint8_t name[32];
+  } __attribute__((packed));
+  struct msg_add_region {
+    uint16_t index;
+    uint64_t size;
+  } __attribute__((packed));
+  struct msg_add_ring {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t region;
+    uint32_t offset;
+    uint8_t log2_ring_size;
+    uint16_t private_hdr_size;
+  } __attribute__((packed));
+  struct msg_connect {
+    uint8_t if_name[32];
+  } __attribute__((packed));
+  struct msg_disconnect {
+    uint32_t code;
+    uint8_t string[96];
+  } __attribute__((packed));
+  struct msg {
+    uint16_t type;
+    union {
+      struct msg_hello hello;
+      struct msg_init init;
+      struct msg_add_region add_region;
+      struct msg_add_ring add_ring;
+      struct msg_connect connect;
+      struct msg_disconnect disconnect;
+    };
+  } __attribute__((packed, aligned(128)));
+
+  struct desc {
+    uint16_t flags;
+    uint16_t region;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t metadata;
+  } __attribute__((packed));
+  struct ring {
+    uint32_t cookie;
+    uint16_t flags;
+    uint16_t head;
+    uint8_t pad0[56];
+    uint16_t tail;
+    uint8_t pad1[62];
+    struct desc desc[0];
+  };
+
+  struct Queue {
+    struct ring *ring;
+    int int_fd;
+    uint16_t last_tail = 0; // rx: next used slot. tx: slots freed by the server
+    uint16_t nb_held = 0; // rx: slots handed out by the last recv
+    unsigned pending = 0; // tx: made available since the last interrupt
+    char scratch[MAX_BUF]; // rx: chained frames are assembled here
+  };
+
+  int sock = -1;
+  int mem_fd = -1;
+  char *mem = NULL;
+  size_t mem_len = 0;
+  uint16_t nr_queues = 0;
+  uint16_t ring_size = 0;
+  std::vector<std::unique_ptr<Queue>> rxqs; // server to client
+  std::vector<std::unique_ptr<Queue>> txqs; // client to server
+
+  size_t ring_len() {
+    return sizeof(struct ring) + (size_t)this->ring_size * sizeof(struct desc);
+  }
+
+  char *data(const struct desc &d) {
+    return this->mem + d.offset;
+  }
+
+  int send_msg(const struct msg &m, int fd = -1) {
+    struct iovec iov = { .iov_base = (void *)&m, .iov_len = sizeof(m) };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+      mh.msg_control = control;
+      mh.msg_controllen = sizeof(control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(this->sock, &mh, 0) != sizeof(m))
+      return -errno;
+    return 0;
+  }
+
+  int recv_msg(struct msg &m, uint16_t type) {
+    if (::recv(this->sock, &m, sizeof(m), MSG_WAITALL) != sizeof(m))
+      return -EIO;
+    if (m.type == DISCONNECT) {
+      printf("WARN: Memif: server disconnected: %.96s\n", m.disconnect.string);
+      return -ECONNREFUSED;
+    }
+    if (m.type != type)
+      return -EPROTO;
+    return 0;
+  }
+
+  // send m and wait for the server's ack
+  int request(const struct msg &m, int fd = -1) {
+    struct msg reply;
+    int err = this->send_msg(m, fd);
+    if (err < 0)
+      return err;
+    return this->recv_msg(reply, ACK);
+  }
+
+  /**
+   * Region layout: all s2m rings, all m2s rings, then one buffer per
+   * descriptor in the same order.
+   */
+  void init_region() {
+    size_t rings_len = 2 * this->nr_queues * this->ring_len();
+    size_t bufs_len = 2 * this->nr_queues * (size_t)this->ring_size * BUF_SIZE;
+    this->mem_len = rings_len + bufs_len;
+    this->mem_fd = memfd_create("vmux-memif", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (this->mem_fd < 0 || ftruncate(this->mem_fd, this->mem_len) < 0)
+      die("Cannot create memif region");
+    void *mem = mmap(NULL, this->mem_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->mem_fd, 0);
+    if (mem == MAP_FAILED)
+      die("Cannot map memif region");
+    this->mem = (char *)mem;
+
+    for (uint16_t r = 0; r < 2 * this->nr_queues; r++) {
+      auto q = std::make_unique<Queue>();
+      q->ring = (struct ring *)(this->mem + r * this->ring_len());
+      q->ring->cookie = COOKIE;
+      q->ring->flags = 0; // we want rx interrupts
+      q->ring->head = 0;
+      q->ring->tail = 0;
+      for (uint16_t slot = 0; slot < this->ring_size; slot++) {
+        struct desc &d = q->ring->desc[slot];
+        d.region = 0;
+        d.offset = rings_len + ((size_t)r * this->ring_size + slot) * BUF_SIZE;
+        d.length = BUF_SIZE;
+        d.flags = 0;
+      }
+      q->int_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (q->int_fd < 0)
+        die("Cannot create eventfd");
+      if (r < this->nr_queues)
+        this->txqs.push_back(std::move(q));
+      else
+        this->rxqs.push_back(std::move(q));
+    }
+  }
+
+  int add_ring(Queue &q, uint16_t flags, uint16_t index) {
+    struct msg m = {};
+    m.type = ADD_RING;
+    m.add_ring.flags = flags;
+    m.add_ring.index = index;
+    m.add_ring.region = 0;
+    m.add_ring.offset = (char *)q.ring - this->mem;
+    m.add_ring.log2_ring_size = __builtin_ctz(this->ring_size);
+    m.add_ring.private_hdr_size = 0;
+    return this->request(m, q.int_fd);
+  }
+
+  // give all rx slots we don't hold back to the server
+  void refill(Queue &q) {
+    uint16_t head = q.ring->head;
+    uint16_t n = this->ring_size - (uint16_t)(head - q.last_tail);
+    if (n == 0)
+      return;
+    for (uint16_t i = 0; i < n; i++) {
+      struct desc &d = q.ring->desc[(head + i) & (this->ring_size - 1)];
+      d.length = BUF_SIZE;
+      d.flags = 0;
+    }
+    __atomic_store_n(&q.ring->head, (uint16_t)(head + n), __ATOMIC_RELEASE);
+  }
+
+  void interrupt(Queue &q) {
+    if (q.pending == 0)
+      return;
+    q.pending = 0;
+    if (__atomic_load_n(&q.ring->flags, __ATOMIC_ACQUIRE) & RING_FLAG_MASK_INT)
+      return; // server polls
+    uint64_t one = 1;
+    if (write(q.int_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      die("Cannot interrupt memif server");
+  }
+
+public:
+  char path[108];
+
+  Memif() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs point into the region
+  }
+
+  virtual ~Memif() {
+    if (this->sock >= 0)
+      close(this->sock);
+    for (auto &q : this->rxqs)
+      close(q->int_fd);
+    for (auto &q : this->txqs)
+      close(q->int_fd);
+    if (this->mem != NULL)
+      munmap(this->mem, this->mem_len);
+    if (this->mem_fd >= 0)
+      close(this->mem_fd);
+    this->queue_fds.clear();
+    this->fd = -1; // is an rx interrupt eventfd
+  }
+
+  /**
+   * Connect to the memif server socket at path as interface id, with up to
+   * nr_queues ring pairs.
+   */
+  int open_memif(const char *path, uint32_t id, int nr_queues) {
+    if (nr_queues > MAX_QUEUES_PER_VM)
+      die("Memif supports at most %d queues", MAX_QUEUES_PER_VM);
+    strncpy(this->path, path, sizeof(this->path) - 1);
+    this->path[sizeof(this->path) - 1] = '\0';
+
+    this->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(this->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      return -errno;
+
+    struct msg m;
+    int err;
+    if ((err = this->recv_msg(m, HELLO)) < 0)
+      return err;
+    if (m.hello.min_version > VERSION || m.hello.max_version < VERSION)
+      return -EPROTONOSUPPORT;
+    // max_*_ring are the highest ring indexes
+    this->nr_queues = std::min<uint16_t>({ (uint16_t)nr_queues, (uint16_t)(m.hello.max_m2s_ring + 1),
+                                           (uint16_t)(m.hello.max_s2m_ring + 1) });
+    this->ring_size = 1 << std::min((uint8_t)LOG2_RING_SIZE, m.hello.max_log2_ring_size);
+    this->init_region();
+
+    m = {};
+    m.type = INIT;
+    m.init.version = VERSION;
+    m.init.id = id;
+    m.init.mode = 0;
+    strncpy((char *)m.init.name, "vmux", sizeof(m.init.name));
+    if ((err = this->request(m)) < 0)
+      return err;
+
+    m = {};
+    m.type = ADD_REGION;
+    m.add_region.index = 0;
+    m.add_region.size = this->mem_len;
+    if ((err = this->request(m, this->mem_fd)) < 0)
+      return err;
+
+    for (uint16_t q = 0; q < this->nr_queues; q++) {
+      if ((err = this->add_ring(*this->txqs[q], RING_S2M, q)) < 0 ||
+          (err = this->add_ring(*this->rxqs[q], 0, q)) < 0)
+        return err;
+    }
+
+    m = {};
+    m.type = CONNECT;
+    snprintf((char *)m.connect.if_name, sizeof(m.connect.if_name), "vmux%u", id);
+    if ((err = this->send_msg(m)) < 0 || (err = this->recv_msg(m, CONNECTED)) < 0)
+      return err;
+
+    for (auto &q : this->rxqs) {
+      this->refill(*q);
+      this->queue_fds.push_back(q->int_fd);
+    }
+    this->fd = this->queue_fds[0];
+    printf(":: memif %s connected (%u queues, %u slots)\n", path, this->nr_queues, this->ring_size);
+    return 0;
+  }
+
+  // the VM's runner thread is the only producer of tx ring 0
+  void send(int vm_id, const char *buf, const size_t len) {
+    Queue &q = *this->txqs[0];
+    struct ring *r = q.ring;
+    uint16_t mask = this->ring_size - 1;
+
+    q.last_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint16_t head = r->head;
+    uint16_t free = this->ring_size - (uint16_t)(head - q.last_tail);
+    uint16_t needed = (len + BUF_SIZE - 1) / BUF_SIZE;
+    if (needed > free) {
+      this->interrupt(q);
+      if_log_level(LOG_DEBUG, printf("memif tx ring full. Dropping packet.\n"));
+      return;
+    }
+
+    size_t off = 0;
+    for (uint16_t i = 0; i < needed; i++) {
+      struct desc &d = r->desc[(head + i) & mask];
+      uint32_t chunk = std::min<size_t>(len - off, BUF_SIZE);
+      memcpy(this->data(d), buf + off, chunk);
+      d.length = chunk;
+      d.flags = i + 1 < needed ? DESC_FLAG_NEXT : 0;
+      off += chunk;
+    }
+    __atomic_store_n(&r->head, (uint16_t)(head + needed), __ATOMIC_RELEASE);
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    q.pending += needed;
+    if (q.pending >= BURST_SIZE)
+      this->interrupt(q);
+  }
+
+  virtual void flush(int vm_id) {
+    this->interrupt(*this->txqs[0]);
+  }
+
+  void recv(int vm_id) {
+    for (uint16_t q = 0; q < this->nr_queues; q++)
+      this->recv_queue(vm_id, q);
+  }
+
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->nr_queues)
+      return;
+    Queue &q = *this->rxqs[queue];
+    struct ring *r = q.ring;
+    uint16_t mask = this->ring_size - 1;
+    uint64_t events;
+    if (read(q.int_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+      die("Cannot read memif interrupt");
+
+    uint16_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint16_t slot = q.last_tail;
+    size_t first = queue * this->per_queue_bufs;
+    size_t nb = 0;
+    bool scratch_used = false;
+    while (slot != tail && nb < this->per_queue_bufs) {
+      struct desc *d = &r->desc[slot & mask];
+      if (!(d->flags & DESC_FLAG_NEXT)) {
+        this->rxBufs[first + nb] = this->data(*d);
+        this->rxBuf_used[first + nb] = d->length;
+        slot++;
+      } else {
+        // find the end of the chain before copying it together
+        uint16_t end = slot;
+        while (end != tail && (r->desc[end & mask].flags & DESC_FLAG_NEXT))
+          end++;
+        if (end == tail || scratch_used)
+          break; // incomplete, or scratch holds a chain of this burst already
+        size_t len = 0;
+        for (; slot != (uint16_t)(end + 1); slot++) {
+          d = &r->desc[slot & mask];
+          size_t chunk = std::min<size_t>(d->length, MAX_BUF - len);
+          memcpy(q.scratch + len, this->data(*d), chunk);
+          len += chunk;
+        }
+        this->rxBufs[first + nb] = q.scratch;
+        this->rxBuf_used[first + nb] = len;
+        scratch_used = true;
+      }
+      this->rxBuf_queue[first + nb] = {}; // the model does the rss
+      if_log_level(LOG_DEBUG, printf("recv %s queue %u: ", this->path, queue));
+      if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[first + nb], this->rxBuf_used[first + nb]));
+      nb++;
+    }
+    q.nb_held = slot - q.last_tail;
+    this->nb_bufs_used[queue] = nb;
+    if (slot != tail) {
+      // there is more: come back without waiting for the server
+      uint64_t one = 1;
+      if (write(q.int_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        die("Cannot write memif interrupt");
+    }
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    for (uint16_t q = 0; q < this->nr_queues; q++)
+      this->recv_consumed_queue(vm_id, q);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->nr_queues)
+      return;
+    Queue &q = *this->rxqs[queue];
+    this->nb_bufs_used[queue] = 0;
+    if (q.nb_held == 0)
+      return;
+    q.last_tail += q.nb_held;
+    q.nb_held = 0;
+    this->refill(q);
+  }
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include "src/util.hpp"
+
+/**
+ * Shared mbuf pools for all queues of the Dpdk driver: one pool per NUMA
+ * socket and direction instead of one tiny pool per queue.
+ *
+ * Pools are sized from the ring depth times the number of queues plus what
+ * can be parked in the per-lcore caches and in the Dpdk rx burst buffers.
+ * Per-lcore caches only take effect on threads that are EAL lcores (or have
+ * been registered as such).
+ *
+ * RX pools are bound to their queues during queue setup and can therefore
+ * only raise an alarm when running low. Their allocation failures are the
+ * rx_nombuf counters of the ports using them. TX pools can grow: once the primary
+ * pool runs below its low watermark, another pool of the same size is added
+ * on that socket and allocations fall back to it.
+ */
+class MbufPools {
+public:
+  enum Direction { RX = 0, TX = 1 };
+
+  static const unsigned CACHE_SIZE = 256; // per lcore, <= RTE_MEMPOOL_CACHE_MAX_SIZE
+  static const unsigned LOW_WATERMARK_PERCENT = 10; // alarm/grow below this fill level
+  static const unsigned MAX_GROW = 4; // additional tx pools per socket
+  static const uint64_t CHECK_INTERVAL_MS = 1000;
+
+private:
+  struct Pool {
+    // [0] is primary, others are grown. Fixed size so that readers don't race with grow().
+    struct rte_mempool* pools[MAX_GROW + 1] = {};
+    std::atomic<size_t> nr_pools = 0;
+    size_t nb_mbufs = 0; // size of each pool in pools
+    std::atomic<uint64_t> alloc_failures = 0;
+    bool alarmed = false; // below watermark since last check
+  };
+
+  Pool pools[RTE_MAX_NUMA_NODES][2];
+  std::mutex grow_lock; // serializes creation of pools
+  size_t per_queue_mbufs[2] = {};
+  size_t nr_queues[2];
+  size_t burst_size;
+  size_t nr_lcores;
+  std::atomic<uint64_t> next_check = 0; // tsc
+  std::vector<std::pair<unsigned, uint16_t>> rx_ports; // socket and port of rx queues using our pools
+
+  static const char* dir_name(Direction dir) {
+    return dir == RX ? "RX" : "TX";
+  }
+
+  // map SOCKET_ID_ANY and unknown sockets to socket 0
+  static unsigned socket_idx(int socket) {
+    if (socket < 0 || socket >= RTE_MAX_NUMA_NODES)
+      return 0;
+    return socket;
+  }
+
+  struct rte_mempool* create_pool(unsigned socket, Direction dir) {
+    Pool &p = this->pools[socket][dir];
+    size_t idx = p.nr_pools.load();
+    std::string name = std::format("MBUF_{}_S{}_{}", dir_name(dir), socket, idx);
+    struct rte_mempool *pool = rte_pktmbuf_pool_create(name.c_str(), p.nb_mbufs,
+        CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+    if (pool == NULL) {
+      printf("WARN: Cannot create mbuf pool %s (%zu mbufs): %s\n", name.c_str(),
+          p.nb_mbufs, rte_strerror(rte_errno));
+      return NULL;
+    }
+    printf(":: created mbuf pool %s with %zu mbufs\n", name.c_str(), p.nb_mbufs);
+    p.pools[idx] = pool;
+    p.nr_pools.store(idx + 1);
+    return pool;
+  }
+
+  bool below_watermark(struct rte_mempool *pool) {
+    return rte_mempool_avail_count(pool) * 100 <
+      (size_t)pool->size * LOW_WATERMARK_PERCENT;
+  }
+
+  // add another tx pool on socket. Returns NULL if we may not grow any further.
+  struct rte_mempool* grow(unsigned socket) {
+    std::lock_guard guard(this->grow_lock);
+    Pool &p = this->pools[socket][TX];
+    if (p.nr_pools.load() == 0)
+      return NULL; // never created with get()
+    // someone else may have grown the pool while we waited
+    struct rte_mempool *last = p.pools[p.nr_pools.load() - 1];
+    if (!below_watermark(last))
+      return last;
+    if (p.nr_pools.load() > MAX_GROW)
+      return NULL;
+    return this->create_pool(socket, TX);
+  }
+
+public:
+  /**
+   * nr_rx_queues/nr_tx_queues: number of queues sharing the pools of a direction
+   * burst_size: mbufs per queue that are held outside of the rings
+   * nr_lcores: number of lcores (including registered threads) that may keep a cache
+   */
+  MbufPools(size_t nr_rx_queues, size_t nr_tx_queues, size_t burst_size, size_t nr_lcores) :
+    nr_queues{nr_rx_queues, nr_tx_queues}, burst_size(burst_size), nr_lcores(nr_lcores) {}
+
+  /**
+   * Set the ring depth of each queue. Must be called before get().
+   */
+  void set_ring_sizes(size_t rx_desc, size_t tx_desc) {
+    // mbufs held by the rx ring plus those parked in rx bursts until recv_consumed()
+    this->per_queue_mbufs[RX] = rx_desc + this->burst_size;
+    // mbufs held by the tx ring until the PMD frees them
+    this->per_queue_mbufs[TX] = tx_desc + this->burst_size;
+  }
+
+  /**
+   * Returns the pool for socket and direction. Creates it if it does not
+   * exist yet.
+   */
+  struct rte_mempool* get(int socket_, Direction dir) {
+    unsigned socket = socket_idx(socket_);
+    Pool &p = this->pools[socket][dir];
+    if (p.nr_pools.load() > 0)
+      return p.pools[0];
+
+    std::lock_guard guard(this->grow_lock);
+    if (p.nr_pools.load() > 0)
+      return p.pools[0];
+
+    size_t cached = (size_t)CACHE_SIZE * this->nr_lcores;
+    p.nb_mbufs = this->per_queue_mbufs[dir] * this->nr_queues[dir] + cached;
+    return this->create_pool(socket, dir);
+  }
+
+  bool exists(int socket, Direction dir) {
+    return this->pools[socket_idx(socket)][dir].nr_pools.load() > 0;
+  }
+
+  /**
+   * Allocate a tx mbuf on socket. Falls back to grown pools when the primary
+   * one is exhausted. Returns NULL only if all pools of the socket are empty.
+   */
+  struct rte_mbuf* alloc_tx(int socket_) {
+    unsigned socket = socket_idx(socket_);
+    Pool &p = this->pools[socket][TX];
+    size_t nr_pools = p.nr_pools.load();
+    for (size_t i = 0; i < nr_pools; i++) {
+      struct rte_mbuf *pkt = rte_pktmbuf_alloc(p.pools[i]);
+      if (likely(pkt != NULL))
+        return pkt;
+    }
+
+    // all pools are empty: grow right away instead of dropping
+    struct rte_mempool *pool = this->grow(socket);
+    if (pool != NULL) {
+      struct rte_mbuf *pkt = rte_pktmbuf_alloc(pool);
+      if (pkt != NULL)
+        return pkt;
+    }
+
+    uint64_t failures = ++p.alloc_failures;
+    if ((failures & (failures - 1)) == 0) // log at powers of two
+      printf("WARN: MbufPools: tx mbuf allocation failed on socket %u (%lu failures)\n",
+          socket, failures);
+    return NULL;
+  }
+
+  // port has rx queues with the rx pool of socket
+  void add_rx_port(int socket, uint16_t port) {
+    this->rx_ports.emplace_back(socket_idx(socket), port);
+  }
+
+  // fetch rx allocation failures from the ports. Before they are closed.
+  void update_rx_failures() {
+    uint64_t failures[RTE_MAX_NUMA_NODES] = {};
+    for (auto [socket, port] : this->rx_ports) {
+      struct rte_eth_stats stats;
+      if (rte_eth_stats_get(port, &stats) == 0)
+        failures[socket] += stats.rx_nombuf;
+    }
+    for (unsigned socket = 0; socket < RTE_MAX_NUMA_NODES; socket++)
+      this->pools[socket][RX].alloc_failures.store(failures[socket]);
+  }
+
+  /**
+   * Watermark monitoring. Cheap to call on every poll: does the actual check
+   * (which walks all lcore caches) only every CHECK_INTERVAL_MS.
+   */
+  void check_watermarks() {
+    uint64_t now = rte_get_timer_cycles();
+    uint64_t next = this->next_check.load();
+    if (likely(now < next))
+      return;
+    // only one of the polling threads does the check
+    if (!this->next_check.compare_exchange_strong(next, now + rte_get_timer_hz() / 1000 * CHECK_INTERVAL_MS))
+      return;
+
+    this->update_rx_failures();
+    for (unsigned socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+      for (Direction dir : { RX, TX }) {
+        Pool &p = this->pools[socket][dir];
+        if (p.nr_pools.load() == 0)
+          continue;
+        struct rte_mempool *last = p.pools[p.nr_pools.load() - 1];
+        bool low = below_watermark(last);
+        if (low && !p.alarmed) {
+          printf("WARN: MbufPools: %s pool on socket %u below %u%% (%u of %u mbufs available, %lu allocation failures)\n",
+              dir_name(dir), socket, LOW_WATERMARK_PERCENT,
+              rte_mempool_avail_count(last), last->size, p.alloc_failures.load());
+        }
+        p.alarmed = low;
+        if (low && dir == TX)
+          this->grow(socket);
+      }
+    }
+  }
+
+  void dump_stats() {
+    for (unsigned socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+      for (Direction dir : { RX, TX }) {
+        Pool &p = this->pools[socket][dir];
+        for (size_t i = 0; i < p.nr_pools.load(); i++) {
+          printf("%s: %u of %u mbufs available\n", p.pools[i]->name,
+              rte_mempool_avail_count(p.pools[i]), p.pools[i]->size);
+        }
+        if (p.nr_pools.load() > 0)
+          printf("%s socket %u: %lu allocation failures\n", dir_name(dir),
+              socket, p.alloc_failures.load());
+      }
+    }
+  }
+
+  ~MbufPools() {
+    for (unsigned socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+      for (Direction dir : { RX, TX }) {
+        Pool &p = this->pools[socket][dir];
+        for (size_t i = 0; i < p.nr_pools.load(); i++)
+          rte_mempool_free(p.pools[i]);
+      }
+    }
+  }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <linux/if_ether.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Discards everything and receives the same precomputed frame as fast as the
+ * device takes it. Serves a single VM. Measures the cost of the device
+ * model and vfio-user without any I/O.
+ *
+ * fd is an eventfd that is never drained, so the device is always woken up.
+ */
+class Null : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const size_t FRAME_SIZE = 60; // minimum without FCS
+
+private:
+  char frame[FRAME_SIZE] = {};
+
+public:
+  Null() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs all point to frame
+  }
+
+  virtual ~Null() {
+    if (this->fd > 0)
+      close(this->fd);
+  }
+
+  // frames are sent to dst_mac
+  int open_null(const uint8_t dst_mac[6]) {
+    // empty ethernet II frame from a locally administered MAC
+    struct ethhdr *eth = (struct ethhdr *)this->frame;
+    static const uint8_t src_mac[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, src_mac, ETH_ALEN);
+    eth->h_proto = htons(0x88b5); // local experimental ethertype
+    for (int i = 0; i < BURST_SIZE; i++) {
+      this->rxBufs[i] = this->frame;
+      this->rxBuf_used[i] = FRAME_SIZE;
+    }
+
+    this->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->fd < 0)
+      return -errno;
+    return 0;
+  }
+
+  void send(int vm_id, const char *buf, const size_t len) {
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+  }
+
+  void recv(int vm_id) {
+    this->nb_bufs_used[0] = BURST_SIZE;
+  }
+
+  void recv_consumed(int vm_id) {
+    this->nb_bufs_used[0] = 0;
+  }
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <memory>
+#include <mutex>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * AF_PACKET backend on a host interface (e.g. one end of a veth pair), using
+ * TPACKET_V3 rings. Serves a single VM, like Tap.
+ *
+ * Every guest queue gets a packet socket. The sockets form a PACKET_FANOUT
+ * group, so the kernel spreads flows over them by their hash. RX hands out
+ * pointers into the mmapped block of a socket's rx ring without copying. A
+ * block goes back to the kernel once all its frames have been consumed.
+ * TX fills the frames of the tx ring and the kernel is kicked once per TX
+ * doorbell (flush()), or when a burst is pending.
+ */
+class Packet : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+
+  // rx ring: blocks with variable sized frames
+  static const unsigned RX_BLOCK_SIZE = 1 << 18;
+  static const unsigned RX_BLOCK_NR = 16;
+  static const unsigned RX_FRAME_SIZE = 1 << 11; // only for the kernel's sanity checks
+  static const unsigned RX_BLOCK_TIMEOUT_MS = 1; // retire partially filled blocks
+  // tx ring: fixed size frames
+  static const unsigned TX_FRAME_SIZE = 1 << 14; // >= MAX_BUF + header
+  static const unsigned TX_BLOCK_SIZE = 1 << 18;
+  static const unsigned TX_BLOCK_NR = 16;
+  static const unsigned TX_FRAME_NR = TX_BLOCK_SIZE / TX_FRAME_SIZE * TX_BLOCK_NR;
+
+private:
+  struct Queue {
+    int fd;
+    char *map = NULL; // rx ring followed by tx ring
+    size_t map_len = 0;
+    // rx
+    unsigned block = 0; // current block
+    struct tpacket3_hdr *next_pkt = NULL; // in current block, NULL if not started
+    uint32_t pkts_left = 0; // in current block
+    // tx
+    char *tx_ring = NULL;
+    unsigned tx_frame = 0;
+    unsigned tx_pending = 0;
+    std::mutex tx_lock;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::atomic<uint64_t> tx_drops = 0;
+  std::atomic<uint64_t> tx_bad = 0; // too large or rejected by the kernel
+
+  struct tpacket_block_desc *block_desc(Queue &q, unsigned block) {
+    return (struct tpacket_block_desc *)(q.map + (size_t)block * RX_BLOCK_SIZE);
+  }
+
+  struct tpacket3_hdr *tx_hdr(Queue &q, unsigned frame) {
+    return (struct tpacket3_hdr *)(q.tx_ring + (size_t)frame * TX_FRAME_SIZE);
+  }
+
+  int open_queue(Queue &q, int ifindex, int fanout_id) {
+    q.fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (q.fd < 0)
+      return -errno;
+
+    int version = TPACKET_V3;
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+      return -errno;
+    int one = 1;
+    // don't receive what we send
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) < 0)
+      return -errno;
+    // we don't need the host's qdiscs
+    setsockopt(q.fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    // the kernel skips frames it rejects (TP_STATUS_WRONG_FORMAT) instead of
+    // stopping the tx ring at them. Must be set before the rings.
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0)
+      return -errno;
+
+    struct tpacket_req3 rx_req = {};
+    rx_req.tp_block_size = RX_BLOCK_SIZE;
+    rx_req.tp_block_nr = RX_BLOCK_NR;
+    rx_req.tp_frame_size = RX_FRAME_SIZE;
+    rx_req.tp_frame_nr = RX_BLOCK_SIZE / RX_FRAME_SIZE * RX_BLOCK_NR;
+    rx_req.tp_retire_blk_tov = RX_BLOCK_TIMEOUT_MS;
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0)
+      return -errno;
+
+    struct tpacket_req3 tx_req = {};
+    tx_req.tp_block_size = TX_BLOCK_SIZE;
+    tx_req.tp_block_nr = TX_BLOCK_NR;
+    tx_req.tp_frame_size = TX_FRAME_SIZE;
+    tx_req.tp_frame_nr = TX_FRAME_NR;
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0)
+      return -errno;
+
+    q.map_len = (size_t)RX_BLOCK_SIZE * RX_BLOCK_NR + (size_t)TX_BLOCK_SIZE * TX_BLOCK_NR;
+    void *map = mmap(NULL, q.map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, q.fd, 0);
+    if (map == MAP_FAILED)
+      return -errno;
+    q.map = (char *)map;
+    q.tx_ring = q.map + (size_t)RX_BLOCK_SIZE * RX_BLOCK_NR;
+
+    struct sockaddr_ll addr = {};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(q.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      return -errno;
+
+    int fanout = fanout_id | (PACKET_FANOUT_HASH << 16);
+    if (setsockopt(q.fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0)
+      return -errno;
+    return 0;
+  }
+
+  // hand the current block back to the kernel and move on
+  void release_block(Queue &q) {
+    block_desc(q, q.block)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    q.block = (q.block + 1) % RX_BLOCK_NR;
+    q.next_pkt = NULL;
+  }
+
+  // make the kernel send the tx ring. Holds tx_lock.
+  void kick_tx(Queue &q) {
+    if (q.tx_pending == 0)
+      return;
+    q.tx_pending = 0;
+    if (sendto(q.fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
+      die("Cannot send on packet socket");
+  }
+
+public:
+  char ifName[IFNAMSIZ];
+
+  Packet() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs point into the rx rings
+  }
+
+  virtual ~Packet() {
+    for (auto &q : this->queues) {
+      if (q->map != NULL)
+        munmap(q->map, q->map_len);
+      close(q->fd);
+    }
+  }
+
+  /**
+   * Open nr_queues packet sockets on the interface dev.
+   */
+  int open_packet(const char *dev, int nr_queues) {
+    if (nr_queues > MAX_QUEUES_PER_VM)
+      die("Packet supports at most %d queues", MAX_QUEUES_PER_VM);
+    int ifindex = if_nametoindex(dev);
+    if (ifindex == 0)
+      return -ENODEV;
+    strncpy(this->ifName, dev, IFNAMSIZ - 1);
+    this->ifName[IFNAMSIZ - 1] = '\0';
+
+    int fanout_id = (getpid() ^ ifindex) & 0xffff;
+    for (int i = 0; i < nr_queues; i++) {
+      this->queues.push_back(std::make_unique<Queue>());
+      int err = this->open_queue(*this->queues.back(), ifindex, fanout_id);
+      if (err < 0)
+        return err;
+      this->queue_fds.push_back(this->queues.back()->fd);
+    }
+    this->fd = this->queue_fds[0];
+    return 0;
+  }
+
+  void count_bad_tx(size_t len) {
+    uint64_t drops = ++this->tx_bad;
+    if ((drops & (drops - 1)) == 0) // log at powers of two
+      printf("WARN: Packet: can't send frame of %zu bytes on %s. Dropped %lu packets\n", len, this->ifName, drops);
+  }
+
+  void send(int vm_id, const char *buf, const size_t len) {
+    if (len > TX_FRAME_SIZE - TPACKET3_HDRLEN) {
+      this->count_bad_tx(len);
+      return;
+    }
+    Queue &q = *this->queues[0];
+    std::lock_guard guard(q.tx_lock);
+
+    struct tpacket3_hdr *hdr = this->tx_hdr(q, q.tx_frame);
+    uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+    if (status == TP_STATUS_WRONG_FORMAT) {
+      // the kernel is done with the slot, but dropped its frame
+      this->count_bad_tx(hdr->tp_len);
+      status = TP_STATUS_AVAILABLE;
+    }
+    if (status != TP_STATUS_AVAILABLE) {
+      this->kick_tx(q);
+      uint64_t drops = ++this->tx_drops;
+      if ((drops & (drops - 1)) == 0) // log at powers of two
+        printf("WARN: Packet: tx ring of %s full. Dropped %lu packets\n", this->ifName, drops);
+      return;
+    }
+    char *data = (char *)hdr + TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+    memcpy(data, buf, len);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    q.tx_frame = (q.tx_frame + 1) % TX_FRAME_NR;
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    if (++q.tx_pending >= BURST_SIZE)
+      this->kick_tx(q);
+  }
+
+  virtual void flush(int vm_id) {
+    Queue &q = *this->queues[0];
+    std::lock_guard guard(q.tx_lock);
+    this->kick_tx(q);
+  }
+
+  void recv(int vm_id) {
+    for (size_t q = 0; q < this->queues.size(); q++)
+      this->recv_queue(vm_id, q);
+  }
+
+  // hand out up to a burst of frames of the current block
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->queues.size())
+      return;
+    Queue &q = *this->queues[queue];
+    struct tpacket_block_desc *bd = this->block_desc(q, q.block);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+      return;
+    if (q.next_pkt == NULL) {
+      q.next_pkt = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+      q.pkts_left = bd->hdr.bh1.num_pkts;
+    }
+
+    size_t first = queue * this->per_queue_bufs;
+    size_t nb = 0;
+    struct tpacket3_hdr *pkt = q.next_pkt;
+    while (nb < this->per_queue_bufs && nb < q.pkts_left) {
+      this->rxBufs[first + nb] = (char *)pkt + pkt->tp_mac;
+      this->rxBuf_used[first + nb] = pkt->tp_snaplen;
+      this->rxBuf_queue[first + nb] = {}; // the model does the rss
+      if_log_level(LOG_DEBUG, printf("recv %s queue %u: ", this->ifName, queue));
+      if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[first + nb], this->rxBuf_used[first + nb]));
+      nb++;
+      pkt = (struct tpacket3_hdr *)((char *)pkt + pkt->tp_next_offset);
+    }
+    q.next_pkt = pkt;
+    q.pkts_left -= nb;
+    this->nb_bufs_used[queue] = nb;
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    for (size_t q = 0; q < this->queues.size(); q++)
+      this->recv_consumed_queue(vm_id, q);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->queues.size())
+      return;
+    Queue &q = *this->queues[queue];
+    this->nb_bufs_used[queue] = 0;
+    if (q.next_pkt != NULL && q.pkts_left == 0)
+      this->release_block(q);
+  }
+};
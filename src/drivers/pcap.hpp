@@ -0,0 +1,402 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Replays a pcap or pcapng file into a single VM in a loop, and optionally
+ * writes everything the VM sends to a pcap file. Needs no NIC, so
+ * emulation can be measured with recorded traffic mixes anywhere.
+ *
+ * The frames of the file are copied into (huge page) memory once when
+ * opening. RX hands out pointers into it, so replay costs no copies or I/O.
+ * A timerfd wakes us up when the next frame is due. Due frames are handed out
+ * in bursts; if we fall behind, they are handed out back to back until we
+ * caught up again.
+ *
+ * Rates:
+ * - "max": as fast as the device takes them
+ * - "x1.5": the inter-frame gaps of the file, 1.5 times faster
+ * - "100000": frames per second
+ */
+class Pcap : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const size_t HUGE_PAGE_SIZE = 1 << 21;
+
+private:
+  // classic pcap
+  static const uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+  static const uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+  static const uint32_t LINKTYPE_ETHERNET = 1;
+  // pcapng
+  static const uint32_t NG_SHB = 0x0a0d0d0a;
+  static const uint32_t NG_IDB = 1;
+  static const uint32_t NG_SPB = 3;
+  static const uint32_t NG_EPB = 6;
+  static const uint32_t NG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+  static const uint16_t NG_OPT_IF_TSRESOL = 9;
+
+  struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+  } __attribute__((packed));
+  struct pcap_pkt_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_frac; // us or ns, see magic
+    uint32_t caplen;
+    uint32_t len;
+  } __attribute__((packed));
+
+  struct Frame {
+    size_t offset; // in frames
+    uint32_t len;
+    uint64_t due_ns; // relative to the start of a pass
+  };
+
+  enum RateMode { RATE_MAX, RATE_SPEEDUP, RATE_PPS };
+
+  // frames of the replay file
+  char *frames = NULL;
+  size_t frames_len = 0;
+  size_t frames_map_len = 0;
+  std::vector<Frame> index;
+  uint64_t pass_ns = 0; // duration of one pass over the file
+
+  // replay position
+  uint64_t start_ns = 0;
+  size_t next = 0;
+  uint64_t pass = 0;
+
+  FILE *capture = NULL;
+
+  static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  // raw is in file byte order
+  static uint32_t u32(const char *raw, bool swap) {
+    uint32_t v;
+    memcpy(&v, raw, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+  }
+
+  static uint16_t u16(const char *raw, bool swap) {
+    uint16_t v;
+    memcpy(&v, raw, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+  }
+
+  struct Parsed {
+    const char *data;
+    uint32_t len;
+    uint64_t ts_ns;
+  };
+
+  static int parse_pcap(const char *file, size_t size, std::vector<Parsed> &out) {
+    if (size < sizeof(struct pcap_file_hdr))
+      return -EINVAL;
+    uint32_t magic = u32(file, false);
+    bool swap = magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    magic = u32(file, swap);
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS)
+      return -EINVAL; // neither pcap nor pcapng
+    uint64_t frac_ns = magic == PCAP_MAGIC_NS ? 1 : 1000;
+    if (u32(file + offsetof(struct pcap_file_hdr, network), swap) != LINKTYPE_ETHERNET)
+      return -EPROTONOSUPPORT;
+
+    size_t pos = sizeof(struct pcap_file_hdr);
+    while (pos + sizeof(struct pcap_pkt_hdr) <= size) {
+      const char *hdr = file + pos;
+      uint32_t caplen = u32(hdr + offsetof(struct pcap_pkt_hdr, caplen), swap);
+      pos += sizeof(struct pcap_pkt_hdr);
+      if (pos + caplen > size)
+        break; // truncated file
+      uint64_t ts = (uint64_t)u32(hdr, swap) * 1000000000 + u32(hdr + 4, swap) * frac_ns;
+      out.push_back({ file + pos, caplen, ts });
+      pos += caplen;
+    }
+    return 0;
+  }
+
+  static int parse_pcapng(const char *file, size_t size, std::vector<Parsed> &out) {
+    bool swap = false;
+    std::vector<uint64_t> if_ns_per_tick; // 0: not ethernet
+    uint64_t last_ts = 0;
+    size_t pos = 0;
+    while (pos + 12 <= size) {
+      const char *blk = file + pos;
+      uint32_t type = u32(blk, false); // the shb type is a palindrome
+      if (type == NG_SHB) {
+        swap = u32(blk + 8, false) != NG_BYTE_ORDER_MAGIC;
+        if_ns_per_tick.clear();
+      } else {
+        type = u32(blk, swap);
+      }
+      uint32_t blk_len = u32(blk + 4, swap);
+      if (blk_len < 12 || pos + blk_len > size)
+        break; // truncated file
+
+      if (type == NG_IDB && blk_len >= 20) {
+        uint64_t ns_per_tick = 1000; // default resolution: us
+        // options
+        for (size_t opt = 16; opt + 4 <= blk_len - 4;) {
+          uint16_t code = u16(blk + opt, swap);
+          uint16_t len = u16(blk + opt + 2, swap);
+          if (code == 0)
+            break;
+          if (code == NG_OPT_IF_TSRESOL && len >= 1) {
+            uint8_t res = blk[opt + 4];
+            if (res & 0x80 || res > 9)
+              return -ENOTSUP; // only powers of 10 down to ns
+            ns_per_tick = 1;
+            for (int i = res; i < 9; i++)
+              ns_per_tick *= 10;
+          }
+          opt += 4 + ((len + 3) & ~3);
+        }
+        bool eth = u16(blk + 8, swap) == LINKTYPE_ETHERNET;
+        if_ns_per_tick.push_back(eth ? ns_per_tick : 0);
+      } else if (type == NG_EPB && blk_len >= 32) {
+        uint32_t if_id = u32(blk + 8, swap);
+        uint32_t caplen = u32(blk + 20, swap);
+        if (if_id < if_ns_per_tick.size() && if_ns_per_tick[if_id] != 0 && 28 + caplen <= blk_len) {
+          uint64_t ticks = ((uint64_t)u32(blk + 12, swap) << 32) | u32(blk + 16, swap);
+          last_ts = ticks * if_ns_per_tick[if_id];
+          out.push_back({ blk + 28, caplen, last_ts });
+        }
+      } else if (type == NG_SPB && blk_len >= 16) {
+        // no timestamp: replay it right after the previous frame
+        uint32_t len = std::min<uint32_t>(u32(blk + 8, swap), blk_len - 16);
+        if (!if_ns_per_tick.empty() && if_ns_per_tick[0] != 0)
+          out.push_back({ blk + 12, len, last_ts });
+      }
+      pos += blk_len;
+    }
+    return 0;
+  }
+
+  // memory for the frames: huge pages if possible
+  void alloc_frames(size_t len) {
+    this->frames_map_len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *mem = mmap(NULL, this->frames_map_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED) {
+      printf("WARN: Pcap: no huge pages for %zu bytes of frames (%s). Falling back to transparent huge pages.\n",
+             this->frames_map_len, strerror(errno));
+      mem = mmap(NULL, this->frames_map_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED)
+        die("Cannot allocate %zu bytes for pcap frames", this->frames_map_len);
+      madvise(mem, this->frames_map_len, MADV_HUGEPAGE); // before the frames are copied in
+    }
+    this->frames = (char *)mem;
+  }
+
+  int parse_rate(const char *rate, RateMode &mode, double &value) {
+    char *end;
+    if (strcmp(rate, "max") == 0) {
+      mode = RATE_MAX;
+      return 0;
+    }
+    if (rate[0] == 'x') {
+      mode = RATE_SPEEDUP;
+      value = strtod(rate + 1, &end);
+    } else {
+      mode = RATE_PPS;
+      value = strtod(rate, &end);
+    }
+    if (*end != '\0' || !(value > 0))
+      return -EINVAL;
+    return 0;
+  }
+
+  uint64_t due_ns(size_t frame) {
+    return this->start_ns + this->pass * this->pass_ns + this->index[frame].due_ns;
+  }
+
+  void arm_timer(uint64_t at_ns) {
+    struct itimerspec its = {};
+    its.it_value.tv_sec = at_ns / 1000000000;
+    its.it_value.tv_nsec = at_ns % 1000000000;
+    if (timerfd_settime(this->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      die("Cannot arm pcap replay timer");
+  }
+
+  void write_capture(const char *buf, size_t len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct pcap_pkt_hdr hdr = {
+      .ts_sec = (uint32_t)ts.tv_sec,
+      .ts_frac = (uint32_t)ts.tv_nsec,
+      .caplen = (uint32_t)len,
+      .len = (uint32_t)len,
+    };
+    if (fwrite(&hdr, sizeof(hdr), 1, this->capture) != 1 || fwrite(buf, len, 1, this->capture) != 1)
+      die("Cannot write pcap capture");
+  }
+
+public:
+  Pcap() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs point into frames
+  }
+
+  virtual ~Pcap() {
+    if (this->capture != NULL)
+      fclose(this->capture);
+    if (this->frames != NULL)
+      munmap(this->frames, this->frames_map_len);
+    if (this->fd > 0)
+      close(this->fd);
+  }
+
+  /**
+   * Load the frames of the pcap(ng) file replay and start replaying them at
+   * rate. If capture is not NULL, sent frames are written to that file.
+   */
+  int open_pcap(const char *replay, const char *capture, const char *rate) {
+    RateMode mode;
+    double value = 0;
+    if (this->parse_rate(rate, mode, value) < 0)
+      return -EINVAL;
+
+    int file_fd = open(replay, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0)
+      return -errno;
+    struct stat st;
+    if (fstat(file_fd, &st) < 0 || st.st_size < 4) {
+      close(file_fd);
+      return -EINVAL;
+    }
+    void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    close(file_fd);
+    if (file == MAP_FAILED)
+      return -errno;
+
+    std::vector<Parsed> parsed;
+    int err = u32((char *)file, false) == NG_SHB
+                  ? parse_pcapng((char *)file, st.st_size, parsed)
+                  : parse_pcap((char *)file, st.st_size, parsed);
+    size_t skipped = 0;
+    size_t len = 0;
+    for (auto &p : parsed)
+      len += p.len;
+    if (err == 0 && len > 0) {
+      this->alloc_frames(len);
+      uint64_t ts0 = parsed[0].ts_ns;
+      for (auto &p : parsed) {
+        if (p.len > MAX_BUF || p.len < 14) {
+          skipped++;
+          continue;
+        }
+        uint64_t due = 0;
+        if (mode == RATE_SPEEDUP)
+          due = p.ts_ns >= ts0 ? (p.ts_ns - ts0) / value : 0;
+        else if (mode == RATE_PPS)
+          due = this->index.size() * 1e9 / value;
+        memcpy(this->frames + this->frames_len, p.data, p.len);
+        this->index.push_back({ this->frames_len, p.len, due });
+        this->frames_len += p.len;
+      }
+    }
+    munmap(file, st.st_size);
+    if (err < 0)
+      return err;
+    if (this->index.empty())
+      return -ENODATA;
+    if (skipped > 0)
+      printf("WARN: Pcap: skipped %zu frames of %s larger than %d bytes or without ethernet header\n", skipped, replay, MAX_BUF);
+
+    // next pass starts one (average) gap after the last frame
+    size_t n = this->index.size();
+    if (mode == RATE_PPS)
+      this->pass_ns = n * 1e9 / value;
+    else if (mode == RATE_SPEEDUP)
+      this->pass_ns = this->index[n - 1].due_ns + (n > 1 ? this->index[n - 1].due_ns / (n - 1) : 0);
+    if (mode != RATE_MAX && this->pass_ns == 0)
+      this->pass_ns = 1; // all frames at the same time
+
+    if (capture != NULL) {
+      this->capture = fopen(capture, "w");
+      if (this->capture == NULL)
+        return -errno;
+      setvbuf(this->capture, NULL, _IOFBF, 1 << 20);
+      struct pcap_file_hdr hdr = {
+        .magic = PCAP_MAGIC_NS,
+        .version_major = 2,
+        .version_minor = 4,
+        .thiszone = 0,
+        .sigfigs = 0,
+        .snaplen = MAX_BUF,
+        .network = LINKTYPE_ETHERNET,
+      };
+      if (fwrite(&hdr, sizeof(hdr), 1, this->capture) != 1)
+        return -EIO;
+    }
+
+    this->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (this->fd < 0)
+      return -errno;
+    this->start_ns = now_ns();
+    this->arm_timer(this->start_ns);
+    printf(":: pcap: replaying %zu frames (%zu bytes) of %s at %s\n", n, this->frames_len, replay, rate);
+    return 0;
+  }
+
+  // the VM's runner thread is the only sender
+  void send(int vm_id, const char *buf, const size_t len) {
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+    if (this->capture != NULL)
+      this->write_capture(buf, len);
+  }
+
+  // hand out up to a burst of due frames
+  void recv(int vm_id) {
+    uint64_t expirations;
+    if (read(this->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      die("Cannot read pcap replay timer");
+
+    uint64_t now = now_ns();
+    size_t nb = 0;
+    while (nb < this->per_queue_bufs && this->due_ns(this->next) <= now) {
+      Frame &f = this->index[this->next];
+      this->rxBufs[nb] = this->frames + f.offset;
+      this->rxBuf_used[nb] = f.len;
+      this->rxBuf_queue[nb] = {}; // the model does the rss
+      if_log_level(LOG_DEBUG, printf("recv: "));
+      if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[nb], this->rxBuf_used[nb]));
+      nb++;
+      if (++this->next == this->index.size()) {
+        this->next = 0;
+        this->pass++;
+      }
+    }
+    this->nb_bufs_used[0] = nb;
+    // fires right away if we are behind
+    this->arm_timer(this->due_ns(this->next));
+  }
+
+  void recv_consumed(int vm_id) {
+    this->nb_bufs_used[0] = 0; // frames stay for the next pass
+  }
+};
@@ -0,0 +1,4 @@
+// Shared by the drivers (Driver::MAX_QUEUES_PER_VM) and BPF programs
+#pragma once
+
+#define VMUX_MAX_QUEUES_PER_VM 4 // rx/tx queue pairs of one VM. TODO hardcoded max_queues_per_vm
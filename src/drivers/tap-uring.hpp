@@ -0,0 +1,374 @@
+#pragma once
+
+#include "src/drivers/tap.hpp"
+#include "util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <liburing.h>
+#include <memory>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <vector>
+
+/**
+ * Tap backend doing its I/O through io_uring instead of one read()/write()
+ * per frame.
+ *
+ * Every tap queue gets two rings, so that rx threads and the runner thread
+ * (which sends when the guest rings a TX doorbell) don't share one:
+ * - rx: a multishot read fills buffers of a provided buffer ring. recv_queue()
+ *   reaps a burst of completions and hands out pointers into those buffers
+ *   without copying. recv_consumed_queue() gives them back to the kernel.
+ * - tx: send() copies the frame (or a whole TSO unit, with -g) into a
+ *   registered buffer and queues a write. Writes are submitted once per TX doorbell (flush()) or when
+ *   TX_BATCH of them are queued.
+ *
+ * Completions of the rx rings are signalled through an eventfd per queue,
+ * which is what the device waits on (queue_fds).
+ */
+class TapUring : public Tap {
+public:
+  static const unsigned RX_RING_BUFS = 256; // per queue, power of two
+  static const unsigned TX_SLOTS = 64; // registered tx buffers per queue
+  static const unsigned TX_BATCH = 32; // submit at the latest after that many writes
+  static const size_t BUF_SIZE = 9216; // >= sizeof(tap_vnet_hdr) + MAX_BUF
+  static const size_t MAX_TX_UNIT = 65536; // largest TSO unit of the e810 model (lan_queue_tx::MAX_TSO_UNIT)
+  static const size_t TX_BUF_SIZE = MAX_TX_UNIT + 4096; // vnet header and a TSO unit, page aligned
+  static const uint16_t BGID = 0; // buffer group of each rx ring
+
+private:
+  static const uint64_t REARM = ~0ULL; // user_data of rx reads
+
+  struct RxQueue {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring = NULL;
+    char *bufs = NULL; // RX_RING_BUFS * BUF_SIZE
+    uint16_t bids[RX_RING_BUFS]; // buffers taken by the last recv_queue()
+    size_t nb_bids = 0;
+    int tap_fd;
+    int event_fd;
+    unsigned inflight = 0; // armed reads
+    bool multishot = true;
+  };
+
+  struct TxQueue {
+    struct io_uring ring;
+    char *bufs = NULL; // TX_SLOTS * TX_BUF_SIZE, registered
+    std::vector<uint16_t> free_slots;
+    unsigned queued = 0; // prepared but not yet submitted
+    int tap_fd;
+    std::mutex lock;
+  };
+
+  std::vector<std::unique_ptr<RxQueue>> rxqs;
+  std::vector<std::unique_ptr<TxQueue>> txqs;
+  std::vector<int> tap_fds;
+
+  static char *alloc_area(size_t len) {
+    void *area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED)
+      die("Cannot allocate io_uring buffers");
+    return (char *)area;
+  }
+
+  size_t hdr_len() {
+    return this->vnet_hdr ? sizeof(struct tap_vnet_hdr) : 0;
+  }
+
+  void setup_rx(RxQueue &q) {
+    int ret = io_uring_queue_init(RX_RING_BUFS, &q.ring, 0);
+    if (ret < 0)
+      die("Cannot create io_uring: %s", strerror(-ret));
+
+    q.bufs = alloc_area(RX_RING_BUFS * BUF_SIZE);
+    q.buf_ring = io_uring_setup_buf_ring(&q.ring, RX_RING_BUFS, BGID, 0, &ret);
+    if (q.buf_ring == NULL)
+      die("Cannot set up provided buffer ring: %s", strerror(-ret));
+    for (unsigned bid = 0; bid < RX_RING_BUFS; bid++) {
+      io_uring_buf_ring_add(q.buf_ring, q.bufs + bid * BUF_SIZE, BUF_SIZE, bid,
+                            io_uring_buf_ring_mask(RX_RING_BUFS), bid);
+    }
+    io_uring_buf_ring_advance(q.buf_ring, RX_RING_BUFS);
+
+    q.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q.event_fd < 0)
+      die("Cannot create eventfd");
+    if (io_uring_register_eventfd(&q.ring, q.event_fd) < 0)
+      die("Cannot register eventfd with io_uring");
+  }
+
+  void setup_tx(TxQueue &q) {
+    int ret = io_uring_queue_init(TX_SLOTS, &q.ring, 0);
+    if (ret < 0)
+      die("Cannot create io_uring: %s", strerror(-ret));
+
+    q.bufs = alloc_area(TX_SLOTS * TX_BUF_SIZE);
+    struct iovec iovs[TX_SLOTS];
+    for (unsigned slot = 0; slot < TX_SLOTS; slot++) {
+      iovs[slot].iov_base = q.bufs + slot * TX_BUF_SIZE;
+      iovs[slot].iov_len = TX_BUF_SIZE;
+      q.free_slots.push_back(slot);
+    }
+    ret = io_uring_register_buffers(&q.ring, iovs, TX_SLOTS);
+    if (ret < 0)
+      die("Cannot register io_uring tx buffers: %s", strerror(-ret));
+  }
+
+  // keep reads armed: one multishot read, or else a burst of single reads
+  void arm_rx(RxQueue &q) {
+    unsigned want = q.multishot ? 1 : BURST_SIZE;
+    while (q.inflight < want) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&q.ring);
+      if (sqe == NULL)
+        break;
+      if (q.multishot) {
+        io_uring_prep_read_multishot(sqe, q.tap_fd, 0, 0, BGID);
+      } else {
+        io_uring_prep_read(sqe, q.tap_fd, NULL, BUF_SIZE, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BGID;
+      }
+      io_uring_sqe_set_data64(sqe, REARM);
+      q.inflight++;
+    }
+    io_uring_submit(&q.ring);
+  }
+
+  // reap finished writes. Returns the number of free slots.
+  size_t reap_tx(TxQueue &q) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned n = 0;
+    io_uring_for_each_cqe(&q.ring, head, cqe) {
+      uint64_t slot = io_uring_cqe_get_data64(cqe);
+      if (cqe->res < 0)
+        if_log_level(LOG_DEBUG, printf("tap write failed: %s\n", strerror(-cqe->res)));
+      q.free_slots.push_back(slot);
+      n++;
+    }
+    io_uring_cq_advance(&q.ring, n);
+    return q.free_slots.size();
+  }
+
+  void submit_tx(TxQueue &q) {
+    if (q.queued == 0)
+      return;
+    int ret = io_uring_submit(&q.ring);
+    if (ret < 0)
+      die("Cannot submit tap writes: %s", strerror(-ret));
+    q.queued = 0;
+  }
+
+  void queue_tx(uint16_t queue, const struct tap_vnet_hdr *hdr, const char *buf, const size_t len) {
+    if (len > MAX_TX_UNIT) {
+      printf("WARN: TapUring: dropping frame of %zu bytes\n", len);
+      return;
+    }
+    TxQueue &q = *this->txqs[queue % this->txqs.size()];
+    std::lock_guard guard(q.lock);
+
+    if (q.free_slots.empty() && this->reap_tx(q) == 0) {
+      // all slots in flight: wait for the kernel to finish one
+      this->submit_tx(q);
+      struct io_uring_cqe *cqe;
+      int ret = io_uring_wait_cqe(&q.ring, &cqe);
+      if (ret < 0)
+        die("Cannot wait for tap writes: %s", strerror(-ret));
+      this->reap_tx(q);
+    }
+    uint16_t slot = q.free_slots.back();
+    q.free_slots.pop_back();
+
+    char *dst = q.bufs + slot * TX_BUF_SIZE;
+    size_t off = 0;
+    if (this->vnet_hdr) {
+      memcpy(dst, hdr, sizeof(*hdr));
+      off = sizeof(*hdr);
+    }
+    memcpy(dst + off, buf, len);
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&q.ring);
+    if (sqe == NULL) {
+      this->submit_tx(q);
+      sqe = io_uring_get_sqe(&q.ring);
+    }
+    io_uring_prep_write_fixed(sqe, q.tap_fd, dst, off + len, 0, slot);
+    io_uring_sqe_set_data64(sqe, slot);
+    q.queued++;
+    if (q.queued >= TX_BATCH)
+      this->submit_tx(q);
+  }
+
+public:
+  TapUring() {
+    // rxBufs will point into the provided buffers instead
+    for (size_t i = 0; i < this->nb_bufs; i++) {
+      free(this->rxBufs[i]);
+      this->rxBufs[i] = NULL;
+    }
+  }
+
+  virtual ~TapUring() {
+    for (auto &q : this->rxqs) {
+      io_uring_queue_exit(&q->ring);
+      munmap(q->bufs, RX_RING_BUFS * BUF_SIZE);
+      close(q->event_fd);
+    }
+    for (auto &q : this->txqs) {
+      io_uring_queue_exit(&q->ring);
+      munmap(q->bufs, TX_SLOTS * TX_BUF_SIZE);
+    }
+    for (int fd : this->tap_fds)
+      close(fd);
+    // Tap would close our eventfds
+    this->queue_fds.clear();
+    this->fd = -1;
+  }
+
+  /**
+   * Open a tap (nr_queues == 0: single queue, else multiqueue with
+   * virtio-net headers) and set up its rings.
+   */
+  int open_uring(const char *dev, int nr_queues) {
+    int err = nr_queues == 0 ? this->open_tap(dev) : this->open_tap(dev, nr_queues);
+    if (err < 0)
+      return err;
+    this->tap_fds = this->queue_fds;
+    if (this->tap_fds.empty())
+      this->tap_fds.push_back(this->fd);
+    this->queue_fds.clear();
+
+    for (int tap_fd : this->tap_fds) {
+      // io_uring would return -EAGAIN instead of waiting for frames
+      fcntl(tap_fd, F_SETFL, fcntl(tap_fd, F_GETFL) & ~O_NONBLOCK);
+
+      auto rxq = std::make_unique<RxQueue>();
+      rxq->tap_fd = tap_fd;
+      this->setup_rx(*rxq);
+      this->arm_rx(*rxq);
+      this->queue_fds.push_back(rxq->event_fd);
+      this->rxqs.push_back(std::move(rxq));
+
+      auto txq = std::make_unique<TxQueue>();
+      txq->tap_fd = tap_fd;
+      this->setup_tx(*txq);
+      this->txqs.push_back(std::move(txq));
+    }
+    this->fd = this->queue_fds[0];
+    return 0;
+  }
+
+  void send(int vm_id, const char *buf, const size_t len) {
+    struct tap_vnet_hdr hdr = {};
+    hdr.gso_type = tap_vnet_hdr::GSO_NONE;
+    this->queue_tx(0, &hdr, buf, len);
+  }
+
+  virtual void send_offload(int vm_id, const char *buf, const size_t len,
+                            const struct vmux_tx_offload &offload) {
+    struct tap_vnet_hdr hdr = {};
+    if (offload.l4_csum) {
+      hdr.flags = tap_vnet_hdr::F_NEEDS_CSUM;
+      hdr.csum_start = offload.csum_start;
+      hdr.csum_offset = offload.csum_offset;
+    }
+    if (offload.tso_mss) {
+      hdr.gso_type = tap_vnet_hdr::GSO_TCPV4;
+      hdr.gso_size = offload.tso_mss;
+      hdr.hdr_len = offload.hdr_len;
+    } else {
+      hdr.gso_type = tap_vnet_hdr::GSO_NONE;
+    }
+    this->queue_tx(offload.queue, &hdr, buf, len);
+  }
+
+  // the guest rang a TX doorbell and all its frames are queued
+  virtual void flush(int vm_id) {
+    for (auto &q : this->txqs) {
+      std::lock_guard guard(q->lock);
+      this->submit_tx(*q);
+      this->reap_tx(*q);
+    }
+  }
+
+  void recv(int vm_id) {
+    for (size_t q = 0; q < this->rxqs.size(); q++)
+      this->recv_queue(vm_id, q);
+  }
+
+  // reap a burst of completed reads of queue
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->rxqs.size())
+      return;
+    RxQueue &q = *this->rxqs[queue];
+    uint64_t events;
+    if (read(q.event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+      die("Cannot read io_uring eventfd");
+
+    size_t first = queue * this->per_queue_bufs;
+    size_t nb = 0;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned seen = 0;
+    io_uring_for_each_cqe(&q.ring, head, cqe) {
+      if (nb >= this->per_queue_bufs)
+        break; // rest stays in the completion queue for the next burst
+      seen++;
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        q.inflight--;
+      if (cqe->res == -EINVAL && q.multishot) {
+        printf("WARN: TapUring: kernel does not support multishot reads. Falling back to single reads.\n");
+        q.multishot = false;
+        continue;
+      }
+      if (cqe->res == -ENOBUFS)
+        continue; // all buffers are with the device. Re-armed in recv_consumed_queue.
+      if (cqe->res < 0)
+        die("could not read from tap: %s", strerror(-cqe->res));
+      if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        continue;
+
+      uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      q.bids[q.nb_bids++] = bid;
+      if ((size_t)cqe->res < this->hdr_len()) {
+        continue; // buffer is returned in recv_consumed_queue
+      }
+      char *buf = q.bufs + bid * BUF_SIZE;
+      this->rxBufs[first + nb] = buf + this->hdr_len();
+      this->rxBuf_used[first + nb] = cqe->res - this->hdr_len();
+      this->rxBuf_queue[first + nb] = {}; // the model does the rss
+      if (this->vnet_hdr) {
+        const struct tap_vnet_hdr *hdr = (const struct tap_vnet_hdr *)buf;
+        this->rxBuf_csum[first + nb] = hdr->flags & tap_vnet_hdr::F_DATA_VALID ? VMUX_RX_CSUM_L4_GOOD : 0;
+      }
+      nb++;
+    }
+    io_uring_cq_advance(&q.ring, seen);
+    this->nb_bufs_used[queue] = nb;
+    if (q.inflight == 0)
+      this->arm_rx(q);
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    for (size_t q = 0; q < this->rxqs.size(); q++)
+      this->recv_consumed_queue(vm_id, q);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->rxqs.size())
+      return;
+    RxQueue &q = *this->rxqs[queue];
+    for (size_t i = 0; i < q.nb_bids; i++) {
+      io_uring_buf_ring_add(q.buf_ring, q.bufs + q.bids[i] * BUF_SIZE, BUF_SIZE,
+                            q.bids[i], io_uring_buf_ring_mask(RX_RING_BUFS), i);
+    }
+    io_uring_buf_ring_advance(q.buf_ring, q.nb_bids);
+    q.nb_bids = 0;
+    this->nb_bufs_used[queue] = 0;
+    if (q.inflight == 0)
+      this->arm_rx(q);
+  }
+};
@@ -1,26 +1,56 @@
 #pragma once
 
 #include "util.hpp"
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "src/drivers/driver.hpp"
 
+// struct virtio_net_hdr. linux/virtio_net.h does not compile as C++.
+struct tap_vnet_hdr {
+  static const uint8_t F_NEEDS_CSUM = 1;
+  static const uint8_t F_DATA_VALID = 2; // rx: the kernel (or its NIC) verified the l4 checksum
+  static const uint8_t GSO_NONE = 0;
+  static const uint8_t GSO_TCPV4 = 1;
+
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} __attribute__((packed));
+
+/**
+ * Linux tap backend. Serves a single VM.
+ *
+ * By default, a single queue is read and written one frame at a time. With
+ * open_tap(dev, nr_queues), the tap is opened with IFF_MULTI_QUEUE and
+ * IFF_VNET_HDR: each guest queue pair gets its own fd, and checksum and TSO
+ * work of the guest is passed to the host kernel in the virtio-net header.
+ */
 class Tap : public Driver {
 public:
+  static const int BURST_SIZE = 32;
 
   char ifName[IFNAMSIZ];
+  bool vnet_hdr = false;
 
   Tap() {
-    this->alloc_rx_lists(1, 1);
+    this->alloc_rx_lists(1, BURST_SIZE);
     this->alloc_rx_bufs();
   }
 
   virtual ~Tap() {
-    close(this->fd); // does onthing if uninitialized (== 0)
+    if (this->queue_fds.empty())
+      close(this->fd); // does onthing if uninitialized (== 0)
+    for (int fd : this->queue_fds)
+      close(fd);
   }
 
   int open_tap(const char *dev) {
@@ -50,7 +80,50 @@ public:
     return 0;
   }
 
+  /**
+   * Open nr_queues queues of a multiqueue tap with virtio-net headers.
+   */
+  int open_tap(const char *dev, int nr_queues) {
+    struct ifreq ifr;
+    int fd, err;
+
+    if (nr_queues > MAX_QUEUES_PER_VM)
+      die("Tap supports at most %d queues", MAX_QUEUES_PER_VM);
+
+    for (int q = 0; q < nr_queues; q++) {
+      if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0)
+        die("Cannot open /dev/net/tun");
+
+      memset(&ifr, 0, sizeof(ifr));
+      ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE | IFF_VNET_HDR;
+      if (*dev)
+        strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+
+      if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
+        close(fd);
+        return err;
+      }
+
+      // Only accept frames the e810 model can pass to the guest as they are:
+      // it has no LRO and can't report partial checksums.
+      if ((err = ioctl(fd, TUNSETOFFLOAD, 0)) < 0) {
+        close(fd);
+        return err;
+      }
+      this->queue_fds.push_back(fd);
+    }
+    strcpy(this->ifName, ifr.ifr_name);
+    this->fd = this->queue_fds[0];
+    this->vnet_hdr = true;
+    return 0;
+  }
+
   void send(int vm_id, const char *buf, const size_t len) {
+    if (this->vnet_hdr) {
+      struct vmux_tx_offload offload;
+      this->send_offload(vm_id, buf, len, offload);
+      return;
+    }
     if (len > Tap::MAX_BUF)
       die("Attempting to send a packet too large for vmux (%zu)", len);
     memcpy(&(this->txFrame), (void *)buf, len);
@@ -62,7 +135,50 @@ public:
     }
   }
 
+  virtual bool tx_offloads(int vm_id) {
+    return this->vnet_hdr;
+  }
+
+  // send on the tap queue of the guest's tx queue without copying buf
+  virtual void send_offload(int vm_id, const char *buf, const size_t len,
+                            const struct vmux_tx_offload &offload) {
+    struct tap_vnet_hdr hdr = {};
+    if (offload.l4_csum) {
+      hdr.flags = tap_vnet_hdr::F_NEEDS_CSUM;
+      hdr.csum_start = offload.csum_start;
+      hdr.csum_offset = offload.csum_offset;
+    }
+    if (offload.tso_mss) {
+      hdr.gso_type = tap_vnet_hdr::GSO_TCPV4;
+      hdr.gso_size = offload.tso_mss;
+      hdr.hdr_len = offload.hdr_len;
+    } else {
+      hdr.gso_type = tap_vnet_hdr::GSO_NONE;
+    }
+
+    struct iovec iov[2] = {
+      { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+      { .iov_base = (void *)buf, .iov_len = len },
+    };
+    int fd = this->queue_fds[offload.queue % this->queue_fds.size()];
+    ssize_t n = writev(fd, iov, 2);
+    if (n < 0 && errno == EAGAIN) {
+      if_log_level(LOG_DEBUG, printf("tap queue %u full. Dropping packet.\n", offload.queue));
+      return;
+    }
+    if (n != (ssize_t)(sizeof(hdr) + len)) {
+      die("Could not send full packet (sent %zd of %zu b). Is the tap "
+          "interface down?",
+          n, sizeof(hdr) + len);
+    }
+  }
+
   void recv(int _vm_number) {
+    if (this->vnet_hdr) {
+      for (size_t q = 0; q < this->queue_fds.size(); q++)
+        this->recv_queue(_vm_number, q);
+      return;
+    }
     size_t n = read(this->fd, this->rxBufs[0], Tap::MAX_BUF);
     this->rxBuf_used[0] = n;
     this->nb_bufs_used[0] = 1;
@@ -74,8 +190,45 @@ public:
       die("could not read from tap");
   }
 
+  // read a burst of frames from the fd of queue
+  virtual void recv_queue(int _vm_number, uint16_t queue) {
+    if (!this->vnet_hdr) {
+      if (queue == 0)
+        this->recv(_vm_number);
+      return;
+    }
+
+    size_t first = queue * this->per_queue_bufs;
+    size_t i;
+    for (i = first; i < first + this->per_queue_bufs; i++) {
+      struct tap_vnet_hdr hdr;
+      struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = this->rxBufs[i], .iov_len = Tap::MAX_BUF },
+      };
+      ssize_t n = readv(this->queue_fds[queue], iov, 2);
+      if (n < 0 && errno == EAGAIN)
+        break;
+      if (n < (ssize_t)sizeof(hdr))
+        die("could not read from tap");
+      this->rxBuf_used[i] = n - sizeof(hdr);
+      this->rxBuf_queue[i] = {}; // the model does the rss
+      this->rxBuf_csum[i] = hdr.flags & tap_vnet_hdr::F_DATA_VALID ? VMUX_RX_CSUM_L4_GOOD : 0;
+      if (LOG_LEVEL >= LOG_DEBUG) {
+        printf("recv queue %u %zu bytes\n", queue, this->rxBuf_used[i]);
+        Util::dump_pkt(this->rxBufs[i], this->rxBuf_used[i]);
+      }
+    }
+    this->nb_bufs_used[queue] = i - first;
+  }
+
   virtual void recv_consumed(int _vm_number) {
-    this->nb_bufs_used[0] = 0;
+    for (int q = 0; q < MAX_QUEUES_PER_VM; q++)
+      this->nb_bufs_used[q] = 0;
+  }
+
+  virtual void recv_consumed_queue(int _vm_number, uint16_t queue) {
+    this->nb_bufs_used[queue] = 0;
   }
 
   void dumpRx() {
@@ -0,0 +1,498 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * vhost-user front end: connects to the vhost-user socket of a software
+ * switch (OVS-DPDK, testpmd with net_vhost, ...) and acts as the virtio-net
+ * driver of one queue pair. Serves a single VM, like Tap.
+ *
+ * All memory the switch sees is one shared memfd: the two virtqueues and a
+ * fixed buffer per descriptor. Split and packed virtqueues are supported.
+ *
+ * - RX: received frames are handed to the device as pointers into their
+ *   buffers. recv_consumed() makes the buffers available again in one go.
+ * - TX: send() writes the frame into the buffer of a free descriptor, which
+ *   the switch reads in place. The switch is kicked once per TX doorbell
+ *   (flush()), if it asks for kicks at all.
+ *
+ * We wait on the call eventfd of the rx queue.
+ */
+class VhostUser : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const uint16_t QUEUE_SIZE = 256;
+  static const size_t BUF_SIZE = 9216; // >= virtio-net header + MAX_BUF
+  static const size_t RING_SIZE = 16384; // desc table, driver area and device area, 4k each
+
+private:
+  enum Request {
+    GET_FEATURES = 1,
+    SET_FEATURES = 2,
+    SET_OWNER = 3,
+    SET_MEM_TABLE = 5,
+    SET_VRING_NUM = 8,
+    SET_VRING_ADDR = 9,
+    SET_VRING_BASE = 10,
+    SET_VRING_KICK = 12,
+    SET_VRING_CALL = 13,
+  };
+  static const uint32_t VERSION = 0x1;
+  static const uint32_t FLAG_REPLY = 0x4;
+
+  static const uint64_t F_VERSION_1 = 1ULL << 32;
+  static const uint64_t F_RING_PACKED = 1ULL << 34;
+
+  // split virtqueue
+  static const uint16_t DESC_F_WRITE = 2;
+  static const uint16_t AVAIL_F_NO_INTERRUPT = 1;
+  static const uint16_t USED_F_NO_NOTIFY = 1;
+  // packed virtqueue
+  static const uint16_t PACKED_DESC_F_AVAIL = 1 << 7;
+  static const uint16_t PACKED_DESC_F_USED = 1 << 15;
+  static const uint16_t EVENT_FLAGS_DISABLE = 1;
+
+  enum VqIdx { RXQ = 0, TXQ = 1 };
+
+  struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+  };
+  struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[QUEUE_SIZE];
+  };
+  struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+  };
+  struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[QUEUE_SIZE];
+  };
+  struct vring_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+  };
+  struct vring_packed_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+  };
+
+  // virtio_net_hdr_v1 (VIRTIO_F_VERSION_1)
+  struct net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+  } __attribute__((packed));
+
+  struct msg_hdr {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+  } __attribute__((packed));
+  struct vring_state {
+    uint32_t index;
+    uint32_t num;
+  };
+  struct vring_addr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+  };
+  struct mem_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+  };
+  struct mem_table {
+    uint32_t nregions;
+    uint32_t padding;
+    struct mem_region regions[1];
+  };
+
+  struct Virtqueue {
+    char *ring; // RING_SIZE
+    char *bufs; // QUEUE_SIZE * BUF_SIZE
+    int kick_fd;
+    int call_fd;
+    // split
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    // packed
+    struct vring_packed_desc *pdesc;
+    struct vring_packed_event *driver_event;
+    struct vring_packed_event *device_event;
+    bool avail_wrap = true;
+    bool used_wrap = true;
+
+    uint16_t next_avail = 0; // split: avail idx, packed: position
+    uint16_t next_used = 0; // split: used idx, packed: position
+    uint16_t free_ids[QUEUE_SIZE]; // tx: descriptors/buffers not in flight
+    uint16_t nb_free = 0;
+    uint16_t held[QUEUE_SIZE]; // rx: buffers taken by the last recv
+    uint16_t nb_held = 0;
+    unsigned pending = 0; // tx: made available since the last kick
+  };
+
+  int sock = -1;
+  bool packed = false;
+  int mem_fd = -1;
+  char *mem = NULL;
+  size_t mem_len = 0;
+  Virtqueue vqs[2];
+  std::mutex tx_lock;
+
+  char *buf(Virtqueue &vq, uint16_t id) {
+    return vq.bufs + (size_t)id * BUF_SIZE;
+  }
+
+  int send_msg(uint32_t request, const void *payload, uint32_t size, int fd = -1) {
+    struct msg_hdr hdr = { request, VERSION, size };
+    struct iovec iov[2] = {
+      { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+      { .iov_base = (void *)payload, .iov_len = size },
+    };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = size ? 2 : 1;
+    if (fd >= 0) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(this->sock, &msg, 0) != (ssize_t)(sizeof(hdr) + size))
+      return -errno;
+    return 0;
+  }
+
+  int send_u64(uint32_t request, uint64_t value, int fd = -1) {
+    return this->send_msg(request, &value, sizeof(value), fd);
+  }
+
+  int recv_u64(uint32_t request, uint64_t &value) {
+    struct msg_hdr hdr;
+    if (::recv(this->sock, &hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr))
+      return -EIO;
+    if (hdr.request != request || !(hdr.flags & FLAG_REPLY) || hdr.size != sizeof(value))
+      return -EPROTO;
+    if (::recv(this->sock, &value, sizeof(value), MSG_WAITALL) != sizeof(value))
+      return -EIO;
+    return 0;
+  }
+
+  void init_vq(Virtqueue &vq, char *ring, char *bufs) {
+    vq.ring = ring;
+    vq.bufs = bufs;
+    vq.desc = (struct vring_desc *)ring;
+    vq.avail = (struct vring_avail *)(ring + 4096);
+    vq.used = (struct vring_used *)(ring + 8192);
+    vq.pdesc = (struct vring_packed_desc *)ring;
+    vq.driver_event = (struct vring_packed_event *)(ring + 4096);
+    vq.device_event = (struct vring_packed_event *)(ring + 8192);
+    vq.kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    vq.call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vq.kick_fd < 0 || vq.call_fd < 0)
+      die("Cannot create eventfd");
+  }
+
+  // make a buffer available to the switch (split: buffer id == descriptor id)
+  void make_avail(Virtqueue &vq, uint16_t id, uint32_t len, uint16_t flags) {
+    if (!this->packed) {
+      vq.desc[id] = { (uint64_t)this->buf(vq, id), len, flags, 0 };
+      vq.avail->ring[vq.next_avail % QUEUE_SIZE] = id;
+      vq.next_avail++;
+      return;
+    }
+    struct vring_packed_desc *d = &vq.pdesc[vq.next_avail];
+    d->addr = (uint64_t)this->buf(vq, id);
+    d->len = len;
+    d->id = id;
+    uint16_t avail_flags = vq.avail_wrap ? PACKED_DESC_F_AVAIL : PACKED_DESC_F_USED;
+    __atomic_store_n(&d->flags, (uint16_t)(flags | avail_flags), __ATOMIC_RELEASE);
+    if (++vq.next_avail == QUEUE_SIZE) {
+      vq.next_avail = 0;
+      vq.avail_wrap = !vq.avail_wrap;
+    }
+  }
+
+  // publish what make_avail() added (split only, packed publishes per descriptor)
+  void publish_avail(Virtqueue &vq) {
+    if (!this->packed)
+      __atomic_store_n(&vq.avail->idx, vq.next_avail, __ATOMIC_RELEASE);
+  }
+
+  // next buffer the switch is done with. false if there is none.
+  bool get_used(Virtqueue &vq, uint16_t &id, uint32_t &len) {
+    if (!this->packed) {
+      if (vq.next_used == __atomic_load_n(&vq.used->idx, __ATOMIC_ACQUIRE))
+        return false;
+      struct vring_used_elem *e = &vq.used->ring[vq.next_used % QUEUE_SIZE];
+      id = e->id;
+      len = e->len;
+      vq.next_used++;
+      return true;
+    }
+    struct vring_packed_desc *d = &vq.pdesc[vq.next_used];
+    uint16_t flags = __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE);
+    bool avail = flags & PACKED_DESC_F_AVAIL;
+    bool used = flags & PACKED_DESC_F_USED;
+    if (avail != used || used != vq.used_wrap)
+      return false;
+    id = d->id;
+    len = d->len;
+    if (++vq.next_used == QUEUE_SIZE) {
+      vq.next_used = 0;
+      vq.used_wrap = !vq.used_wrap;
+    }
+    return true;
+  }
+
+  void kick(Virtqueue &vq) {
+    if (vq.pending == 0)
+      return;
+    vq.pending = 0;
+    bool wants_kick;
+    if (!this->packed)
+      wants_kick = !(__atomic_load_n(&vq.used->flags, __ATOMIC_ACQUIRE) & USED_F_NO_NOTIFY);
+    else
+      wants_kick = __atomic_load_n(&vq.device_event->flags, __ATOMIC_ACQUIRE) != EVENT_FLAGS_DISABLE;
+    if (!wants_kick)
+      return;
+    uint64_t one = 1;
+    if (write(vq.kick_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      die("Cannot kick vhost-user queue");
+  }
+
+  int setup_vring(uint32_t index) {
+    Virtqueue &vq = this->vqs[index];
+    struct vring_state num = { index, QUEUE_SIZE };
+    struct vring_state base = { index, this->packed ? (1U << 15) : 0U }; // packed: wrap counter
+    struct vring_addr addr = {};
+    addr.index = index;
+    addr.desc_user_addr = (uint64_t)vq.ring;
+    addr.avail_user_addr = (uint64_t)vq.ring + 4096; // packed: driver event suppression
+    addr.used_user_addr = (uint64_t)vq.ring + 8192; // packed: device event suppression
+    int err;
+    if ((err = this->send_msg(SET_VRING_NUM, &num, sizeof(num))) < 0 ||
+        (err = this->send_msg(SET_VRING_BASE, &base, sizeof(base))) < 0 ||
+        (err = this->send_msg(SET_VRING_ADDR, &addr, sizeof(addr))) < 0 ||
+        (err = this->send_u64(SET_VRING_CALL, index, vq.call_fd)) < 0 ||
+        (err = this->send_u64(SET_VRING_KICK, index, vq.kick_fd)) < 0) // starts the ring
+      return err;
+    return 0;
+  }
+
+public:
+  char path[108];
+
+  VhostUser() {
+    this->alloc_rx_lists(1, BURST_SIZE); // rxBufs point into the shared memory
+  }
+
+  virtual ~VhostUser() {
+    if (this->sock >= 0)
+      close(this->sock);
+    for (auto &vq : this->vqs) {
+      close(vq.kick_fd);
+      close(vq.call_fd);
+    }
+    if (this->mem != NULL)
+      munmap(this->mem, this->mem_len);
+    if (this->mem_fd >= 0)
+      close(this->mem_fd);
+    this->fd = -1; // is vqs[RXQ].call_fd
+  }
+
+  /**
+   * Connect to the vhost-user socket at path. packed: use packed virtqueues
+   * (if the switch supports them).
+   */
+  int open_vhost(const char *path, bool packed) {
+    strncpy(this->path, path, sizeof(this->path) - 1);
+    this->path[sizeof(this->path) - 1] = '\0';
+
+    // shared memory: both rings, then the buffers of both queues
+    size_t bufs_len = (size_t)QUEUE_SIZE * BUF_SIZE;
+    this->mem_len = 2 * RING_SIZE + 2 * bufs_len;
+    this->mem_fd = memfd_create("vmux-vhost-user", MFD_CLOEXEC);
+    if (this->mem_fd < 0 || ftruncate(this->mem_fd, this->mem_len) < 0)
+      return -errno;
+    void *mem = mmap(NULL, this->mem_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->mem_fd, 0);
+    if (mem == MAP_FAILED)
+      return -errno;
+    this->mem = (char *)mem;
+    this->init_vq(this->vqs[RXQ], this->mem, this->mem + 2 * RING_SIZE);
+    this->init_vq(this->vqs[TXQ], this->mem + RING_SIZE, this->mem + 2 * RING_SIZE + bufs_len);
+
+    this->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(this->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      return -errno;
+
+    int err;
+    uint64_t features;
+    if ((err = this->send_msg(SET_OWNER, NULL, 0)) < 0 ||
+        (err = this->send_msg(GET_FEATURES, NULL, 0)) < 0 ||
+        (err = this->recv_u64(GET_FEATURES, features)) < 0)
+      return err;
+    if (!(features & F_VERSION_1))
+      return -ENOTSUP;
+    this->packed = packed && (features & F_RING_PACKED);
+    if (packed && !this->packed)
+      printf("WARN: VhostUser: %s does not support packed virtqueues. Using split ones.\n", path);
+    uint64_t acked = F_VERSION_1 | (this->packed ? F_RING_PACKED : 0);
+    if ((err = this->send_u64(SET_FEATURES, acked)) < 0)
+      return err;
+
+    // addresses in the rings are our own virtual addresses
+    struct mem_table table = {};
+    table.nregions = 1;
+    table.regions[0] = { (uint64_t)this->mem, this->mem_len, (uint64_t)this->mem, 0 };
+    if ((err = this->send_msg(SET_MEM_TABLE, &table, sizeof(table), this->mem_fd)) < 0)
+      return err;
+
+    // all rx buffers are available, all tx buffers are free
+    Virtqueue &rxq = this->vqs[RXQ];
+    for (uint16_t id = 0; id < QUEUE_SIZE; id++)
+      this->make_avail(rxq, id, BUF_SIZE, DESC_F_WRITE);
+    this->publish_avail(rxq);
+    Virtqueue &txq = this->vqs[TXQ];
+    for (uint16_t id = 0; id < QUEUE_SIZE; id++)
+      txq.free_ids[txq.nb_free++] = id;
+    // we don't wait for tx completions
+    if (this->packed)
+      txq.driver_event->flags = EVENT_FLAGS_DISABLE;
+    else
+      txq.avail->flags = AVAIL_F_NO_INTERRUPT;
+
+    if ((err = this->setup_vring(RXQ)) < 0 || (err = this->setup_vring(TXQ)) < 0)
+      return err;
+
+    this->queue_fds.push_back(rxq.call_fd);
+    this->fd = rxq.call_fd;
+    printf(":: vhost-user %s connected (%s virtqueues)\n", path, this->packed ? "packed" : "split");
+    return 0;
+  }
+
+  void send(int vm_id, const char *buf, const size_t len) {
+    if (len > BUF_SIZE - sizeof(struct net_hdr))
+      die("Attempting to send a packet too large for vmux (%zu)", len);
+    std::lock_guard guard(this->tx_lock);
+    Virtqueue &vq = this->vqs[TXQ];
+
+    // reclaim buffers the switch has sent
+    uint16_t id;
+    uint32_t used_len;
+    while (this->get_used(vq, id, used_len))
+      vq.free_ids[vq.nb_free++] = id;
+    if (vq.nb_free == 0) {
+      this->kick(vq);
+      if_log_level(LOG_DEBUG, printf("vhost-user tx queue full. Dropping packet.\n"));
+      return;
+    }
+    id = vq.free_ids[--vq.nb_free];
+
+    char *dst = this->buf(vq, id);
+    memset(dst, 0, sizeof(struct net_hdr));
+    memcpy(dst + sizeof(struct net_hdr), buf, len);
+    this->make_avail(vq, id, sizeof(struct net_hdr) + len, 0);
+    this->publish_avail(vq);
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    if (++vq.pending >= BURST_SIZE)
+      this->kick(vq);
+  }
+
+  virtual void flush(int vm_id) {
+    std::lock_guard guard(this->tx_lock);
+    this->kick(this->vqs[TXQ]);
+  }
+
+  void recv(int vm_id) {
+    this->recv_queue(vm_id, 0);
+  }
+
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue != 0)
+      return;
+    Virtqueue &vq = this->vqs[RXQ];
+    uint64_t events;
+    if (read(vq.call_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+      die("Cannot read vhost-user call eventfd");
+
+    uint16_t id;
+    uint32_t len;
+    size_t nb = 0;
+    while (nb < this->per_queue_bufs && this->get_used(vq, id, len)) {
+      vq.held[vq.nb_held++] = id;
+      if (len <= sizeof(struct net_hdr))
+        continue;
+      this->rxBufs[nb] = this->buf(vq, id) + sizeof(struct net_hdr);
+      this->rxBuf_used[nb] = len - sizeof(struct net_hdr);
+      this->rxBuf_queue[nb] = {}; // the model does the rss
+      if_log_level(LOG_DEBUG, printf("recv %s: ", this->path));
+      if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[nb], this->rxBuf_used[nb]));
+      nb++;
+    }
+    this->nb_bufs_used[0] = nb;
+    if (nb == this->per_queue_bufs) {
+      // there may be more: come back without waiting for the switch
+      uint64_t one = 1;
+      if (write(vq.call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        die("Cannot write vhost-user call eventfd");
+    }
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    this->recv_consumed_queue(vm_id, 0);
+  }
+
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue != 0)
+      return;
+    Virtqueue &vq = this->vqs[RXQ];
+    this->nb_bufs_used[0] = 0;
+    if (vq.nb_held == 0)
+      return;
+    for (uint16_t i = 0; i < vq.nb_held; i++)
+      this->make_avail(vq, vq.held[i], BUF_SIZE, DESC_F_WRITE);
+    this->publish_avail(vq);
+    vq.pending += vq.nb_held;
+    vq.nb_held = 0;
+    this->kick(vq);
+  }
+};
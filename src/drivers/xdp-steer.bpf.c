@@ -0,0 +1,50 @@
+// XDP program of the Xdp driver: steers frames to the AF_XDP socket of the
+// VM owning their destination MAC. Everything else goes to the host stack.
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <bpf/bpf_helpers.h>
+#include "xdp-steer.h"
+
+#define MAX_VMS XDP_STEER_MAX_VMS
+#define MAX_QUEUES VMUX_MAX_QUEUES_PER_VM
+
+// dst mac (in the lower 6 bytes) -> vm
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, MAX_VMS * 16);
+  __type(key, __u64);
+  __type(value, __u32);
+} macs SEC(".maps");
+
+// vm * MAX_QUEUES + queue -> xsk
+struct {
+  __uint(type, BPF_MAP_TYPE_XSKMAP);
+  __uint(max_entries, MAX_VMS * MAX_QUEUES);
+  __type(key, __u32);
+  __type(value, __u32);
+} xsks SEC(".maps");
+
+SEC("xdp")
+int vmux_steer(struct xdp_md *ctx) {
+  void *data = (void *)(long)ctx->data;
+  void *data_end = (void *)(long)ctx->data_end;
+  struct ethhdr *eth = data;
+
+  if ((void *)(eth + 1) > data_end)
+    return XDP_PASS;
+
+  __u64 mac = 0;
+  __builtin_memcpy(&mac, eth->h_dest, ETH_ALEN);
+  __u32 *vm = bpf_map_lookup_elem(&macs, &mac);
+  if (!vm)
+    return XDP_PASS;
+
+  // frames of a VM never go to the host stack: the VM has no XSK on queues
+  // beyond MAX_QUEUES
+  __u32 queue = ctx->rx_queue_index;
+  if (queue >= MAX_QUEUES)
+    return XDP_DROP;
+  return bpf_redirect_map(&xsks, *vm * MAX_QUEUES + queue, XDP_DROP);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,6 @@
+// Shared by the Xdp driver and its XDP program (xdp-steer.bpf.c)
+#pragma once
+
+#include "queues.h"
+
+#define XDP_STEER_MAX_VMS 64
@@ -0,0 +1,361 @@
+#pragma once
+
+#include "src/drivers/driver.hpp"
+#include "util.hpp"
+#include "src/drivers/xdp-steer.h"
+#include "xdp-steer.bpf.h" // generated: xdp_steer_bpf[], xdp_steer_bpf_len
+#include <algorithm>
+#include <atomic>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/sockios.h>
+#include <memory>
+#include <mutex>
+#include <net/if.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <vector>
+#include <xdp/xsk.h>
+
+/**
+ * AF_XDP backend on a host interface (e.g. one end of a veth pair). Serves
+ * multiple VMs.
+ *
+ * Every queue of the interface gets a UMEM. Each VM has one XSK per
+ * interface queue (= per guest queue), and all XSKs of a queue share its
+ * UMEM. Our XDP program (xdp-steer.bpf.c) redirects frames to the XSK of the
+ * VM owning their destination MAC and passes everything else to the host.
+ *
+ * Received frames are handed to the device as pointers into the UMEM and
+ * go back to the fill ring in recv_consumed(). Sending copies into a UMEM
+ * frame. The kernel is kicked once per TX doorbell (flush()), or when a
+ * burst is pending.
+ *
+ * Frames are one page each and the interface MTU must fit (no multi-buffer).
+ */
+class Xdp : public Driver {
+public:
+  static const int BURST_SIZE = 32;
+  static const uint32_t NUM_FRAMES = 4096; // per UMEM: half for rx, half for tx
+  static const uint32_t FRAME_SIZE = XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+private:
+  // shared by all XSKs bound to one queue of the interface
+  struct Umem {
+    struct xsk_umem *umem = NULL;
+    struct xsk_ring_prod fill;
+    struct xsk_ring_cons comp;
+    char *area = NULL;
+    std::vector<uint64_t> free_frames; // for tx
+    std::mutex lock; // protects fill, comp, free_frames and the tx rings of the XSKs
+  };
+
+  struct Socket {
+    struct xsk_socket *xsk = NULL;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    Umem *umem;
+    uint64_t held[BURST_SIZE]; // frames handed out by the last recv_queue()
+    uint32_t nb_held = 0;
+    uint32_t tx_pending = 0; // submitted, but kernel not kicked yet
+  };
+
+  std::string ifname;
+  int ifindex;
+  int num_vms;
+  uint16_t nr_queues; // used queues of the interface
+  std::vector<std::unique_ptr<Umem>> umems; // per interface queue
+  std::vector<std::unique_ptr<Socket>> sockets; // vm * MAX_QUEUES_PER_VM + queue
+  struct bpf_object *bpf_obj = NULL;
+  int macs_fd;
+  int xsks_fd;
+  std::atomic<uint64_t> tx_drops = 0;
+  std::atomic<uint64_t> tx_too_large = 0;
+
+  static uint64_t mac_key(const uint8_t mac[6]) {
+    uint64_t key = 0;
+    memcpy(&key, mac, 6);
+    return key;
+  }
+
+  // number of combined (or rx) channels of the interface. 1 if unknown.
+  uint16_t query_queues() {
+    struct ethtool_channels channels = {};
+    channels.cmd = ETHTOOL_GCHANNELS;
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, this->ifname.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_data = (char *)&channels;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int ret = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+    if (ret < 0)
+      return 1;
+    uint32_t queues = channels.combined_count ? channels.combined_count : channels.rx_count;
+    return queues ? queues : 1;
+  }
+
+  void load_program() {
+    this->bpf_obj = bpf_object__open_mem(xdp_steer_bpf, xdp_steer_bpf_len, NULL);
+    if (this->bpf_obj == NULL)
+      die("Cannot open XDP steering program");
+    if (bpf_object__load(this->bpf_obj) != 0)
+      die("Cannot load XDP steering program");
+    struct bpf_program *prog = bpf_object__find_program_by_name(this->bpf_obj, "vmux_steer");
+    if (prog == NULL)
+      die("XDP steering program has no vmux_steer");
+    if (bpf_xdp_attach(this->ifindex, bpf_program__fd(prog), XDP_FLAGS_UPDATE_IF_NOEXIST, NULL) != 0)
+      die("Cannot attach XDP program to %s. Is another one attached?", this->ifname.c_str());
+    this->macs_fd = bpf_object__find_map_fd_by_name(this->bpf_obj, "macs");
+    this->xsks_fd = bpf_object__find_map_fd_by_name(this->bpf_obj, "xsks");
+    if (this->macs_fd < 0 || this->xsks_fd < 0)
+      die("XDP steering program lacks its maps");
+  }
+
+  void setup_umem(Umem &u) {
+    size_t len = (size_t)NUM_FRAMES * FRAME_SIZE;
+    void *area = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED)
+      die("Cannot allocate UMEM");
+    u.area = (char *)area;
+    int ret = xsk_umem__create(&u.umem, u.area, len, &u.fill, &u.comp, NULL);
+    if (ret != 0)
+      die("Cannot create UMEM: %s", strerror(-ret));
+
+    // first half goes to the fill ring, second half is for tx
+    uint32_t rx_frames = NUM_FRAMES / 2;
+    uint32_t idx;
+    if (xsk_ring_prod__reserve(&u.fill, rx_frames, &idx) != rx_frames)
+      die("Cannot populate fill ring");
+    for (uint32_t i = 0; i < rx_frames; i++)
+      *xsk_ring_prod__fill_addr(&u.fill, idx++) = (uint64_t)i * FRAME_SIZE;
+    xsk_ring_prod__submit(&u.fill, rx_frames);
+    for (uint32_t i = rx_frames; i < NUM_FRAMES; i++)
+      u.free_frames.push_back((uint64_t)i * FRAME_SIZE);
+  }
+
+  void setup_socket(Socket &s, int vm, uint16_t queue) {
+    struct xsk_socket_config cfg = {};
+    cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    cfg.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD; // we bring our own
+    cfg.bind_flags = XDP_USE_NEED_WAKEUP;
+    s.umem = this->umems[queue].get();
+    int ret = xsk_socket__create_shared(&s.xsk, this->ifname.c_str(), queue, s.umem->umem,
+                                        &s.rx, &s.tx, &s.umem->fill, &s.umem->comp, &cfg);
+    if (ret != 0)
+      die("Cannot create AF_XDP socket for vm %d queue %u: %s", vm, queue, strerror(-ret));
+
+    uint32_t key = vm * MAX_QUEUES_PER_VM + queue;
+    int fd = xsk_socket__fd(s.xsk);
+    if (bpf_map_update_elem(this->xsks_fd, &key, &fd, BPF_ANY) != 0)
+      die("Cannot add AF_XDP socket to xsks map");
+  }
+
+  // return completed tx frames. Holds umem lock.
+  void reclaim_tx(Umem &u) {
+    uint32_t idx;
+    uint32_t n = xsk_ring_cons__peek(&u.comp, NUM_FRAMES, &idx);
+    for (uint32_t i = 0; i < n; i++)
+      u.free_frames.push_back(*xsk_ring_cons__comp_addr(&u.comp, idx++));
+    xsk_ring_cons__release(&u.comp, n);
+  }
+
+  // make the kernel process the tx ring. Holds umem lock.
+  void kick_tx(Socket &s) {
+    if (s.tx_pending == 0)
+      return;
+    s.tx_pending = 0;
+    if (!xsk_ring_prod__needs_wakeup(&s.tx))
+      return;
+    if (sendto(xsk_socket__fd(s.xsk), NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+      die("Cannot kick AF_XDP tx");
+  }
+
+  Socket &socket_of(int vm_id, uint16_t queue) {
+    return *this->sockets[vm_id * MAX_QUEUES_PER_VM + queue];
+  }
+
+public:
+  /**
+   * num_vms: number of emulated devices served by this driver
+   * mac_addr: MAC of vm 0. VM n gets mac_addr + n (like Dpdk)
+   */
+  Xdp(int num_vms, const uint8_t (*mac_addr)[6], std::string ifname) : ifname(ifname), num_vms(num_vms) {
+    this->alloc_rx_lists(num_vms, BURST_SIZE); // rxBufs point into UMEMs
+
+    this->ifindex = if_nametoindex(ifname.c_str());
+    if (this->ifindex == 0)
+      die("Unknown interface %s", ifname.c_str());
+    this->nr_queues = std::min<uint16_t>(this->query_queues(), MAX_QUEUES_PER_VM);
+    printf(":: AF_XDP on %s, %u queues\n", ifname.c_str(), this->nr_queues);
+
+    this->load_program();
+
+    for (uint16_t q = 0; q < this->nr_queues; q++) {
+      this->umems.push_back(std::make_unique<Umem>());
+      this->setup_umem(*this->umems[q]);
+    }
+    for (int vm = 0; vm < num_vms; vm++) {
+      for (uint16_t q = 0; q < MAX_QUEUES_PER_VM; q++) {
+        this->sockets.push_back(std::make_unique<Socket>());
+        if (q < this->nr_queues)
+          this->setup_socket(*this->sockets.back(), vm, q);
+      }
+
+      uint8_t mac[6];
+      memcpy(mac, mac_addr, 6);
+      Util::intcrement_mac(mac, vm);
+      this->add_switch_rule(vm, mac, 0);
+    }
+  }
+
+  virtual ~Xdp() {
+    for (auto &s : this->sockets) {
+      if (s->xsk != NULL)
+        xsk_socket__delete(s->xsk);
+    }
+    for (auto &u : this->umems) {
+      xsk_umem__delete(u->umem);
+      munmap(u->area, (size_t)NUM_FRAMES * FRAME_SIZE);
+    }
+    bpf_xdp_detach(this->ifindex, 0, NULL);
+    bpf_object__close(this->bpf_obj);
+  }
+
+  virtual int numa_node(int vm_id) {
+    std::ifstream file("/sys/class/net/" + this->ifname + "/device/numa_node");
+    int node = -1;
+    if (file.is_open())
+      file >> node;
+    return node;
+  }
+
+  virtual void send(int vm_id, const char *buf, const size_t len) {
+    if (len > FRAME_SIZE) {
+      uint64_t drops = ++this->tx_too_large;
+      if ((drops & (drops - 1)) == 0) // log at powers of two
+        printf("WARN: Xdp: frame of %zu bytes does not fit into a UMEM frame. Dropped %lu packets\n", len, drops);
+      return;
+    }
+    Socket &s = this->socket_of(vm_id, 0);
+    Umem &u = *s.umem;
+    std::lock_guard guard(u.lock);
+
+    if (u.free_frames.empty())
+      this->reclaim_tx(u);
+    uint32_t idx;
+    if (u.free_frames.empty() || xsk_ring_prod__reserve(&s.tx, 1, &idx) != 1) {
+      this->kick_tx(s);
+      uint64_t drops = ++this->tx_drops;
+      if ((drops & (drops - 1)) == 0) // log at powers of two
+        printf("WARN: Xdp: tx ring full. Dropped %lu packets\n", drops);
+      return;
+    }
+    uint64_t addr = u.free_frames.back();
+    u.free_frames.pop_back();
+    memcpy(xsk_umem__get_data(u.area, addr), buf, len);
+
+    struct xdp_desc *desc = xsk_ring_prod__tx_desc(&s.tx, idx);
+    desc->addr = addr;
+    desc->len = len;
+    xsk_ring_prod__submit(&s.tx, 1);
+    if_log_level(LOG_DEBUG, printf("send: "));
+    if_log_level(LOG_DEBUG, Util::dump_pkt((void*)buf, len));
+
+    if (++s.tx_pending >= BURST_SIZE)
+      this->kick_tx(s);
+  }
+
+  virtual void flush(int vm_id) {
+    Socket &s = this->socket_of(vm_id, 0);
+    std::lock_guard guard(s.umem->lock);
+    this->kick_tx(s);
+    this->reclaim_tx(*s.umem);
+  }
+
+  // each recv(vm) call must be followed up with a recv_consumed(vm) call (see Dpdk)
+  virtual void recv(int vm_id) {
+    for (uint16_t q = 0; q < MAX_QUEUES_PER_VM; q++)
+      this->recv_queue(vm_id, q);
+  }
+
+  virtual void recv_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->nr_queues)
+      return;
+    Socket &s = this->socket_of(vm_id, queue);
+    size_t buf_queue = this->rx_buf_queue(vm_id, queue);
+
+    if (queue == 0 && s.tx_pending > 0) {
+      // don't leave frames of devices that don't flush() in the tx ring
+      std::lock_guard guard(s.umem->lock);
+      this->kick_tx(s);
+    }
+
+    uint32_t idx;
+    uint32_t nb_rx = xsk_ring_cons__peek(&s.rx, BURST_SIZE, &idx);
+    if (nb_rx == 0) {
+      if (xsk_ring_prod__needs_wakeup(&s.umem->fill))
+        recvfrom(xsk_socket__fd(s.xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+      return;
+    }
+
+    for (uint32_t i = 0; i < nb_rx; i++) {
+      const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s.rx, idx++);
+      size_t buf = buf_queue * BURST_SIZE + i;
+      uint64_t addr = xsk_umem__add_offset_to_addr(desc->addr);
+      this->rxBufs[buf] = (char *)xsk_umem__get_data(s.umem->area, addr);
+      this->rxBuf_used[buf] = desc->len;
+      this->rxBuf_queue[buf] = {}; // make the behavioral model emulate the switching
+      s.held[i] = xsk_umem__extract_addr(desc->addr);
+      if_log_level(LOG_DEBUG, printf("recv %s queue %u: ", this->ifname.c_str(), queue));
+      if_log_level(LOG_DEBUG, Util::dump_pkt(this->rxBufs[buf], this->rxBuf_used[buf]));
+    }
+    xsk_ring_cons__release(&s.rx, nb_rx);
+    s.nb_held = nb_rx;
+    this->nb_bufs_used[buf_queue] = nb_rx;
+  }
+
+  virtual void recv_consumed(int vm_id) {
+    for (uint16_t q = 0; q < MAX_QUEUES_PER_VM; q++)
+      this->recv_consumed_queue(vm_id, q);
+  }
+
+  // give the frames of the last burst back to the fill ring
+  virtual void recv_consumed_queue(int vm_id, uint16_t queue) {
+    if (queue >= this->nr_queues)
+      return;
+    Socket &s = this->socket_of(vm_id, queue);
+    this->nb_bufs_used[this->rx_buf_queue(vm_id, queue)] = 0;
+    if (s.nb_held == 0)
+      return;
+
+    std::lock_guard guard(s.umem->lock);
+    uint32_t idx;
+    // the fill ring can hold all rx frames, so there is always room
+    if (xsk_ring_prod__reserve(&s.umem->fill, s.nb_held, &idx) != s.nb_held)
+      die("AF_XDP fill ring overflow");
+    for (uint32_t i = 0; i < s.nb_held; i++)
+      *xsk_ring_prod__fill_addr(&s.umem->fill, idx++) = s.held[i];
+    xsk_ring_prod__submit(&s.umem->fill, s.nb_held);
+    s.nb_held = 0;
+  }
+
+  // steer frames to mac_addr to vm_id. The model picks the guest queue.
+  virtual bool add_switch_rule(int vm_id, uint8_t mac_addr[6], uint16_t dst_queue) {
+    uint64_t key = mac_key(mac_addr);
+    uint32_t vm = vm_id;
+    if (bpf_map_update_elem(this->macs_fd, &key, &vm, BPF_ANY) != 0) {
+      printf("WARN: Xdp: cannot add MAC rule for vm %d\n", vm_id);
+      return false;
+    }
+    return true;
+  }
+};
@@ -33,6 +33,7 @@
 #include "interrupts/simbricks.hpp"
 #include "vfio-server.hpp"
 #include "devices/vmux-device.hpp"
+#include "local-switch.hpp"
 #include "util.hpp"
 #include <memory>
 
@@ -173,6 +174,18 @@ class Runner {
      */
     virtual void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len) = 0;
 
+    /**
+     * A burst of n packets has arrived on the wire. Models that classify
+     * packets in batches override this. ptypes (RTE_PTYPE_*, 0 if unknown)
+     * are the packet types the NIC classified the packets as, hashes (0 if
+     * none) the RSS hashes it computed with the key the model was given and
+     * csums (vmux_rx_csum, 0 if none) the checksums it verified.
+     */
+    virtual void EthRxBurst(uint8_t port, const std::optional<uint16_t> *queues, const char *const *data, const size_t *lens, const uint32_t *ptypes, const uint32_t *hashes, const uint8_t *csums, size_t n) {
+      for (size_t i = 0; i < n; i++)
+        EthRx(port, queues[i], data[i], lens[i]);
+    }
+
     /**
      * A timed event is due.
      */
@@ -241,8 +254,27 @@ class CallbackAdaptor {
       if_log_level(LOG_DEBUG, 
         printf("CallbackAdaptor::EthSend(len=%zu)\n", len)
       );
+      if (this->device->localSwitch && this->device->localSwitch->forward(this->device->device_id, data, len))
+        return;
       this->device->driver->send(this->device->device_id, (char*)data, len);
     }
+    // all packets of a TX doorbell have been passed to EthSend
+    void EthFlush() {
+      this->device->driver->flush(this->device->device_id);
+    }
+    // true if the driver takes checksums and TSO off our hands. Not with
+    // local switching: frames to local devices have to be complete.
+    bool EthOffloadsTx() {
+      if (this->device->localSwitch)
+        return false;
+      return this->device->driver->tx_offloads(this->device->device_id);
+    }
+    void EthSendOffload(const void *data, size_t len, const vmux_tx_offload &offload) {
+      if_log_level(LOG_DEBUG,
+        printf("CallbackAdaptor::EthSendOffload(len=%zu, mss=%u)\n", len, offload.tso_mss)
+      );
+      this->device->driver->send_offload(this->device->device_id, (char*)data, len, offload);
+    }
 
     void EventSchedule(nicbm::TimedEvent &evt) {
       printf("CallbackAdaptor::EventSchedule\n");
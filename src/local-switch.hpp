@@ -0,0 +1,116 @@
+#pragma once
+
+#include "devices/vmux-device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * L2 switching between the emulated devices of this vMux process.
+ *
+ * Frames a VM sends to the MAC of another local VM are handed to the
+ * receiving device directly (VmuxDevice::local_rx()) instead of going out
+ * through the driver and coming back through the NIC (or not at all, with
+ * taps). The MAC table knows the MAC of every device (base MAC + device
+ * number) and the MACs guests add with switch rules.
+ *
+ * Broadcast frames and frames to multicast groups other local devices
+ * joined are received by each of them and still passed to the driver.
+ */
+class LocalSwitch {
+private:
+  std::shared_mutex lock; // protects macs, devices and groups
+  std::unordered_map<uint64_t, int> macs; // dst mac (lower 6 bytes) -> device_id
+  std::vector<VmuxDevice *> devices; // by device_id
+  std::unordered_map<uint64_t, std::vector<int>> groups; // multicast mac -> device_ids
+  std::atomic<uint64_t> drops = 0;
+
+  static uint64_t mac_key(const uint8_t mac[6]) {
+    uint64_t key = 0;
+    memcpy(&key, mac, 6);
+    return key;
+  }
+
+  // hand a broadcast/multicast frame to every other subscribed local device
+  void replicate(int src_id, const uint8_t *dst, const void *data, size_t len) {
+    static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    std::shared_lock guard(this->lock);
+    if (memcmp(dst, broadcast, 6) == 0) {
+      for (VmuxDevice *device : this->devices) {
+        if (device != NULL && device->device_id != src_id)
+          this->deliver(device, data, len);
+      }
+      return;
+    }
+    auto group = this->groups.find(mac_key(dst));
+    if (group == this->groups.end())
+      return;
+    for (int id : group->second) {
+      if (id != src_id && (size_t)id < this->devices.size() && this->devices[id] != NULL)
+        this->deliver(this->devices[id], data, len);
+    }
+  }
+
+  void deliver(VmuxDevice *device, const void *data, size_t len) {
+    if (!device->local_rx(data, len)) {
+      uint64_t drops = ++this->drops;
+      if ((drops & (drops - 1)) == 0) // log at powers of two
+        printf("WARN: LocalSwitch: vmux%d cannot take frames. Dropped %lu packets\n", device->device_id, drops);
+    }
+  }
+
+public:
+  // device must outlive the switch
+  void add_device(VmuxDevice *device, const uint8_t mac[6]) {
+    std::unique_lock guard(this->lock);
+    if ((size_t)device->device_id >= this->devices.size())
+      this->devices.resize(device->device_id + 1);
+    this->devices[device->device_id] = device;
+    this->macs[mac_key(mac)] = device->device_id;
+  }
+
+  // learn a MAC of device_id (e.g. from switch rules of its guest)
+  void add_mac(int device_id, const uint8_t mac[6]) {
+    std::unique_lock guard(this->lock);
+    this->macs[mac_key(mac)] = device_id;
+  }
+
+  // device_id receives frames to the multicast mac
+  void join(int device_id, const uint8_t mac[6]) {
+    std::unique_lock guard(this->lock);
+    auto &members = this->groups[mac_key(mac)];
+    if (std::find(members.begin(), members.end(), device_id) == members.end())
+      members.push_back(device_id);
+  }
+
+  /**
+   * Called for every frame device src_id sends. Returns true if the frame was
+   * taken care of locally and must not be passed to the driver.
+   */
+  bool forward(int src_id, const void *data, size_t len) {
+    if (len < 6)
+      return false;
+    const uint8_t *dst = (const uint8_t *)data;
+    if (dst[0] & 1) {
+      this->replicate(src_id, dst, data, len);
+      return false; // others may be subscribed as well
+    }
+
+    VmuxDevice *device;
+    {
+      std::shared_lock guard(this->lock);
+      auto entry = this->macs.find(mac_key(dst));
+      if (entry == this->macs.end() || entry->second == src_id)
+        return false;
+      device = this->devices[entry->second];
+    }
+    this->deliver(device, data, len);
+    return true;
+  }
+};
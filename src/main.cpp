@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 #include <dirent.h>
@@ -32,6 +33,8 @@
 #include "src/vfio-server.hpp"
 
 #include "src/runner.hpp"
+#include "src/queue-affinity.hpp"
+#include "src/topology.hpp"
 
 #ifdef BUILD_E1000_EMU
   #include "devices/e1000.hpp"
@@ -40,7 +43,17 @@
 #include "devices/passthrough.hpp"
 #include "src/devices/vmux-device.hpp"
 #include "src/drivers/dpdk.hpp"
+#include "src/drivers/generator.hpp"
+#include "src/drivers/loopback.hpp"
+#include "src/drivers/null.hpp"
+#include "src/drivers/memif.hpp"
+#include "src/drivers/packet.hpp"
+#include "src/drivers/pcap.hpp"
 #include "src/drivers/tap.hpp"
+#include "src/drivers/vhost-user.hpp"
+#include "src/drivers/tap-uring.hpp"
+#include "src/drivers/xdp.hpp"
+#include "src/local-switch.hpp"
 #include "src/rx-thread.hpp"
 
 extern "C" {
@@ -102,6 +115,7 @@ Result<void> _main(int argc, char **argv) {
   std::vector<std::shared_ptr<VfioUserServer>> vfuServers;
   std::vector<std::shared_ptr<Driver>> drivers; // network backend for emulation
   std::vector<std::unique_ptr<RxThread>> pollingThreads;
+  std::vector<std::shared_ptr<QueueAffinity>> affinities; // per device, NULL if not in affinity mode
   std::string group_arg;
   // int HARDWARE_REVISION; // could be set by vfu_pci_set_class:
   // vfu_ctx->pci.config_space->hdr.rid = 0x02;
@@ -111,13 +125,27 @@ Result<void> _main(int argc, char **argv) {
   std::vector<std::string> modes;
   std::vector<cpu_set_t> rxThreadCpus;
   std::vector<cpu_set_t> runnerThreadCpus;
+  std::vector<uint16_t> dpdkPorts;
+  std::string bondMode;
+  bool affinityMode = false;
+  bool tapMultiqueue = false;
+  bool tapUring = false;
+  bool usePacket = false;
+  bool useMemif = false;
+  std::string pcapRate; // replay pcaps at this rate
+  bool useGenerator = false;
+  bool localSwitching = false;
+  std::string vhostRing; // use vhost-user with this ring layout
+  std::vector<std::vector<cpu_set_t>> vcpuMaps;
+  std::vector<cpu_set_t> vcpuMap;
   cpu_set_t default_cpuset;
   Util::parse_cpuset("0-6", default_cpuset);
   bool useDpdk = false;
+  std::string xdpInterface;
   bool pollInMainThread = false;
   uint8_t mac_addr[6];
   cpu_set_t cpuset;
-  while ((ch = getopt(argc, argv, "hd:t:s:m:a:e:f:b:qu")) != -1) {
+  while ((ch = getopt(argc, argv, "hd:t:s:m:a:e:f:b:qup:l:cv:grx:kw:yi:no")) != -1) {
     switch (ch) {
     case 'q':
       LOG_LEVEL = LOG_ERR;
@@ -152,6 +180,57 @@ Result<void> _main(int argc, char **argv) {
       }
       runnerThreadCpus.push_back(cpuset);
       break;
+    case 'p':
+      if (!Util::is_valid_number(optarg)) {
+        errno = EINVAL;
+        die("vmux%zu, Cannot parse dpdk port\n", dpdkPorts.size())
+      }
+      dpdkPorts.push_back(std::stoi(optarg));
+      break;
+    case 'l':
+      bondMode = optarg;
+      break;
+    case 'c':
+      affinityMode = true;
+      break;
+    case 'v':
+      if (!QueueAffinity::parse_vcpu_map(optarg, vcpuMap)) {
+        errno = EINVAL;
+        die("vmux%zu, Cannot parse vCPU map\n", vcpuMaps.size())
+      }
+      vcpuMaps.push_back(vcpuMap);
+      break;
+    case 'g':
+      tapMultiqueue = true;
+      break;
+    case 'r':
+      tapUring = true;
+      break;
+    case 'x':
+      xdpInterface = optarg;
+      break;
+    case 'k':
+      usePacket = true;
+      break;
+    case 'y':
+      useMemif = true;
+      break;
+    case 'i':
+      pcapRate = optarg;
+      break;
+    case 'n':
+      useGenerator = true;
+      break;
+    case 'o':
+      localSwitching = true;
+      break;
+    case 'w':
+      vhostRing = optarg;
+      if (vhostRing != "split" && vhostRing != "packed") {
+        errno = EINVAL;
+        die("Unknown virtqueue layout %s", optarg);
+      }
+      break;
     case '?':
     case 'h':
       std::cout
@@ -165,12 +244,25 @@ Result<void> _main(int argc, char **argv) {
           << "-d 0000:18:00.0                        PCI-Device (or "
              "\"none\" if not applicable)\n"
           << "-t tap-username0                       Tap device to use "
-             "as backend for emulation (or \"none\" if not applicable)\n"
+             "as backend for emulation (or \"none\" if not applicable). \"null\": discard TX, receive a fixed frame as fast as possible. \"loopback\": receive what the VM sends\n"
           << "-s /tmp/vmux.sock                      Path of the socket\n"
           << "-m passthrough                         vMux mode: "
-             "passthrough, emulation, mediation, e1000-emu\n"
-          << "-e cpuset                              pin Rx thread to cpus. Takes arguements similar to cpuset. Default: 0-6\n"
-          << "-f cpuset                              pin Runner thread to cpus.\n";
+             "passthrough, emulation, mediation, e1000-emu. With -u, switch running e810 devices with echo mediation > SOCKET.mode (or emulation)\n"
+          << "-e cpuset                              pin Rx thread to cpus. Takes arguements similar to cpuset. Default: a core on the NUMA node of the NIC and guest memory (0-6 if unknown)\n"
+          << "-f cpuset                              pin Runner thread to cpus. Default: sibling of the Rx thread's core\n"
+          << "-p 0                                   DPDK port to serve this device with. Default: 0\n"
+          << "-l 802.3ad                             Bond all DPDK ports and serve all devices with the aggregate: 802.3ad, balance-xor\n"
+          << "-c                                     Affinity mode: poll each queue in its own Rx thread close to the vCPU handling the queue's interrupt\n"
+          << "-v 8,9,10,11                           Host cpu of each vCPU of this device's VM (affinity mode). Default: read from qemu's vCPU threads\n"
+          << "-g                                     Multiqueue taps: one tap queue per guest queue pair, pass checksum/TSO work to the host kernel (emulation mode)\n"
+          << "-r                                     Do tap I/O with io_uring: batched reads and writes (emulation mode)\n"
+          << "-x eth1                                Use AF_XDP on this interface as backend instead of linux taps\n"
+          << "-k                                     -t names host interfaces (e.g. a veth) to use with AF_PACKET rings instead of taps\n"
+          << "-w split                               -t names vhost-user sockets of a switch to connect to instead of taps. Virtqueues: split, packed\n"
+          << "-y                                     -t names memif sockets (e.g. of DPDK net_memif) to connect to as client instead of taps\n"
+          << "-i x1                                  -t names pcap(ng) files to replay in a loop instead of taps (in.pcap[,capture.pcap]). Rate: max, x<speedup of the file's timing>, <frames per second>\n"
+          << "-n                                     -t names synthetic traffic to serve instead of taps, e.g. udp,flows=64,size=64,pps=1000000,reflect\n"
+          << "-o                                     Switch frames between emulated devices of this process locally instead of sending them out\n";
       return outcome::success();
     default:
       break;
@@ -191,18 +283,20 @@ Result<void> _main(int argc, char **argv) {
     die("Command line arguments need to specify the same number of devices, "
         "sockets and modes");
   }
-  if (!useDpdk && pciAddresses.size() != tapNames.size()) {
+  if (dpdkPorts.size() > pciAddresses.size()) {
     errno = EINVAL;
-    die("Command line arguments need to specify the same number of devices, "
-        "taps, sockets and modes");
+    die("Command line arguments specify more dpdk ports than devices");
   }
-
-  // fill default cpusets
-  for (size_t i = rxThreadCpus.size();  i <= sockets.size(); i++) {
-    rxThreadCpus.push_back(default_cpuset);
+  // backends that serve all devices and are busy polled
+  bool pollDriver = useDpdk || !xdpInterface.empty();
+  if (useDpdk && !xdpInterface.empty()) {
+    errno = EINVAL;
+    die("Use either dpdk or AF_XDP");
   }
-  for (size_t i = runnerThreadCpus.size();  i <= sockets.size(); i++) {
-    runnerThreadCpus.push_back(default_cpuset);
+  if (!pollDriver && pciAddresses.size() != tapNames.size()) {
+    errno = EINVAL;
+    die("Command line arguments need to specify the same number of devices, "
+        "taps, sockets and modes");
   }
 
   // parse base mac
@@ -219,17 +313,109 @@ Result<void> _main(int argc, char **argv) {
 
   int efd = epoll_create1(0);
 
-  if (!useDpdk) {
+  if (!pollDriver) {
     // create taps
     for (size_t i = 0; i < tapNames.size(); i++) {
       if (tapNames[i] == "none") {
         drivers.push_back(NULL);
         continue;
       }
+      if (tapNames[i] == "null") {
+        auto null = std::make_shared<Null>();
+        uint8_t vm_mac[6];
+        memcpy(vm_mac, base_mac, sizeof(vm_mac));
+        Util::intcrement_mac(vm_mac, i);
+        if (null->open_null(vm_mac) < 0)
+          die("Cannot open null driver");
+        drivers.push_back(null);
+        continue;
+      }
+      if (tapNames[i] == "loopback") {
+        auto loopback = std::make_shared<Loopback>();
+        if (loopback->open_loopback() < 0)
+          die("Cannot open loopback driver");
+        drivers.push_back(loopback);
+        continue;
+      }
+      bool e1000 = i < modes.size() && modes[i] == "e1000-emu";
+      if (!vhostRing.empty()) {
+        auto vhost = std::make_shared<VhostUser>();
+        int err = vhost->open_vhost(tapNames[i].c_str(), vhostRing == "packed");
+        if (err < 0) {
+          errno = -err;
+          die("Cannot connect to vhost-user socket %s", tapNames[i].c_str());
+        }
+        drivers.push_back(vhost);
+        continue;
+      }
+      if (useGenerator) {
+        auto generator = std::make_shared<Generator>();
+        uint8_t vm_mac[6];
+        memcpy(vm_mac, base_mac, sizeof(vm_mac));
+        Util::intcrement_mac(vm_mac, i);
+        if (generator->open_generator(tapNames[i].c_str(), vm_mac) < 0)
+          die("Cannot generate traffic %s", tapNames[i].c_str());
+        drivers.push_back(generator);
+        continue;
+      }
+      if (!pcapRate.empty()) {
+        auto pcap = std::make_shared<Pcap>();
+        std::string replay = tapNames[i];
+        std::string capture;
+        size_t comma = replay.find(',');
+        if (comma != std::string::npos) {
+          capture = replay.substr(comma + 1);
+          replay = replay.substr(0, comma);
+        }
+        int err = pcap->open_pcap(replay.c_str(), capture.empty() ? NULL : capture.c_str(), pcapRate.c_str());
+        if (err < 0) {
+          errno = -err;
+          die("Cannot replay %s", tapNames[i].c_str());
+        }
+        drivers.push_back(pcap);
+        continue;
+      }
+      if (useMemif) {
+        auto memif = std::make_shared<Memif>();
+        int err = memif->open_memif(tapNames[i].c_str(), i, e1000 ? 1 : Driver::MAX_QUEUES_PER_VM);
+        if (err < 0) {
+          errno = -err;
+          die("Cannot connect to memif socket %s", tapNames[i].c_str());
+        }
+        drivers.push_back(memif);
+        continue;
+      }
+      if (usePacket) {
+        auto packet = std::make_shared<Packet>();
+        int err = packet->open_packet(tapNames[i].c_str(), e1000 ? 1 : Driver::MAX_QUEUES_PER_VM);
+        if (err < 0) {
+          errno = -err;
+          die("Cannot open packet sockets on %s", tapNames[i].c_str());
+        }
+        drivers.push_back(packet);
+        continue;
+      }
+      if (tapUring && !e1000) {
+        auto tap = std::make_shared<TapUring>();
+        if (tap->open_uring(tapNames[i].c_str(), tapMultiqueue ? Driver::MAX_QUEUES_PER_VM : 0) < 0)
+          die("Cannot open tap %s", tapNames[i].c_str());
+        drivers.push_back(tap);
+        continue;
+      }
       auto tap = std::make_shared<Tap>();
-      tap->open_tap(tapNames[i].c_str());
+      if (tapMultiqueue && !e1000) {
+        if (tap->open_tap(tapNames[i].c_str(), Driver::MAX_QUEUES_PER_VM) < 0)
+          die("Cannot open multiqueue tap %s", tapNames[i].c_str());
+      } else {
+        tap->open_tap(tapNames[i].c_str());
+      }
       drivers.push_back(tap);
     }
+  } else if (!xdpInterface.empty()) {
+    auto xdp = std::make_shared<Xdp>(sockets.size(), &base_mac, xdpInterface);
+    for (size_t i = 0; i < sockets.size(); i++) {
+      drivers.push_back(xdp); // everyone shares a single AF_XDP backend
+    }
   } else {
     // init dpdk
     // move to after vfu sock creation
@@ -244,7 +430,7 @@ Result<void> _main(int argc, char **argv) {
     }
 
     auto dpdk =
-        std::make_shared<Dpdk>(sockets.size(), &base_mac, dpdk_argc, dpdk_argv);
+        std::make_shared<Dpdk>(sockets.size(), &base_mac, dpdkPorts, bondMode, dpdk_argc, dpdk_argv);
     for (size_t i = 0; i < sockets.size(); i++) {
       drivers.push_back(dpdk); // everyone shares a single dpdk backend
     }
@@ -269,9 +455,49 @@ Result<void> _main(int argc, char **argv) {
     vfioc[i]->init_msix();
   }
 
+  // Place threads that are not pinned with -e/-f on a core on the NUMA node of
+  // their NIC. The rx thread and runner of a device share a physical core.
+  auto topology = std::make_shared<Topology>();
+  size_t nrRxPinned = rxThreadCpus.size();
+  size_t nrRunnerPinned = runnerThreadCpus.size();
+  rxThreadCpus.resize(std::max(nrRxPinned, sockets.size() + 1), default_cpuset);
+  runnerThreadCpus.resize(std::max(nrRunnerPinned, sockets.size() + 1), default_cpuset);
+  std::vector<int> nicNodes; // per device
+  std::vector<bool> autoPlaced; // per device: all cpus chosen by vmux (and not by -e/-f)
+  if (!topology->discovered())
+    printf("WARN: cannot discover cpu topology. Using default cpus %s\n",
+           Topology::cpuset_str(default_cpuset).c_str());
+  for (size_t i = 0; i < sockets.size(); i++) {
+    int node = -1;
+    if (drivers[i] != NULL)
+      node = drivers[i]->numa_node(i);
+    if (node < 0 && pciAddresses[i] != "none")
+      node = Topology::pci_numa_node(pciAddresses[i]);
+    nicNodes.push_back(node);
+    autoPlaced.push_back(false);
+
+    if (i < nrRxPinned && i < nrRunnerPinned)
+      continue;
+    Topology::Core core;
+    if (!topology->allocate_core(node, core, "vmux" + std::to_string(i)))
+      continue;
+    if (i >= nrRxPinned)
+      rxThreadCpus[i] = Topology::core_cpu(core, 0);
+    if (i >= nrRunnerPinned)
+      runnerThreadCpus[i] = Topology::core_cpu(core, 1);
+    autoPlaced[i] = i >= nrRxPinned && i >= nrRunnerPinned;
+    printf("vmux%zu: NIC on NUMA node %d. Rx thread on cpus %s, runner on cpus %s (node %d)\n",
+           i, node, Topology::cpuset_str(rxThreadCpus[i]).c_str(),
+           Topology::cpuset_str(runnerThreadCpus[i]).c_str(), core.node);
+  }
+
   int nr_threads = vfioc.size() + 1; // runner threads + 1 main thread
   globalIrq = std::make_shared<GlobalInterrupts>(nr_threads);
 
+  std::shared_ptr<LocalSwitch> localSwitch = NULL;
+  if (localSwitching)
+    localSwitch = std::make_shared<LocalSwitch>();
+
   // create devices
   for (size_t i = 0; i < pciAddresses.size(); i++) {
     std::shared_ptr<VmuxDevice> device = NULL;
@@ -287,13 +513,23 @@ Result<void> _main(int argc, char **argv) {
     if (modes[i] == "stub") {
       device = std::make_shared<StubDevice>();
     }
+    // allocate the model state on the node of the runner which uses it most
+    int modelNode = topology->cpuset_numa_node(runnerThreadCpus[i]);
     if (modes[i] == "emulation") {
+      Topology::prefer_node(modelNode);
       device = std::make_shared<E810EmulatedDevice>(i, drivers[i], efd, &mac_addr, globalIrq);
+      Topology::prefer_node(-1);
     }
     if (modes[i] == "mediation") {
-      device = std::make_shared<E810EmulatedDevice>(i, drivers[i], efd, &mac_addr, globalIrq);
-      device->driver->mediation_enable(i);
+      Topology::prefer_node(modelNode);
+      auto e810 = std::make_shared<E810EmulatedDevice>(i, drivers[i], efd, &mac_addr, globalIrq);
+      Topology::prefer_node(-1);
+      e810->set_mediation(true);
+      device = e810;
     }
+    // dpdk devices can be switched between emulation and mediation at runtime
+    if (auto e810 = std::dynamic_pointer_cast<E810EmulatedDevice>(device); e810 && useDpdk)
+      e810->enable_mode_control(sockets[i] + ".mode", efd);
     if (modes[i] == "e1000-emu") {
 #ifdef BUILD_E1000_EMU
       device = std::make_shared<E1000EmulatedDevice>(i, drivers[i], efd, true,
@@ -304,11 +540,24 @@ Result<void> _main(int argc, char **argv) {
     }
     if (device == NULL)
       die("Unknown mode specified: %s\n", modes[i].c_str());
+    if (localSwitch != NULL) {
+      if (auto e810 = std::dynamic_pointer_cast<E810EmulatedDevice>(device))
+        e810->enable_local_switch(localSwitch, efd);
+    }
     devices.push_back(device);
-    if (useDpdk && pollInMainThread)
+    if (pollDriver && pollInMainThread)
       mainThreadPolling.push_back(device);
-    if (useDpdk && !pollInMainThread) {
+    if (pollDriver && !pollInMainThread && affinityMode && device->nr_rx_queues() > 0) {
+      auto affinity = std::make_shared<QueueAffinity>(topology,
+          i < vcpuMaps.size() ? vcpuMaps[i] : std::vector<cpu_set_t>());
+      affinities.push_back(affinity);
+      for (uint16_t q = 0; q < device->nr_rx_queues(); q++)
+        pollingThreads.push_back(std::make_unique<RxThread>(device, rxThreadCpus[i], q, affinity));
+    } else if (pollDriver && !pollInMainThread) {
+      affinities.push_back(NULL);
       pollingThreads.push_back(std::make_unique<RxThread>(device, rxThreadCpus[i]));
+    } else {
+      affinities.push_back(NULL);
     }
   }
 
@@ -337,6 +586,51 @@ Result<void> _main(int argc, char **argv) {
     }
   }
 
+  // Guest memory is known once the VMs mapped their DMA regions. The rx thread
+  // writes into it for every packet, so we move automatically placed threads
+  // to its node and report what still crosses nodes.
+  for (size_t i = 0; i < pciAddresses.size() && !quit.load(); i++) {
+    for (int retries = 0; vfuServers[i]->guest_numa_node.load() < 0 && retries < 100; retries++)
+      usleep(10000);
+    int guestNode = vfuServers[i]->guest_numa_node.load();
+    if (guestNode < 0) {
+      printf("vmux%zu: NUMA node of guest memory unknown\n", i);
+      continue;
+    }
+    if (autoPlaced[i] && topology->cpuset_numa_node(runnerThreadCpus[i]) != guestNode) {
+      Topology::Core core;
+      if (topology->allocate_core(guestNode, core, "vmux" + std::to_string(i)) &&
+          core.node == guestNode) {
+        rxThreadCpus[i] = Topology::core_cpu(core, 0);
+        runnerThreadCpus[i] = Topology::core_cpu(core, 1);
+        for (auto &pollingThread : pollingThreads) {
+          if (pollingThread->device->device_id == (int)i)
+            pollingThread->cpupin = rxThreadCpus[i];
+        }
+        runner[i]->repin(runnerThreadCpus[i]);
+        printf("vmux%zu: guest memory on NUMA node %d. Moved rx thread to cpus %s, runner to cpus %s (device model stays)\n",
+               i, guestNode, Topology::cpuset_str(rxThreadCpus[i]).c_str(),
+               Topology::cpuset_str(runnerThreadCpus[i]).c_str());
+      }
+    }
+    int threadNode = topology->cpuset_numa_node(runnerThreadCpus[i]);
+    if (threadNode != guestNode)
+      printf("WARN: vmux%zu: threads on NUMA node %d but guest memory on node %d: copies into guest memory cross nodes\n",
+             i, threadNode, guestNode);
+    if (nicNodes[i] >= 0 && nicNodes[i] != guestNode)
+      printf("WARN: vmux%zu: NIC on NUMA node %d but guest memory on node %d: packet buffers cross nodes\n",
+             i, nicNodes[i], guestNode);
+  }
+
+  // affinity mode: learn where the vCPUs of each VM run
+  for (size_t i = 0; i < affinities.size(); i++) {
+    if (affinities[i] == NULL)
+      continue;
+    pid_t qemu = vfuServers[i]->peer_pid();
+    if (qemu < 0 || !affinities[i]->discover(qemu))
+      printf("WARN: vmux%zu: vCPU placement unknown. Queues are processed where they are.\n", i);
+  }
+
   for (auto &pollingThread : pollingThreads) {
     pollingThread->start();
   }
@@ -348,7 +642,7 @@ Result<void> _main(int argc, char **argv) {
 
   // runtime loop
   int poll_timeout;
-  if (useDpdk && pollInMainThread) {
+  if (pollDriver && pollInMainThread) {
     poll_timeout = 0; // dpdk: busy polling
   } else {
     poll_timeout = 500; // default: event based
@@ -383,7 +677,9 @@ Result<void> _main(int argc, char **argv) {
 
   for (size_t i = 0; i < pciAddresses.size(); i++) {
     runner[i]->stop();
-    pollingThreads[i]->stop();
+  }
+  for (auto &pollingThread : pollingThreads) {
+    pollingThread->stop();
   }
 
   Result<void> res = Ok();
@@ -392,6 +688,8 @@ Result<void> _main(int argc, char **argv) {
       printf("Runner thread %zu failed: %s\n", i, e.error().c_str());
       res = Err("Terminating because a thread failed.");
     }
+  }
+  for (size_t i = 0; i < pollingThreads.size(); i++) {
     if (Result<void> e = pollingThreads[i]->join()) {} else {
       printf("Poling rx thread %zu failed: %s\n", i, e.error().c_str());
       res = Err("Terminating because a thread failed.");
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "src/topology.hpp"
+#include "src/util.hpp"
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Affinity mode: decides where to process an rx queue of a device, so that
+ * packets are copied into guest buffers on a core which shares its L2 (or at
+ * least its LLC) with the vCPU that will consume them.
+ *
+ * - queue -> vector: what the guest wrote to QINT_RQCTL/QINT_TQCTL
+ *   (VmuxDevice::rx_queue_vector()).
+ * - vector -> vCPU: QEMU emulates the MSI-X table itself, so vMux never sees
+ *   the message address (destination APIC). We assume the spread of the linux
+ *   ice driver instead: vector 0 is the misc interrupt, vector n+1 interrupts
+ *   vCPU n.
+ * - vCPU -> host cpus: supplied by the operator (-v) or read from the
+ *   affinity of QEMU's "CPU n/KVM" threads.
+ */
+class QueueAffinity {
+  std::shared_ptr<Topology> topology;
+  std::vector<cpu_set_t> vcpu_cpus; // per vCPU
+  std::map<int, cpu_set_t> vector_cpus; // placements handed out so far
+  std::mutex lock;
+
+public:
+  QueueAffinity(std::shared_ptr<Topology> topology, std::vector<cpu_set_t> vcpu_cpus)
+      : topology(topology), vcpu_cpus(vcpu_cpus) {}
+
+  // parse a vCPU map: the host cpu of each vCPU, e.g. 8,9,10,11
+  static bool parse_vcpu_map(const std::string &map, std::vector<cpu_set_t> &vcpu_cpus) {
+    std::stringstream ss(map);
+    std::string token;
+    vcpu_cpus.clear();
+    while (std::getline(ss, token, ',')) {
+      if (!Util::is_valid_number(token))
+        return false;
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(std::stoi(token), &cpus);
+      vcpu_cpus.push_back(cpus);
+    }
+    return !vcpu_cpus.empty();
+  }
+
+  /**
+   * Learn the vCPU map from the affinity of the vCPU threads of a QEMU
+   * process. Only works if the vCPUs are pinned.
+   */
+  bool discover(pid_t qemu_pid) {
+    std::lock_guard guard(this->lock);
+    if (!this->vcpu_cpus.empty())
+      return true; // set by operator
+    std::string path = "/proc/" + std::to_string(qemu_pid) + "/task";
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL)
+      return false;
+
+    std::map<int, cpu_set_t> found;
+    struct dirent *task;
+    while ((task = readdir(dir)) != NULL) {
+      if (!Util::is_valid_number(task->d_name))
+        continue;
+      std::ifstream comm_file(path + "/" + task->d_name + "/comm");
+      std::string comm;
+      std::getline(comm_file, comm);
+      int vcpu;
+      if (sscanf(comm.c_str(), "CPU %d/KVM", &vcpu) != 1)
+        continue;
+      cpu_set_t cpus;
+      if (sched_getaffinity(std::stoi(task->d_name), sizeof(cpus), &cpus) != 0)
+        continue;
+      found[vcpu] = cpus;
+    }
+    closedir(dir);
+
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (size_t vcpu = 0; vcpu < found.size(); vcpu++) {
+      // vCPUs must be numbered densely and pinned to be of any use
+      if (!found.count(vcpu) || CPU_COUNT(&found[vcpu]) >= nr_cpus) {
+        printf("WARN: QueueAffinity: vCPU threads of qemu (pid %d) are not pinned. Use -v.\n", qemu_pid);
+        return false;
+      }
+      this->vcpu_cpus.push_back(found[vcpu]);
+    }
+    return !this->vcpu_cpus.empty();
+  }
+
+  bool known() {
+    std::lock_guard guard(this->lock);
+    return !this->vcpu_cpus.empty();
+  }
+
+  /**
+   * cpus on which to process a queue that interrupts vector. Queues of the
+   * same vector are placed together.
+   */
+  std::optional<cpu_set_t> cpus_for_vector(int vector, std::string purpose) {
+    std::lock_guard guard(this->lock);
+    if (this->vcpu_cpus.empty() || vector < 1)
+      return {}; // no vCPU map or misc interrupt
+    if (this->vector_cpus.count(vector))
+      return this->vector_cpus[vector];
+
+    size_t vcpu = (vector - 1) % this->vcpu_cpus.size();
+    cpu_set_t cpus;
+    if (!this->topology->allocate_core_near(this->vcpu_cpus[vcpu], cpus, purpose))
+      return {};
+    printf("%s: vector %d interrupts vCPU %zu on cpus %s. Processing on cpus %s\n",
+           purpose.c_str(), vector, vcpu, Topology::cpuset_str(this->vcpu_cpus[vcpu]).c_str(),
+           Topology::cpuset_str(cpus).c_str());
+    this->vector_cpus[vector] = cpus;
+    return cpus;
+  }
+};
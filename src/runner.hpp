@@ -26,6 +26,8 @@ public:
   std::string socket;
   std::string termination_error; // non-null if Runner terminated with error
   cpu_set_t cpupin;
+  cpu_set_t requested_cpupin; // written by repin(), applied by the runner thread
+  std::atomic_bool repin_requested = false;
 
   // void (*VmuxRunner::interrupt_handler)(void);
 
@@ -53,15 +55,16 @@ public:
     if (ret != 0) {
       die("cant rename thread");
     }
-
-    // set cpu affinity
-    ret = pthread_setaffinity_np(thread, sizeof(this->cpupin), &this->cpupin);
-    if (ret != 0)
-        die("failed to set pthread cpu affinity");
   }
 
   void stop() { running.store(0); }
 
+  // Move the runner to other cpus. Takes effect with the next poll of the runner thread.
+  void repin(cpu_set_t cpus) {
+    this->requested_cpupin = cpus;
+    this->repin_requested.store(true);
+  }
+
   Result<void> join() {
     runner.join();
     if (!this->termination_error.empty()) {
@@ -84,7 +87,34 @@ private:
     raise(SIGINT); // signal abortion to main thread
   }
 
+  // set cpu affinity before registering with the driver so that it sees our final cpus
+  void pin() {
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(this->cpupin), &this->cpupin);
+    if (ret != 0)
+        die("failed to set pthread cpu affinity");
+
+    // we may send packets when the guest rings tx doorbells
+    if (this->device->driver)
+      this->device->driver->register_thread();
+  }
+
+  // undo pin(): the next pin() registers with the driver again
+  void unpin() {
+    if (this->device->driver)
+      this->device->driver->unregister_thread();
+
+    cpu_set_t all;
+    CPU_ZERO(&all);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &all);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(all), &all);
+    if (ret != 0)
+        die("failed to reset pthread cpu affinity");
+  }
+
   void run() {
+    this->pin();
+
     this->initilize();
     state.store(INITILIZED);
     printf("%s: Waiting for qemu to attach...\n", this->socket.c_str());
@@ -106,6 +136,12 @@ private:
         (struct pollfd){.fd = vfu_get_poll_fd(vfu->vfu_ctx), .events = POLLIN};
 
     while (running.load()) {
+      if (this->repin_requested.exchange(false)) {
+        this->unpin();
+        this->cpupin = this->requested_cpupin;
+        this->pin();
+      }
+
       int ret = poll(&pfd, 1, 500);
       // printf("poll runner\n");
 
@@ -126,6 +162,8 @@ private:
         }
       }
     }
+
+    this->unpin();
   }
 
   void add_caps(std::shared_ptr<VfioConsumer> vfioc) {
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "devices/vmux-device.hpp"
+#include "queue-affinity.hpp"
 #include "util.hpp"
 #include <atomic>
+#include <memory>
 #include <thread>
 
 /**
  * Does busy polling on the VmuxDevices rx_callback (should probably only be used with DPDK drivers).
+ *
+ * In affinity mode, a thread polls only a single queue of the device and
+ * follows the vCPU the guest assigned to the queue's interrupt vector.
  */
 class RxThread {
   public:
@@ -15,9 +20,18 @@ class RxThread {
     std::string termination_error; // non-null if Runner terminated with error
     std::shared_ptr<VmuxDevice> device;
     cpu_set_t cpupin;
+    int queue = -1; // affinity mode: the only queue to poll
+    std::shared_ptr<QueueAffinity> affinity;
+
+    // polls between checks whether the guest moved the queue's interrupt
+    static const uint64_t AFFINITY_CHECK_POLLS = 1 << 20;
 
     RxThread(std::shared_ptr<VmuxDevice> device, cpu_set_t cpupin): device(device), cpupin(cpupin) { }
 
+    RxThread(std::shared_ptr<VmuxDevice> device, cpu_set_t cpupin, int queue,
+             std::shared_ptr<QueueAffinity> affinity)
+        : device(device), cpupin(cpupin), queue(queue), affinity(affinity) { }
+
     void start() {
       running.store(1);
       runner = std::thread(&RxThread::run, this);
@@ -25,16 +39,14 @@ class RxThread {
 
       // set name
       char name[16] = { 0 };
-      snprintf(name, 16, "vmuxRx%u", device->device_id);
+      if (this->queue < 0)
+        snprintf(name, 16, "vmuxRx%u", device->device_id);
+      else
+        snprintf(name, 16, "vmuxRx%u.%d", device->device_id, this->queue);
       int ret = pthread_setname_np(thread, name);
       if (ret != 0) {
         die("cant rename thread");
       }
-
-      // set cpu affinity
-      ret = pthread_setaffinity_np(thread, sizeof(this->cpupin), &this->cpupin);
-      if (ret != 0)
-          die("failed to set pthread cpu affinity");
     }
 
     void stop() { running.store(0); }
@@ -48,10 +60,45 @@ class RxThread {
     }
 
   private:
+    int last_vector = -1;
+
+    // set cpu affinity before registering with the driver so that it sees our final cpus
+    void pin() {
+      int ret = pthread_setaffinity_np(pthread_self(), sizeof(this->cpupin), &this->cpupin);
+      if (ret != 0)
+          die("failed to set pthread cpu affinity");
+      device->driver->register_thread();
+    }
+
+    // move next to the vCPU which handles our queue's interrupt
+    void follow_vector() {
+      int vector = device->rx_queue_vector(this->queue);
+      if (vector == this->last_vector)
+        return;
+      this->last_vector = vector;
+      std::string name = "vmux" + std::to_string(device->device_id) + " queue " + std::to_string(this->queue);
+      std::optional<cpu_set_t> cpus = this->affinity->cpus_for_vector(vector, name);
+      if (!cpus.has_value() || CPU_EQUAL(&cpus.value(), &this->cpupin))
+        return;
+      device->driver->unregister_thread();
+      this->cpupin = cpus.value();
+      this->pin();
+    }
+
     void run() {
-      while (running.load()) {
-        // dpdk: do busy polling
-        device->rx_callback(device->device_id, device.get());
+      this->pin();
+      if (this->queue < 0) {
+        while (running.load()) {
+          // dpdk: do busy polling
+          device->rx_callback(device->device_id, device.get());
+        }
+      } else {
+        for (uint64_t polls = 0; running.load(); polls++) {
+          if (this->affinity && polls % AFFINITY_CHECK_POLLS == 0)
+            this->follow_vector();
+          device->poll_rx_queue(this->queue);
+        }
       }
+      device->driver->unregister_thread();
     }
 };
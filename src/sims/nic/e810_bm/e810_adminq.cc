@@ -370,6 +370,9 @@ void queue_admin_tx::admin_desc_ctx::process() {
         reinterpret_cast<struct ice_aqc_get_set_rss_key *>(
                 d->params.raw);
 
+    // 40 byte standard key, followed by the 12 byte extended key
+    memcpy(dev.regs.pfqf_hkey, data, std::min<size_t>(d->datalen, sizeof(dev.regs.pfqf_hkey)));
+    dev.lanmgr.rss_key_updated();
     desc_complete_indir(0, data, d->datalen);
   } else if (d->opcode == ice_aqc_opc_set_rss_lut) {
     struct ice_aqc_get_set_rss_lut *v =
@@ -380,6 +383,7 @@ void queue_admin_tx::admin_desc_ctx::process() {
       // We use this RSS setting to detect DPDK based Fastclick to fix its unexplainable reg_idx queue offset.
       dev.vsi0_first_queue = 1;
     }
+    dev.lanmgr.rss_lut_updated(static_cast<const uint8_t *>(data), d->datalen);
     desc_complete_indir(0, data, d->datalen);
   // }
 //   else if (d->opcode == i40e_aqc_opc_set_switch_config) {
@@ -53,7 +53,8 @@ e810_bm::e810_bm()
       lanmgr(*this, NUM_QUEUES),
       cem(*this, NUM_QUEUES),
       ptp(*this),
-      bcam(*this) {
+      bcam(*this),
+      fdir(*this) {
   reset(false);
 }
 
@@ -99,6 +100,13 @@ void e810_bm::EthRx(uint8_t port, std::optional<uint16_t> queue, const void *dat
   lanmgr.packet_received(data, len, queue);
 }
 
+void e810_bm::EthRxBurst(uint8_t port, const std::optional<uint16_t> *queues, const char *const *data, const size_t *lens, const uint32_t *ptypes, const uint32_t *hashes, const uint8_t *csums, size_t n) {
+#ifdef DEBUG_DEV
+  std::cout << "e810: received burst of " << n << " packets" << logger::endl;
+#endif
+  lanmgr.packets_received(queues, data, lens, ptypes, hashes, csums, n);
+}
+
 void e810_bm::RegRead(uint8_t bar, uint64_t addr, void *dest, size_t len) {
   uint32_t *dest_p = reinterpret_cast<uint32_t *>(dest);
 
@@ -1136,6 +1144,23 @@ void e810_bm::Timed(nicbm::TimedEvent &ev) {
   }
 }
 
+void e810_bm::UseNicClock(bool nic) {
+  ptp.use_nic_clock(nic);
+}
+
+int e810_bm::QueueVector(uint16_t queue) {
+  size_t idx = vsi0_first_queue + queue;
+  if (idx >= NUM_QUEUES)
+    return -1;
+  uint32_t rqctl = regs.qint_rqctl[idx];
+  if (rqctl & QINT_RQCTL_CAUSE_ENA_M)
+    return (rqctl & QINT_RQCTL_MSIX_INDX_M) >> QINT_RQCTL_MSIX_INDX_S;
+  uint32_t tqctl = regs.qint_tqctl[idx];
+  if (tqctl & QINT_TQCTL_CAUSE_ENA_M)
+    return (tqctl & QINT_TQCTL_MSIX_INDX_M) >> QINT_TQCTL_MSIX_INDX_S;
+  return -1;
+}
+
 /*
  * e810_bm reads itr from GLINT_CEQCTL ITR index field. This index refers to GLINT_ITR{0..2}.
  */
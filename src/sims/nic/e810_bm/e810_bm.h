@@ -29,6 +29,8 @@
 #include <deque>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include <src/libsimbricks/simbricks/pcie/proto.h>
 }
@@ -36,6 +38,7 @@ extern "C" {
 #include <src/libsimbricks/simbricks/nicbm/nicbm.h>
 #include "sims/nic/e810_bm/e810_base_wrapper.h"
 #include "sims/nic/e810_bm/e810_bm.h"
+#include "sims/nic/e810_bm/e810_pkt_meta.h"
 #include "sims/nic/e810_bm/e810_ptp.h"
 
 // #define DEBUG_DEV
@@ -606,6 +609,7 @@ class lan_queue_base : public queue_base {
 class lan_queue_tx : public lan_queue_base {
  protected:
   static const uint16_t MTU = 9024;
+  static const uint32_t MAX_TSO_UNIT = 65536; // largest unit we hand to the driver unsegmented
 
   class tx_desc_ctx : public desc_ctx {
    protected:
@@ -638,6 +642,7 @@ class lan_queue_tx : public lan_queue_base {
   uint8_t pktbuf[MTU];
   uint32_t tso_off;
   uint32_t tso_len;
+  std::vector<uint8_t> tso_unit; // whole TSO unit, if the driver does TSO
   std::deque<tx_desc_ctx *> ready_segments;
 
   bool hwb;
@@ -649,6 +654,9 @@ class lan_queue_tx : public lan_queue_base {
   virtual void do_writeback(uint32_t first_idx, uint32_t first_pos,
                             uint32_t cnt);
   bool trigger_tx_packet();
+  void trigger_tx_offload(size_t d_skip, size_t dcnt, uint32_t total_len,
+                          uint16_t maclen, uint16_t iplen, uint16_t l4len,
+                          uint32_t tso_mss);
   void trigger_tx();
 
  public:
@@ -658,6 +666,13 @@ class lan_queue_tx : public lan_queue_base {
   virtual void reset();
 };
 
+// what the rx descriptors of a frame report besides its data
+struct rx_desc_meta {
+  uint32_t hash; // rss hash, 0: not hashed
+  uint16_t ptype; // ICE_PTT index, 0: unknown
+  uint8_t csum; // vmux_rx_csum flags of the verified checksums
+};
+
 class lan_queue_rx : public lan_queue_base {
  protected:
   class rx_desc_ctx : public desc_ctx {
@@ -668,7 +683,8 @@ class lan_queue_rx : public lan_queue_base {
    public:
     explicit rx_desc_ctx(lan_queue_rx &queue_);
     virtual void process();
-    void packet_received(const void *data, size_t len, e810_timestamp_t timestamp, bool last);
+    void packet_received(const void *data, size_t len, const rx_desc_meta &meta,
+                         e810_timestamp_t timestamp, bool last);
 
  };
 
@@ -687,8 +703,8 @@ class lan_queue_rx : public lan_queue_base {
                uint32_t &fpm_basereg, uint32_t &reg_intqctl);
   
   virtual void reset();
-  void packet_received(const void *data, size_t len, uint32_t hash);
-  bool ptp_should_sample_rx(const void *data, size_t len);
+  void packet_received(const void *data, size_t len, const rx_desc_meta &meta, bool ptp);
+  bool ptp_should_sample_rx(bool ptp);
 };
 
 class rss_key_cache {
@@ -708,6 +724,62 @@ class rss_key_cache {
   uint32_t hash_ipv4(uint32_t sip, uint32_t dip, uint16_t sp, uint16_t dp);
 };
 
+/**
+ * Exact match cache of what the classification of received frames (switch,
+ * rss, ptp) decided for recent flows: a hit costs one hash probe instead of
+ * a switch lookup and a toeplitz hash. Set associative, least recently used
+ * entries of a set are replaced. invalidate() drops all entries at once and
+ * must be called whenever an input of the classification changes.
+ */
+class flow_cache {
+ public:
+  struct key {
+    uint64_t mac_vlan; // dst mac (bits 0-47), vlan (48-59)
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t ethertype;
+    uint8_t proto;
+
+    bool operator==(const key &other) const = default;
+  };
+
+  struct result {
+    uint16_t queue; // for frames without queue hint
+    uint32_t hash;
+    bool ptp; // ptp event frame (rx timestamp)
+    bool drop; // by a flow director filter
+    bool rss; // queue from the rss lut (no switch or flow director rule)
+  };
+
+  static const size_t SETS = 1024; // power of two
+  static const size_t WAYS = 4;
+
+ private:
+  struct entry {
+    key k;
+    result r;
+    uint32_t gen; // valid if == flow_cache::gen
+    uint32_t last_used;
+  };
+  std::vector<entry> entries; // SETS * WAYS
+  uint32_t gen = 1;
+  uint32_t clock = 0;
+
+ public:
+  flow_cache() : entries(SETS * WAYS) {};
+
+  // frames without ip header are not worth caching
+  static bool cacheable(const pkt_meta &meta) { return meta.l3_off != 0; }
+  static key make_key(const pkt_meta &meta);
+  static size_t set(const key &k);
+  void prefetch(size_t set) const { __builtin_prefetch(&entries[set * WAYS]); }
+  bool lookup(const key &k, size_t set, result *r);
+  void insert(const key &k, size_t set, const result &r);
+  void invalidate() { gen++; }
+};
+
 // rx tx management
 class lan {
  protected:
@@ -723,8 +795,13 @@ class lan {
   lan_queue_tx **txqs;
   size_t rss_last_queue = -1; // may be used to serve queues in round robin fashion. Consumers shall wrap to MIN_QUEUE value if this exceeds MAX_QUEUE value.
 
-  bool rss_steering(const void *data, size_t len, uint16_t &queue,
-                    uint32_t &hash);
+  flow_cache flows;
+  std::vector<uint8_t> rss_lut; // vsi queue by hash, empty: not set by the guest
+
+  bool rss_steering(const pkt_meta &meta, uint32_t nic_hash, uint16_t &queue, uint32_t &hash);
+  void mirror_rss();
+  static bool is_ptp(const pkt_meta &meta);
+  void deliver(const void *data, size_t len, uint16_t queue, const rx_desc_meta &meta, bool ptp);
 
  public:
   lan(e810_bm &dev, size_t num_qs);
@@ -732,7 +809,10 @@ class lan {
   void qena_updated(uint16_t idx, bool rx);
   void tail_updated(uint16_t idx, bool rx);
   void rss_key_updated();
+  void rss_lut_updated(const uint8_t *lut, size_t len);
+  void switch_rules_updated();
   void packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint);
+  void packets_received(const std::optional<uint16_t> *queue_hints, const char *const *data, const size_t *lens, const uint32_t *ptypes, const uint32_t *hashes, const uint8_t *csums, size_t n);
 };
 
 class completion_event_manager {
@@ -765,21 +845,107 @@ class shadow_ram {
   void write(uint16_t addr, uint16_t val);
 };
 
+/**
+ * Open addressing hash table (linear probing) of switch rule keys -> queue.
+ * Lookups are split into bucket() and find(), so a burst can prefetch all
+ * its buckets before probing them.
+ */
+class switch_table {
+  struct entry {
+    uint64_t key; // 0: empty
+    uint16_t queue; // first queue of the group
+    uint8_t region; // the group has 1 << region queues
+  };
+  std::vector<entry> entries; // size is a power of two
+  size_t used = 0;
+
+  void grow();
+
+ public:
+  switch_table() : entries(64) {};
+
+  bool empty() const { return used == 0; }
+  size_t bucket(uint64_t key) const;
+  void prefetch(size_t bucket) const { __builtin_prefetch(&entries[bucket]); }
+  bool find(uint64_t key, size_t bucket, uint16_t *queue, uint8_t *region) const;
+  void insert(uint64_t key, uint16_t queue, uint8_t region);
+};
+
 class e810_switch {
-  std::map<uint64_t, uint16_t> mac_rules; // dst mac address (odd alignment/byte order...) -> dst queue idx
+  // lookup types of LKUP_RX rules we emulate, in order of precedence
+  enum lookup { LKUP_MAC_VLAN = 1, LKUP_MAC, LKUP_VLAN, LKUP_ETHERTYPE, LKUP_NUM };
+  // key: lookup type (bits 60-63), vlan id (48-59), dst mac or ethertype (0-47)
+  static uint64_t rule_key(lookup type, uint64_t mac_or_ethertype, uint16_t vlan) {
+    return ((uint64_t)type << 60) | ((uint64_t)(vlan & 0xfff) << 48) | (mac_or_ethertype & 0xFFFFFFFFFFFF);
+  }
+
+  switch_table rules; // rule_key -> dst queue idx and queue group size
+  size_t nr_rules[LKUP_NUM] = {}; // per lookup type, to skip types without rules
   e810_bm &dev;
 
   public:
+  static const size_t BURST_SIZE = 32;
 
   e810_switch(e810_bm &dev_) : dev(dev_) {};
 
   bool add_rule(struct ice_aqc_sw_rules_elem *add_sw_rules);
+  bool add_multicast_rule(struct ice_aqc_sw_rules_elem *add_sw_rules);
 
-  void select_queue(const void* data, size_t len, uint16_t* queue);
+  void select_queue(const pkt_meta &meta, uint16_t* queue, uint8_t *region);
+  // select_queue for n <= BURST_SIZE frames at once
+  void select_queues(const pkt_meta *metas, uint16_t *queues, uint8_t *regions, size_t n);
 
   static void print_sw_rule(struct ice_aqc_sw_rules_elem *add_sw_rules);
 };
 
+/**
+ * Flow director: the filters the guest programs with filter programming
+ * descriptors on its tx queues (ethtool ntuple filters and aRFS). Each
+ * descriptor is followed by a dummy packet with the fields to match. We
+ * understand ipv4 filters and match the fields the dummy packet sets (zero
+ * fields match anything). Filters on the whole 5-tuple (aRFS) are found with
+ * one hash lookup, the others are searched.
+ */
+class e810_fdir {
+  struct tuple {
+    uint32_t src_ip; // host byte order
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t proto;
+
+    bool operator==(const tuple &other) const = default;
+    bool exact() const { return src_ip && dst_ip && src_port && dst_port && proto; }
+  };
+  struct tuple_hash {
+    size_t operator()(const tuple &t) const;
+  };
+  struct filter {
+    tuple match;
+    uint16_t queue; // dst queue idx
+    bool drop;
+  };
+
+  std::unordered_map<uint32_t, filter> filters; // fd id -> filter
+  std::unordered_map<tuple, uint32_t, tuple_hash> exact; // full 5-tuple -> fd id
+  std::vector<uint32_t> wildcard; // fd ids of the other filters
+  e810_bm &dev;
+
+  static bool matches(const tuple &match, const pkt_meta &meta);
+  struct vmux_flow_rule flow_rule(const filter &f) const;
+  void add(uint32_t fd_id, const filter &f);
+  void remove(uint32_t fd_id);
+
+  public:
+  e810_fdir(e810_bm &dev_) : dev(dev_) {};
+
+  // a filter programming descriptor and the dummy packet of the next descriptor
+  void program(const struct ice_fltr_desc *desc, const void *pkt, size_t len);
+  bool empty() const { return filters.empty(); }
+  // false if no filter matches the frame
+  bool lookup(const pkt_meta &meta, uint16_t *queue, bool *drop) const;
+};
+
 class e810_bm : public nicbm::Runner::Device {
  protected:
   friend class queue_admin_tx;
@@ -793,6 +959,7 @@ class e810_bm : public nicbm::Runner::Device {
   friend class lan_queue_tx;
   friend class shadow_ram;
   friend class e810_switch;
+  friend class e810_fdir;
 
   static const unsigned BAR_REGS = 0;
   static const unsigned BAR_IO = 2;
@@ -1003,11 +1170,19 @@ class e810_bm : public nicbm::Runner::Device {
   virtual void RegWrite32(uint8_t bar, uint64_t addr, uint32_t val);
   void DmaComplete(nicbm::DMAOp &op) override;
   void EthRx(uint8_t port, std::optional<uint16_t> queue, const void *data, size_t len) override;
+  void EthRxBurst(uint8_t port, const std::optional<uint16_t> *queues, const char *const *data, const size_t *lens, const uint32_t *ptypes, const uint32_t *hashes, const uint8_t *csums, size_t n) override;
   void Timed(nicbm::TimedEvent &ev) override;
   e810_timestamp_t ReadCurrentTimestamp();
 
   virtual void SignalInterrupt(uint16_t vector, uint8_t itr);
 
+  /** MSI-X vector the guest assigned to a VSI queue pair (QINT_RQCTL, or
+   * QINT_TQCTL if rx interrupts are disabled). -1 if not assigned. */
+  int QueueVector(uint16_t queue);
+
+  /** PTP follows NIC time (mediation) or CLOCK_MONOTONIC (emulation). */
+  void UseNicClock(bool nic);
+
  protected:
   logger log;
   e810_regs regs;
@@ -1020,6 +1195,7 @@ class e810_bm : public nicbm::Runner::Device {
   completion_event_manager cem;
   PTPManager ptp;
   e810_switch bcam; // binary content addressable memory aka switch
+  e810_fdir fdir;
 
   u8 ctx_addr[2048][22]; // 22 byte descriptors for each tx queue
   int last_used_parent_node = 3;
@@ -1065,4 +1241,13 @@ void xsum_tcpip_tso(void *iphdr, uint8_t iplen, uint8_t l4len, uint16_t paylen);
 void tso_postupdate_header(void *iphdr, uint8_t iplen, uint8_t l4len,
                            uint16_t paylen);
 
+// prepares an ipv4/tcp TSO unit for segmentation by someone else: sets the
+// ip header and places the pseudo header xsum (over l4len) in the tcp header
+void xsum_tcpip_tso_partial(void *iphdr, uint8_t iplen, uint32_t l4len);
+
+// verifies the checksums of a received frame that are not in known yet (ipv4
+// header, tcp/udp over ipv4/ipv6). Returns known and the verified ones
+// (vmux_rx_csum flags).
+uint8_t xsum_verify_rx(const void *frame, size_t len, const pkt_meta &meta, uint8_t known);
+
 }  // namespace e810
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+#include <netinet/in.h>
+using namespace std;
+#include "sims/nic/e810_bm/e810_base_wrapper.h"
+#include "sims/nic/e810_bm/e810_bm.h"
+#include "sims/nic/e810_bm/headers.h"
+
+namespace e810 {
+
+size_t e810_fdir::tuple_hash::operator()(const tuple &t) const {
+  uint64_t ips = ((uint64_t)t.src_ip << 32) | t.dst_ip;
+  uint64_t rest = ((uint64_t)t.src_port << 24) | ((uint64_t)t.dst_port << 8) | t.proto;
+  return (ips ^ (rest * 0x9E3779B97F4A7C15)) * 0xBF58476D1CE4E5B9 >> 32;
+}
+
+bool e810_fdir::matches(const tuple &match, const pkt_meta &meta) {
+  return (!match.src_ip || match.src_ip == meta.src_ip) &&
+    (!match.dst_ip || match.dst_ip == meta.dst_ip) &&
+    (!match.proto || match.proto == meta.l4_proto) &&
+    (!match.src_port || (meta.l4_off != 0 && match.src_port == meta.src_port)) &&
+    (!match.dst_port || (meta.l4_off != 0 && match.dst_port == meta.dst_port));
+}
+
+/**
+ * The filter for drivers steering in hardware. Fields are matched exactly or
+ * not at all: masks are neither in the descriptor nor in the dummy packet
+ * (the input set belongs to the flow profile), and ice only programs full or
+ * empty field masks anyways.
+ */
+struct vmux_flow_rule e810_fdir::flow_rule(const filter &f) const {
+  struct vmux_flow_rule rule;
+  rule.ip_version = 4;
+  uint32_t src_ip = htonl(f.match.src_ip);
+  uint32_t dst_ip = htonl(f.match.dst_ip);
+  memcpy(rule.src_ip, &src_ip, 4);
+  memcpy(rule.dst_ip, &dst_ip, 4);
+  rule.src_prefix = f.match.src_ip ? 32 : 0;
+  rule.dst_prefix = f.match.dst_ip ? 32 : 0;
+  rule.l4_proto = f.match.proto;
+  if (f.match.proto == IPPROTO_TCP || f.match.proto == IPPROTO_UDP) {
+    if (f.match.src_port)
+      rule.src_port = f.match.src_port;
+    if (f.match.dst_port)
+      rule.dst_port = f.match.dst_port;
+  }
+  rule.drop = f.drop;
+  if (!f.drop) // the queue index of drop filters is meaningless
+    rule.queue = f.queue - this->dev.vsi0_first_queue;
+  return rule;
+}
+
+void e810_fdir::add(uint32_t fd_id, const filter &f) {
+  this->remove(fd_id); // the guest replaces filters by adding them again
+  this->filters[fd_id] = f;
+  if (f.match.exact())
+    this->exact[f.match] = fd_id;
+  else
+    this->wildcard.push_back(fd_id);
+
+  auto driver = this->dev.vmux->device->driver;
+  driver->add_flow_rule(this->dev.vmux->device->device_id, this->flow_rule(f));
+}
+
+void e810_fdir::remove(uint32_t fd_id) {
+  auto it = this->filters.find(fd_id);
+  if (it == this->filters.end())
+    return;
+  const filter &f = it->second;
+  if (f.match.exact())
+    this->exact.erase(f.match);
+  else
+    this->wildcard.erase(std::find(this->wildcard.begin(), this->wildcard.end(), fd_id));
+
+  auto driver = this->dev.vmux->device->driver;
+  driver->del_flow_rule(this->dev.vmux->device->device_id, this->flow_rule(f));
+  this->filters.erase(it);
+}
+
+void e810_fdir::program(const struct ice_fltr_desc *desc, const void *pkt, size_t len) {
+  uint64_t qw0 = desc->qidx_compq_space_stat;
+  uint64_t qw1 = desc->dtype_cmd_vsi_fdid;
+  uint32_t fd_id = (qw1 & ICE_FXD_FLTR_QW1_FDID_M) >> ICE_FXD_FLTR_QW1_FDID_S;
+  bool remove = ((qw1 & ICE_FXD_FLTR_QW1_PCMD_M) >> ICE_FXD_FLTR_QW1_PCMD_S) == ICE_FXD_FLTR_QW1_PCMD_REMOVE;
+
+  if (remove) {
+    this->remove(fd_id);
+  } else {
+    pkt_meta meta;
+    parse_pkt_meta(pkt, len, 0, meta);
+    if (!meta.is_ipv4()) {
+      printf("WARN: e810_fdir: only ipv4 filters are supported. Ignoring filter %u\n", fd_id);
+      return;
+    }
+    filter f = {};
+    f.match.src_ip = meta.src_ip;
+    f.match.dst_ip = meta.dst_ip;
+    f.match.proto = meta.l4_proto;
+    f.match.src_port = meta.src_port;
+    f.match.dst_port = meta.dst_port;
+    f.queue = (qw0 & ICE_FXD_FLTR_QW0_QINDEX_M) >> ICE_FXD_FLTR_QW0_QINDEX_S;
+    f.drop = (qw0 & ICE_FXD_FLTR_QW0_DROP_M) >> ICE_FXD_FLTR_QW0_DROP_S;
+    this->add(fd_id, f);
+  }
+  this->dev.lanmgr.switch_rules_updated(); // flows may be steered differently now
+}
+
+/**
+ * Filters on the whole 5-tuple are the most specific ones, so they win over
+ * the others.
+ */
+bool e810_fdir::lookup(const pkt_meta &meta, uint16_t *queue, bool *drop) const {
+  if (!meta.is_ipv4())
+    return false;
+  const filter *found = NULL;
+  if (!this->exact.empty() && meta.l4_off != 0) {
+    tuple t = {};
+    t.src_ip = meta.src_ip;
+    t.dst_ip = meta.dst_ip;
+    t.src_port = meta.src_port;
+    t.dst_port = meta.dst_port;
+    t.proto = meta.l4_proto;
+    auto it = this->exact.find(t);
+    if (it != this->exact.end())
+      found = &this->filters.at(it->second);
+  }
+  for (size_t i = 0; !found && i < this->wildcard.size(); i++) {
+    const filter &f = this->filters.at(this->wildcard[i]);
+    if (matches(f.match, meta))
+      found = &f;
+  }
+  if (!found)
+    return false;
+  *queue = found->queue;
+  *drop = found->drop;
+  return true;
+}
+
+}
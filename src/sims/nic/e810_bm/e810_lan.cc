@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -37,6 +38,54 @@
 
 namespace e810 {
 
+flow_cache::key flow_cache::make_key(const pkt_meta &meta) {
+  key k;
+  memset(&k, 0, sizeof(k)); // padding is hashed
+  k.mac_vlan = meta.dst_mac | ((uint64_t)meta.vlan << 48);
+  k.src_ip = meta.src_ip;
+  k.dst_ip = meta.dst_ip;
+  k.src_port = meta.src_port;
+  k.dst_port = meta.dst_port;
+  k.ethertype = meta.ethertype;
+  k.proto = meta.l4_proto;
+  return k;
+}
+
+size_t flow_cache::set(const key &k) {
+  uint64_t words[3];
+  static_assert(sizeof(key) <= sizeof(words));
+  memset(words, 0, sizeof(words));
+  memcpy(words, &k, sizeof(k));
+  uint64_t h = (words[0] ^ (words[1] * 0x9E3779B97F4A7C15) ^ words[2]) * 0xBF58476D1CE4E5B9;
+  return (h >> 32) & (SETS - 1);
+}
+
+bool flow_cache::lookup(const key &k, size_t set, result *r) {
+  entry *ways = &entries[set * WAYS];
+  for (size_t w = 0; w < WAYS; w++) {
+    if (ways[w].gen == gen && ways[w].k == k) {
+      ways[w].last_used = ++clock;
+      *r = ways[w].r;
+      return true;
+    }
+  }
+  return false;
+}
+
+void flow_cache::insert(const key &k, size_t set, const result &r) {
+  entry *ways = &entries[set * WAYS];
+  entry *victim = &ways[0];
+  for (size_t w = 0; w < WAYS; w++) {
+    if (ways[w].gen != gen) { // invalid: take it
+      victim = &ways[w];
+      break;
+    }
+    if ((int32_t)(ways[w].last_used - victim->last_used) < 0)
+      victim = &ways[w];
+  }
+  *victim = { k, r, gen, ++clock };
+}
+
 lan::lan(e810_bm &dev_, size_t num_qs_)
     : dev(dev_), log("lan", dev_.runner_), rss_kc(dev_.regs.pfqf_hkey),
       num_qs(num_qs_) {
@@ -94,74 +143,218 @@ void lan::tail_updated(uint16_t idx, bool rx) {
                           : static_cast<lan_queue_base &>(*txqs[idx]));
   if (q.is_enabled())
     q.reg_updated();
+
+  // DMA is synchronous: everything the doorbell made available has been sent
+  if (!rx)
+    dev.vmux->EthFlush();
 }
 
 void lan::rss_key_updated() {
   rss_kc.set_dirty();
+  flows.invalidate();
+  mirror_rss();
+}
+
+void lan::rss_lut_updated(const uint8_t *lut, size_t len) {
+  rss_lut.assign(lut, lut + len);
+  flows.invalidate();
+  mirror_rss();
+}
+
+/* let the driver hash (and spread) in hardware like the guest configured it */
+void lan::mirror_rss() {
+  auto device = dev.vmux->device;
+  device->driver->set_rss(device->device_id,
+      reinterpret_cast<const uint8_t *>(dev.regs.pfqf_hkey), sizeof(dev.regs.pfqf_hkey),
+      rss_lut.data(), rss_lut.size());
+}
+
+void lan::switch_rules_updated() {
+  flows.invalidate();
 }
 
-bool lan::rss_steering(const void *data, size_t len, uint16_t &queue,
-                       uint32_t &hash) {
+/*
+ * Hashes the frame with the guest's key and picks its queue from the guest's
+ * lut. nic_hash: the hash the nic computed with the same key (0: none), saves
+ * the toeplitz hash. Only taken for the flows hashed here, which are the ones
+ * the nic hashes (RSS_TYPES of the Dpdk driver). Returns false if the frame
+ * is not hashed or there is no lut.
+ */
+bool lan::rss_steering(const pkt_meta &meta, uint32_t nic_hash, uint16_t &queue, uint32_t &hash) {
   hash = 0;
 
-  const headers::pkt_tcp *tcp =
-      reinterpret_cast<const headers::pkt_tcp *>(data);
-  const headers::pkt_udp *udp =
-      reinterpret_cast<const headers::pkt_udp *>(data);
-  // should actually determine packet type and mask with enabled packet types
+  // should actually mask with enabled packet types
   // TODO(antoinek): ipv6
-  if (tcp->eth.type == htons(ETH_TYPE_IP) && tcp->ip.proto == IP_PROTO_TCP) {
-    hash = rss_kc.hash_ipv4(ntohl(tcp->ip.src), ntohl(tcp->ip.dest),
-                            ntohs(tcp->tcp.src), ntohs(tcp->tcp.dest));
+  if (!meta.is_ipv4()) {
+    #ifdef DEBUG_LAN
+    std::cout << "rss_stearing: non-matched, return false." << logger::endl;
+    #endif
+    return false;
+  } else if (nic_hash != 0) {
+    hash = nic_hash;
+  } else if (meta.l4_off != 0 && meta.l4_proto == IP_PROTO_TCP) {
+    hash = rss_kc.hash_ipv4(meta.src_ip, meta.dst_ip,
+                            meta.src_port, meta.dst_port);
 
     #ifdef DEBUG_LAN
     std::cout << "TCP IP Ethernet" << logger::endl;
     #endif
-  } else if (udp->eth.type == htons(ETH_TYPE_IP) &&
-             udp->ip.proto == IP_PROTO_UDP) {
-    hash = rss_kc.hash_ipv4(ntohl(udp->ip.src), ntohl(udp->ip.dest),
-                            ntohs(udp->udp.src), ntohs(udp->udp.dest));
+  } else if (meta.l4_off != 0 && meta.l4_proto == IP_PROTO_UDP) {
+    hash = rss_kc.hash_ipv4(meta.src_ip, meta.dst_ip,
+                            meta.src_port, meta.dst_port);
     #ifdef DEBUG_LAN
     std::cout << "UDP IP Ethernet" << logger::endl;
     #endif
-  } else if (udp->eth.type == htons(ETH_TYPE_IP)) {
-    hash = rss_kc.hash_ipv4(ntohl(udp->ip.src), ntohl(udp->ip.dest), 0, 0);
-    #ifdef DEBUG_LAN
-    std::cout << "UDP non-IP Ethernet" << logger::endl;
-    #endif
   } else {
+    hash = rss_kc.hash_ipv4(meta.src_ip, meta.dst_ip, 0, 0);
     #ifdef DEBUG_LAN
-    std::cout << "rss_stearing: non-matched, return false." << logger::endl;
+    std::cout << "UDP non-IP Ethernet" << logger::endl;
     #endif
-    return false;
   }
 
-//   uint16_t luts =
-//       (!(dev.regs.pfqf_ctl_0 & I40E_PFQF_CTL_0_HASHLUTSIZE_MASK) ? 128 : 512);
-//   uint16_t idx = hash % luts;
-//   queue = (dev.regs.pfqf_hlut[idx / 4] >> (8 * (idx % 4))) & 0x3f;
-// #ifdef DEBUG_LAN
-//   std::cout << "  q=" << queue << " h=" << hash << " i=" << idx << logger::endl;
-// #endif
-  return true;
+  if (rss_lut.empty())
+    return false;
+  size_t idx = hash % rss_lut.size();
+  queue = dev.vsi0_first_queue + rss_lut[idx];
+#ifdef DEBUG_LAN
+  std::cout << "  q=" << queue << " h=" << hash << " i=" << idx << logger::endl;
+#endif
+  return queue < num_qs;
+}
+
+/* not in base/ice_lan_tx_rx.h. Has the rss hash in qword 3 and the flow id in
+ * flex fields 0 and 1 (ice_32b_rx_flex_desc_comms_ovs of DPDK's ice pmd) */
+static const uint8_t RXDID_COMMS_OVS = 22;
+
+/* flex profiles with the rss hash in flex fields 0 and 1 */
+static bool rxdid_hash_in_flex01(uint8_t rxdid) {
+  return rxdid == ICE_RXDID_FLEX_NIC || rxdid == ICE_RXDID_FLEX_NIC_2 ||
+         rxdid == ICE_RXDID_GSC ||
+         (rxdid >= ICE_RXDID_COMMS_GENERIC && rxdid <= ICE_RXDID_COMMS_AUX_TCP);
+}
+
+/* the packet type (ICE_PTT index) rx descriptors report for a frame */
+static uint16_t ice_ptype(const pkt_meta &meta) {
+  uint32_t l3 = meta.ptype & RTE_PTYPE_L3_MASK;
+  uint32_t l4 = meta.ptype & RTE_PTYPE_L4_MASK;
+  bool ipv4 = RTE_ETH_IS_IPV4_HDR(l3);
+  if (!ipv4 && !RTE_ETH_IS_IPV6_HDR(l3))
+    return meta.ptype != 0 ? 1 : 0; // MAC_PAY2
+  if (l4 == RTE_PTYPE_L4_FRAG)
+    return ipv4 ? 22 : 88;
+  if (l4 == RTE_PTYPE_L4_TCP)
+    return ipv4 ? 26 : 92;
+  if (l4 == RTE_PTYPE_L4_UDP)
+    return ipv4 ? 24 : 90;
+  if (meta.l4_proto == (ipv4 ? IP_PROTO_ICMP : 58))
+    return ipv4 ? 28 : 94;
+  return ipv4 ? 23 : 89; // PAY3
+}
+
+/* frames the ptp clock timestamps on rx */
+bool lan::is_ptp(const pkt_meta &meta) {
+  if (meta.l4_off != 0 && meta.l4_proto == IP_PROTO_UDP) {
+
+    // check UDP port
+    return meta.dst_port == PTP_UDP_1 || meta.dst_port == PTP_UDP_2;
+
+  } else {
+
+    // return true iff ethertype is PTP
+    return meta.ethertype == ETH_TYPE_PTP;
+  }
 }
 
 void lan::packet_received(const void *data, size_t len, std::optional<uint16_t> queue_hint) {
 #ifdef DEBUG_LAN
   std::cout << " packet received len=" << len << logger::endl;
 #endif
+  const char *frame = (const char *)data;
+  packets_received(&queue_hint, &frame, &len, NULL, NULL, NULL, 1);
+}
 
-  uint32_t hash = 0;
-  // if the driver uses VSIs, it reserves queue 0 as VSI control queue. 
-  // Rss may have to account for that.
-  // In other drivers, this dev.vsi0_first_queue + queue_id is called queue_register_id
-  uint16_t queue = dev.vsi0_first_queue + 0;
-  if (auto q = queue_hint) {
-    queue = dev.vsi0_first_queue + *q;
-  } else {
-    this->dev.bcam.select_queue(data, len, &queue);
+/*
+ * Classifies a burst of frames and passes them to their queues. The headers
+ * of every frame are parsed once. Flows in the flow cache are done with
+ * that, the others go through the switch (all of the burst at once), rss,
+ * flow director and the ptp check and are added to the cache. The checksums
+ * the driver didn't verify are verified for the descriptors.
+ */
+void lan::packets_received(const std::optional<uint16_t> *queue_hints, const char *const *data, const size_t *lens, const uint32_t *ptypes, const uint32_t *hashes, const uint8_t *csums, size_t n) {
+  const size_t BURST_SIZE = e810_switch::BURST_SIZE;
+  for (size_t first = 0; first < n; first += BURST_SIZE) {
+    size_t nb = std::min(n - first, BURST_SIZE);
+    pkt_meta metas[BURST_SIZE];
+    flow_cache::key keys[BURST_SIZE];
+    size_t sets[BURST_SIZE];
+    flow_cache::result results[BURST_SIZE];
+
+    for (size_t i = 0; i < nb; i++) {
+      parse_pkt_meta(data[first + i], lens[first + i], ptypes ? ptypes[first + i] : 0, metas[i]);
+      if (flow_cache::cacheable(metas[i])) {
+        keys[i] = flow_cache::make_key(metas[i]);
+        sets[i] = flow_cache::set(keys[i]);
+        flows.prefetch(sets[i]);
+      }
+    }
+
+    // frames of flows we don't know yet
+    pkt_meta miss_metas[BURST_SIZE];
+    size_t misses[BURST_SIZE];
+    size_t nb_miss = 0;
+    for (size_t i = 0; i < nb; i++) {
+      if (flow_cache::cacheable(metas[i]) && flows.lookup(keys[i], sets[i], &results[i]))
+        continue;
+      misses[nb_miss] = i;
+      miss_metas[nb_miss++] = metas[i];
+    }
+
+    if (nb_miss > 0) {
+      // if the driver uses VSIs, it reserves queue 0 as VSI control queue. 
+      // Rss may have to account for that.
+      // In other drivers, this dev.vsi0_first_queue + queue_id is called queue_register_id
+      const uint16_t NO_QUEUE = UINT16_MAX;
+      uint16_t queues[BURST_SIZE];
+      uint8_t regions[BURST_SIZE] = {};
+      std::fill(queues, queues + nb_miss, NO_QUEUE);
+      this->dev.bcam.select_queues(miss_metas, queues, regions, nb_miss);
+      for (size_t j = 0; j < nb_miss; j++) {
+        size_t i = misses[j];
+        uint16_t rss_queue;
+        bool rss = rss_steering(metas[i], hashes ? hashes[first + i] : 0, rss_queue, results[i].hash);
+        results[i].queue = queues[j];
+        if (regions[j] != 0) // queue group: spread by rss hash, like the nic
+          results[i].queue += results[i].hash & ((1u << regions[j]) - 1);
+        results[i].drop = false;
+        if (!dev.fdir.empty())
+          dev.fdir.lookup(metas[i], &results[i].queue, &results[i].drop);
+        results[i].rss = results[i].queue == NO_QUEUE && rss;
+        if (results[i].queue == NO_QUEUE)
+          results[i].queue = rss ? rss_queue : dev.vsi0_first_queue + 0;
+        results[i].ptp = is_ptp(metas[i]);
+        if (flow_cache::cacheable(metas[i]))
+          flows.insert(keys[i], sets[i], results[i]);
+      }
+    }
+
+    for (size_t i = 0; i < nb; i++) {
+      uint16_t queue = results[i].queue;
+      if (auto q = queue_hints[first + i]; q && !results[i].rss)
+        queue = dev.vsi0_first_queue + *q; // the nic applied the rules already
+      else if (results[i].drop)
+        continue;
+      rx_desc_meta rx;
+      rx.hash = results[i].hash;
+      rx.ptype = ice_ptype(metas[i]);
+      rx.csum = xsum_verify_rx(data[first + i], lens[first + i], metas[i], csums ? csums[first + i] : 0);
+      if (metas[i].l4_off != 0 && !(rx.csum & VMUX_RX_CSUM_L4))
+        rx.csum = 0; // the guest reads the status bits as l3 and l4 verified
+      deliver(data[first + i], lens[first + i], queue, rx, results[i].ptp);
+    }
   }
-  rss_steering(data, len, queue, hash);
+}
+
+void lan::deliver(const void *data, size_t len, uint16_t queue, const rx_desc_meta &meta, bool ptp) {
   if (!rxqs[queue]->is_enabled()) {
     // if we receive on uninitialized queues, we throw errors
     #ifdef DEBUG_LAN
@@ -188,7 +381,7 @@ void lan::packet_received(const void *data, size_t len, std::optional<uint16_t>
   #ifdef DEBUG_LAN
     std::cout << "rx packet queue " << std::dec << queue << "."<< logger::endl;
   #endif
-  rxqs[queue]->packet_received(data, len, hash);
+  rxqs[queue]->packet_received(data, len, meta, ptp);
 }
 
 lan_queue_base::lan_queue_base(lan &lanmgr_, const std::string &qtype,
@@ -368,31 +561,16 @@ queue_base::desc_ctx &lan_queue_rx::desc_ctx_create() {
 }
 
 /* determine if we should sample a ptp rx timestamp for this packet */
-bool lan_queue_rx::ptp_should_sample_rx(const void *data, size_t len) {
+bool lan_queue_rx::ptp_should_sample_rx(bool ptp) {
   // if no global timer is active, do not sample
   if (!PTP_GLTSYN_ENA(dev.regs.REG_GLTSYN_ENA[0]) || !PTP_GLTSYN_ENA(dev.regs.REG_GLTSYN_ENA[1])) {
     return false;
   }
-
-  const headers::pkt_udp *udp =
-      reinterpret_cast<const headers::pkt_udp *>(data);
-  const void *ptp_start;
-
-  if (udp->eth.type == htons(ETH_TYPE_IP) && udp->ip.proto == IP_PROTO_UDP) {
-
-    // check UDP port
-    uint16_t port = ntohs(udp->udp.dest);
-    return port == PTP_UDP_1 || port == PTP_UDP_2;
-
-  } else {
-
-    // return true iff ethertype is PTP
-    return udp->eth.type == htons(ETH_TYPE_PTP);
-  }
+  return ptp;
 }
 
 void lan_queue_rx::packet_received(const void *data, size_t pktlen,
-                                   uint32_t h) {
+                                   const rx_desc_meta &meta, bool ptp) {
   size_t num_descs = (pktlen + dbuff_size - 1) / dbuff_size;
   if (!enabled) {
     std::cout << "rx queue is disabled "
@@ -412,7 +590,7 @@ void lan_queue_rx::packet_received(const void *data, size_t pktlen,
 
   e810_timestamp_t timestamp = { .value=0 };
 
-  if (ptp_should_sample_rx(data, pktlen)) {
+  if (ptp_should_sample_rx(ptp)) {
     timestamp = dev.ptp.phc_sample_rx(0);
   }
 
@@ -429,10 +607,10 @@ void lan_queue_rx::packet_received(const void *data, size_t pktlen,
 
     if (i == num_descs - 1) {
       // last packet
-      ctx.packet_received(buf, pktlen - dbuff_size * i, timestamp, true);
+      ctx.packet_received(buf, pktlen - dbuff_size * i, meta, timestamp, true);
     } else {
 
-      ctx.packet_received(buf, dbuff_size, timestamp, false);
+      ctx.packet_received(buf, dbuff_size, meta, timestamp, false);
     }
   }
 }
@@ -450,15 +628,43 @@ void lan_queue_rx::rx_desc_ctx::process() {
 }
 
 void lan_queue_rx::rx_desc_ctx::packet_received(const void *data, size_t pktlen,
+                                                const rx_desc_meta &meta,
                                                 e810_timestamp_t timestamp, bool last) {
   union ice_32byte_rx_desc *rxd =
       reinterpret_cast<union ice_32byte_rx_desc *>(desc);
   union ice_32b_rx_flex_desc *flex_rxd =
       reinterpret_cast<union ice_32b_rx_flex_desc *>(desc);
   uint64_t addr = rxd->read.pkt_addr;
+  uint8_t rxdid = (rq.dev.regs.QRXFLXP_CNTXT[rq.idx] & QRXFLXP_CNTXT_RXDID_IDX_M) >> QRXFLXP_CNTXT_RXDID_IDX_S;
+  bool flex = rxdid > ICE_RXDID_LEGACY_1;
   flex_rxd->wb.pkt_len = pktlen;
   rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_DD_S);
-  rxd->wb.qword1.status_error_len |= (pktlen << 38);
+  if (flex) {
+    flex_rxd->wb.rxdid = rxdid;
+    flex_rxd->wb.mir_id_umb_cast = 0;
+    flex_rxd->wb.ptype_flex_flags0 = meta.ptype & ICE_RX_FLEX_DESC_PTYPE_M;
+    flex_rxd->wb.hdr_len_sph_flex_flags1 = 0;
+    bool hashed = meta.hash != 0;
+    if (rxdid == RXDID_COMMS_OVS) {
+      flex_rxd->wb.flex_meta0 = 0xffff; // flow id: no fdir match
+      flex_rxd->wb.flex_meta1 = 0xffff;
+      if (hashed) {
+        flex_rxd->wb.flex_meta2 = meta.hash & 0xffff;
+        flex_rxd->wb.flex_meta3 = meta.hash >> 16;
+      }
+    } else if (rxdid_hash_in_flex01(rxdid)) {
+      if (hashed) {
+        flex_rxd->wb.flex_meta0 = meta.hash & 0xffff;
+        flex_rxd->wb.flex_meta1 = meta.hash >> 16;
+      }
+    } else {
+      hashed = false; // the profile has no rss hash
+    }
+    if (hashed)
+      flex_rxd->wb.status_error0 |= (1 << ICE_RX_FLEX_DESC_STATUS0_RSS_VALID_S);
+  } else {
+    rxd->wb.qword1.status_error_len |= (pktlen << 38);
+  }
 
   // write to TS registers of flex context
   flex_rxd->wb.flex_ts.ts_high_0 = (uint16_t) timestamp.time & 0xFFFF;
@@ -467,7 +673,16 @@ void lan_queue_rx::rx_desc_ctx::packet_received(const void *data, size_t pktlen,
 
   if (last) {
     rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_EOF_S);
-    rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_L3L4P_S);
+    if (!flex) {
+      rxd->wb.qword1.status_error_len |= (1 << ICE_RX_FLEX_DESC_STATUS0_L3L4P_S);
+    } else if (meta.csum != 0) {
+      // the guest trusts the checksums that are not flagged
+      flex_rxd->wb.status_error0 |= (1 << ICE_RX_FLEX_DESC_STATUS0_L3L4P_S);
+      if (meta.csum & VMUX_RX_CSUM_L3_BAD)
+        flex_rxd->wb.status_error0 |= (1 << ICE_RX_FLEX_DESC_STATUS0_XSUM_IPE_S);
+      if (meta.csum & VMUX_RX_CSUM_L4_BAD)
+        flex_rxd->wb.status_error0 |= (1 << ICE_RX_FLEX_DESC_STATUS0_XSUM_L4E_S);
+    }
   }
 
   data_write(addr, pktlen, data); 
@@ -555,9 +770,25 @@ bool lan_queue_tx::trigger_tx_packet() {
   std::cout << "  tso_off=" << tso_off << " tso_len=" << tso_len << logger::endl;
 #endif
 
-  // check if we have a context descriptor first
   tx_desc_ctx *rd = ready_segments.at(0);
   uint8_t dtype = (rd->d->cmd_type_offset_bsz & ICE_FXD_FLTR_QW1_DTYPE_M);
+
+  // flow director filter programming: the next descriptor has the dummy
+  // packet, which is not sent
+  if (dtype == ICE_TX_DESC_DTYPE_FLTR_PROG) {
+    if (n < 2)
+      return false;
+    tx_desc_ctx *pd = ready_segments.at(1);
+    pkt_len = (pd->d->cmd_type_offset_bsz >> ICE_TXD_QW1_TX_BUF_SZ_S) & 0x3FFFULL;
+    dev.fdir.program(reinterpret_cast<struct ice_fltr_desc *>(rd->d), pd->data, pkt_len);
+    for (int i = 0; i < 2; i++) {
+      ready_segments.front()->processed();
+      ready_segments.pop_front();
+    }
+    return true;
+  }
+
+  // check if we have a context descriptor first
   if (dtype == ICE_TX_DESC_DTYPE_CTX) {
     struct ice_tx_ctx_desc *ctxd =
         reinterpret_cast<struct ice_tx_ctx_desc *>(rd->d);
@@ -629,6 +860,13 @@ bool lan_queue_tx::trigger_tx_packet() {
   if (!eop)
     return false;
 
+  // let the driver segment the unit (ipv4 only, like xsum_tcpip_tso)
+  if (tso && tso_off == 0 && iipt && total_len <= MAX_TSO_UNIT &&
+      dev.vmux->EthOffloadsTx()) {
+    trigger_tx_offload(d_skip, dcnt, total_len, maclen, iplen, l4len, tso_mss);
+    return true;
+  }
+
   if (tso) {
     if (tso_off == 0)
       data_limit = maclen + iplen + l4len + tso_mss;
@@ -687,7 +925,17 @@ bool lan_queue_tx::trigger_tx_packet() {
 
   assert(tso_len <= MTU);
 
-  if (!tso) {
+  if (!tso && dev.vmux->EthOffloadsTx()) {
+    // the driver completes the checksum (the guest put the pseudo header xsum in place)
+    struct vmux_tx_offload offload;
+    offload.queue = idx - dev.vsi0_first_queue;
+    if (l4t == ICE_TX_DESC_CMD_L4T_EOFT_TCP || l4t == ICE_TX_DESC_CMD_L4T_EOFT_UDP) {
+      offload.l4_csum = true;
+      offload.csum_start = maclen + iplen;
+      offload.csum_offset = l4t == ICE_TX_DESC_CMD_L4T_EOFT_TCP ? 16 : 6;
+    }
+    dev.vmux->EthSendOffload(pktbuf, tso_len, offload);
+  } else if (!tso) {
 #ifdef DEBUG_LAN
     std::cout << "    normal non-tso packet" << logger::endl;
 #endif
@@ -744,6 +992,48 @@ bool lan_queue_tx::trigger_tx_packet() {
   return true;
 }
 
+/*
+ * Hand a whole TSO unit to the driver in one go instead of segmenting it
+ * into MSS sized packets here.
+ */
+void lan_queue_tx::trigger_tx_offload(size_t d_skip, size_t dcnt,
+                                      uint32_t total_len, uint16_t maclen,
+                                      uint16_t iplen, uint16_t l4len,
+                                      uint32_t tso_mss) {
+  if (tso_unit.size() < MAX_TSO_UNIT)
+    tso_unit.resize(MAX_TSO_UNIT);
+
+  uint32_t off = 0;
+  for (size_t i = d_skip; i < dcnt; i++) {
+    tx_desc_ctx *rd = ready_segments.at(i);
+    uint16_t pkt_len =
+        ((rd->d->cmd_type_offset_bsz) >> ICE_TXD_QW1_TX_BUF_SZ_S) & 0x3FFFULL;
+    memcpy(tso_unit.data() + off, rd->data, pkt_len);
+    off += pkt_len;
+  }
+
+#ifdef DEBUG_LAN
+  std::cout << "    tso unit offloaded len=" << total_len << " mss=" << tso_mss
+      << logger::endl;
+#endif
+
+  xsum_tcpip_tso_partial(tso_unit.data() + maclen, iplen, total_len - maclen - iplen);
+
+  struct vmux_tx_offload offload;
+  offload.queue = idx - dev.vsi0_first_queue;
+  offload.l4_csum = true;
+  offload.csum_start = maclen + iplen;
+  offload.csum_offset = 16; // tcp
+  offload.tso_mss = tso_mss;
+  offload.hdr_len = maclen + iplen + l4len;
+  dev.vmux->EthSendOffload(tso_unit.data(), total_len, offload);
+
+  while (dcnt-- > 0) {
+    ready_segments.front()->processed();
+    ready_segments.pop_front();
+  }
+}
+
 void lan_queue_tx::trigger_tx() {
   while (trigger_tx_packet()) {
   }
@@ -783,8 +1073,10 @@ void lan_queue_tx::tx_desc_ctx::prepare() {
 #endif
 
     prepared();
+  } else if (dtype == ICE_TX_DESC_DTYPE_FLTR_PROG) {
+    prepared(); // see e810_fdir::program()
   } else {
-    std::cout  << "txq: only support context & data descriptors" << logger::endl;
+    std::cout  << "txq: only support context, data & filter programming descriptors" << logger::endl;
     abort();
   }
 }
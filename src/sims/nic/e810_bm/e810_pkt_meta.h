@@ -0,0 +1,119 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <rte_mbuf_ptype.h>
+
+namespace e810 {
+
+/**
+ * What the classification stages of the model (switch, rss, ptp) need to
+ * know about a received frame. Parsed once per frame by parse_pkt_meta().
+ *
+ * Multi byte fields are in host byte order, except dst_mac (as in memory, like
+ * the switch rule keys).
+ */
+struct pkt_meta {
+  uint32_t ptype; // RTE_PTYPE_* bits
+  uint64_t dst_mac;
+  uint16_t vlan; // vlan id of the outer tag, 0: untagged
+  uint16_t ethertype; // after vlan tags
+  uint16_t l3_off; // 0: no l3 header
+  uint16_t l4_off; // 0: no l4 header (or not the first fragment)
+  uint8_t l4_proto; // ip protocol, 0: no ip
+  // 5-tuple (ipv4 only)
+  uint32_t src_ip;
+  uint32_t dst_ip;
+  uint16_t src_port;
+  uint16_t dst_port;
+
+  bool is_ipv4() const {
+    return RTE_ETH_IS_IPV4_HDR(ptype);
+  }
+};
+
+static inline uint16_t pkt_load16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static inline uint32_t pkt_load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+/**
+ * Parses the headers of a frame of length len into m. ptype may be the
+ * packet type the NIC classified the frame as (mbuf packet_type), or 0 if
+ * unknown. VLAN tags are always walked. Only the l3 type of the NIC is
+ * trusted, and only if it has one: if its l3 field is 0, the ethertype
+ * decides.
+ */
+static inline void parse_pkt_meta(const void *data, size_t len, uint32_t ptype, pkt_meta &m) {
+  const uint8_t *pkt = (const uint8_t *)data;
+  memset(&m, 0, sizeof(m));
+  if (len < 14)
+    return;
+  memcpy(&m.dst_mac, pkt, 6);
+
+  // l2
+  size_t off = 12;
+  uint16_t type = pkt_load16(pkt + off);
+  uint32_t l2 = RTE_PTYPE_L2_ETHER;
+  while ((type == 0x8100 || type == 0x88a8) && off + 6 <= len) {
+    if (l2 == RTE_PTYPE_L2_ETHER)
+      m.vlan = pkt_load16(pkt + off + 2) & 0xfff;
+    l2 = l2 == RTE_PTYPE_L2_ETHER ? RTE_PTYPE_L2_ETHER_VLAN : RTE_PTYPE_L2_ETHER_QINQ;
+    off += 4;
+    type = pkt_load16(pkt + off);
+  }
+  off += 2;
+  m.ethertype = type;
+  m.ptype = l2;
+
+  // l3
+  uint32_t l3 = ptype & RTE_PTYPE_L3_MASK;
+  if (RTE_ETH_IS_IPV4_HDR(l3) || (l3 == 0 && type == 0x0800)) {
+    if (off + 20 > len)
+      return;
+    const uint8_t *ip = pkt + off;
+    size_t ihl = l3 == RTE_PTYPE_L3_IPV4 ? 20 : (ip[0] & 0xf) * 4;
+    if (ihl < 20 || off + ihl > len)
+      return;
+    m.ptype |= ihl == 20 ? RTE_PTYPE_L3_IPV4 : RTE_PTYPE_L3_IPV4_EXT;
+    m.l3_off = off;
+    m.l4_proto = ip[9];
+    m.src_ip = pkt_load32(ip + 12);
+    m.dst_ip = pkt_load32(ip + 16);
+    if (pkt_load16(ip + 6) & 0x3fff) { // MF or offset: a fragment, l4 is not complete
+      m.ptype |= RTE_PTYPE_L4_FRAG;
+      return;
+    }
+    off += ihl;
+  } else if (RTE_ETH_IS_IPV6_HDR(l3) || (l3 == 0 && type == 0x86dd)) {
+    if (off + 40 > len)
+      return;
+    m.ptype |= RTE_PTYPE_L3_IPV6;
+    m.l3_off = off;
+    m.l4_proto = pkt[off + 6]; // extension headers are not followed
+    off += 40;
+  } else {
+    return;
+  }
+
+  // l4
+  if (m.l4_proto == 6 && off + 20 <= len)
+    m.ptype |= RTE_PTYPE_L4_TCP;
+  else if (m.l4_proto == 17 && off + 8 <= len)
+    m.ptype |= RTE_PTYPE_L4_UDP;
+  else
+    return;
+  m.l4_off = off;
+  m.src_port = pkt_load16(pkt + off);
+  m.dst_port = pkt_load16(pkt + off + 2);
+}
+
+}  // namespace e810
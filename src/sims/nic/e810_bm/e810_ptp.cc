@@ -20,46 +20,61 @@ void PTPManager::set_enabled(uint32_t clock) {
   this->dev.vmux->device->driver->enableTimesync(0);
 }
 
-e810_timestamp_t PTPManager::phc_read() {
+// time of the clock we follow, without adjustments
+e810_timestamp_t PTPManager::raw_read() {
   // Mediation: if device is emulated, use hw timestamp
-  if (this->dev.vmux->device->isMediating()) {
+  if (this->nic_clock) {
     auto e810_dev = dynamic_pointer_cast<E810EmulatedDevice>(this->dev.vmux->device);
     assert(e810_dev != NULL);
 
     struct timespec ts = e810_dev->driver->readCurrentTimestamp();
-    this->last_val = { .time=TIMESPEC_TO_NANOS(ts), .time_0=0 };
-    
+    return { .time=TIMESPEC_TO_NANOS(ts), .time_0=0 };
+
   // Emulation: use current unix time
   } else {
     struct timespec ts;
     if(clock_gettime(CLOCK_MONOTONIC, &ts)) {
       printf("Error: Could not get unix timestamp. \n");
       return { .value=0 };
-
-    } else {
-
-      uint64_t cycle_now = TIMESPEC_TO_NANOS(ts); // (uint64_t) (((__int128) TIMESPEC_TO_NANOS(ts) *  (__int128) 1'000'000'000'000ULL) / CLOCK_HZ);
-      uint64_t cycles_passed = cycle_now - last_updated;
-
-      this->last_updated = cycle_now;
-      this->last_val.time += (uint64_t) ((double) cycles_passed);
-    } 
+    }
+    this->last_updated = TIMESPEC_TO_NANOS(ts);
+    return { .time=this->last_updated, .time_0=0 };
   }
+}
 
+// a time of the clock we follow, as the guest's PHC sees it
+e810_timestamp_t PTPManager::adjusted(e810_timestamp_t raw) {
   // factor in adjustments
-  e810_timestamp_t adjusted_timestamp;
-
   if (this->offset.value != 0) {
-      last_val.value += (__int128) (offset.value & E810_TIMESTAMP_MASK);
+      raw.value += (__int128) (offset.value & E810_TIMESTAMP_MASK);
   }
+  return raw;
+}
 
+e810_timestamp_t PTPManager::phc_read() {
+  this->read_once = true;
+  this->last_val = this->adjusted(this->raw_read());
   return this->last_val;
 }
 
+void PTPManager::use_nic_clock(bool nic) {
+  if (nic == this->nic_clock)
+    return;
+  if (!this->read_once) { // nothing to continue from
+    this->nic_clock = nic;
+    return;
+  }
+  e810_timestamp_t now = this->phc_read();
+  this->nic_clock = nic;
+  if (nic)
+    this->dev.vmux->device->driver->enableTimesync(0);
+  this->offset.value = now.value - this->raw_read().value;
+}
+
 /* Returns the global time and places the 40 bit RX timestamp in tstamp
 */
 e810_timestamp_t PTPManager::phc_sample_rx(uint16_t portid) {
-  if (this->dev.vmux->device->isMediating()) {
+  if (this->nic_clock) {
     auto e810_dev = dynamic_pointer_cast<E810EmulatedDevice>(this->dev.vmux->device);
     assert(e810_dev != NULL);
 
@@ -67,7 +82,7 @@ e810_timestamp_t PTPManager::phc_sample_rx(uint16_t portid) {
     uint64_t timestamp = e810_dev->driver->readRxTimestamp(portid);
     printf("RX: %lu \n", timestamp);
 
-    return { .time=timestamp, .time_0=0 };
+    return this->adjusted({ .time=timestamp, .time_0=0 });
 
   } else {
     return this->phc_read();
@@ -78,13 +93,13 @@ e810_timestamp_t PTPManager::phc_sample_rx(uint16_t portid) {
 */
 e810_timestamp_t PTPManager::phc_sample_tx(uint16_t portid) {
 
-  if (this->dev.vmux->device->isMediating()) {
+  if (this->nic_clock) {
     auto e810_dev = dynamic_pointer_cast<E810EmulatedDevice>(this->dev.vmux->device);
     assert(e810_dev != NULL);
 
     uint64_t timestamp = e810_dev->driver->readTxTimestamp(portid);
     printf("TX: %lu \n", timestamp);
-    return { .time=timestamp, .time_0=0 };
+    return this->adjusted({ .time=timestamp, .time_0=0 });
 
   } else {
     return this->phc_read();
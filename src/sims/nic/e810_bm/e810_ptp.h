@@ -82,12 +82,21 @@ class PTPManager {
   e810_timestamp_t last_val;
   e810_timestamp_t offset;
   uint64_t inc_val;
+  bool nic_clock = false; // else CLOCK_MONOTONIC
+  bool read_once = false;
+
+  e810_timestamp_t raw_read();
+  e810_timestamp_t adjusted(e810_timestamp_t raw);
 
  public:
   PTPManager(e810_bm &dev);
   
   void set_enabled(uint32_t clock);
 
+  // switch between NIC time (mediation) and CLOCK_MONOTONIC. The PHC keeps
+  // running from where it is.
+  void use_nic_clock(bool nic);
+
   e810_timestamp_t phc_read();
   
   e810_timestamp_t phc_sample_rx(uint16_t portid);
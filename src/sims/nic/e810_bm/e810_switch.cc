@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <cassert>
+#include <algorithm>
 #include <iostream>
 #include <netinet/if_ether.h>
 using namespace std;
@@ -11,42 +12,206 @@ using namespace std;
 
 namespace e810 {
 
+size_t switch_table::bucket(uint64_t key) const {
+  key *= 0x9E3779B97F4A7C15; // fibonacci hashing: the high bits are mixed best
+  return (key >> 32) & (entries.size() - 1);
+}
+
+bool switch_table::find(uint64_t key, size_t bucket, uint16_t *queue, uint8_t *region) const {
+  size_t mask = entries.size() - 1;
+  for (size_t i = bucket; entries[i].key != 0; i = (i + 1) & mask) {
+    if (entries[i].key == key) {
+      *queue = entries[i].queue;
+      *region = entries[i].region;
+      return true;
+    }
+  }
+  return false;
+}
+
+void switch_table::insert(uint64_t key, uint16_t queue, uint8_t region) {
+  size_t mask = entries.size() - 1;
+  size_t i = bucket(key);
+  for (; entries[i].key != 0; i = (i + 1) & mask) {
+    if (entries[i].key == key) {
+      entries[i].queue = queue; // replace rule
+      entries[i].region = region;
+      return;
+    }
+  }
+  entries[i] = { key, queue, region };
+  if (++used * 2 > entries.size()) // keep probe sequences short
+    grow();
+}
+
+void switch_table::grow() {
+  std::vector<entry> old(entries.size() * 2);
+  std::swap(old, entries);
+  used = 0;
+  for (const entry &e : old) {
+    if (e.key != 0)
+      insert(e.key, e.queue, e.region);
+  }
+}
+
 bool e810_switch::add_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
-  uint32_t action_type = (add_sw_rules->pdata.lkup_tx_rx.act & ICE_SINGLE_ACT_TYPE_M) >> ICE_SINGLE_ACT_TYPE_S;
-  uint32_t queue_id = (add_sw_rules->pdata.lkup_tx_rx.act & ICE_SINGLE_ACT_Q_INDEX_M) >> ICE_SINGLE_ACT_Q_INDEX_S;
+  uint32_t act = add_sw_rules->pdata.lkup_tx_rx.act;
+  uint32_t action_type = (act & ICE_SINGLE_ACT_TYPE_M) >> ICE_SINGLE_ACT_TYPE_S;
+  uint32_t queue_id = (act & ICE_SINGLE_ACT_Q_INDEX_M) >> ICE_SINGLE_ACT_Q_INDEX_S;
+  uint32_t queue_region = (act & ICE_SINGLE_ACT_Q_REGION_M) >> ICE_SINGLE_ACT_Q_REGION_S;
+  if (this->add_multicast_rule(add_sw_rules))
+    return true;
   if (
       add_sw_rules->type != ICE_AQC_SW_RULES_T_LKUP_RX || // we only support simple sw rules
-      action_type != ICE_SINGLE_ACT_TO_Q || // we only support forwarding to a queue
-      add_sw_rules->pdata.lkup_tx_rx.recipe_id != 0 || // we only support recipe 0 (hardcoded in firmware)
-      add_sw_rules->pdata.lkup_tx_rx.hdr_len != 56 // depends on the recipe 0
+      (action_type != ICE_SINGLE_ACT_TO_Q && // we only support forwarding to a queue (group)
+       action_type != ICE_SINGLE_ACT_VSI_FORWARDING) || // or to the VSI (list) of the guest
+      (act & ICE_SINGLE_ACT_DROP)
       ) {
     return false; // rule too complicated: not supported by this emulator
   }
 
-  struct ethhdr *hdr = (struct ethhdr*)(add_sw_rules->pdata.lkup_tx_rx.hdr);
-  uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(hdr->h_dest);
-  this->mac_rules[dst_mac] = queue_id;
+  // the rule header is a dummy ethernet header with the fields to match (see
+  // ice_fill_sw_rule): dst mac, ethertype or 0x8100 and the vlan tci
+  uint8_t *hdr = add_sw_rules->pdata.lkup_tx_rx.hdr;
+  uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(hdr);
+  uint16_t ethertype = ntohs(*(uint16_t*)(hdr + 12));
+  uint16_t vlan = ntohs(*(uint16_t*)(hdr + 14)) & 0xfff;
+  lookup type;
+  switch (add_sw_rules->pdata.lkup_tx_rx.recipe_id) {
+    case ICE_SW_LKUP_ETHERTYPE:
+      // recipe 0 with a long header is the mac lookup of the firmware
+      type = add_sw_rules->pdata.lkup_tx_rx.hdr_len == 56 ? LKUP_MAC : LKUP_ETHERTYPE;
+      break;
+    case ICE_SW_LKUP_MAC:
+      type = LKUP_MAC;
+      break;
+    case ICE_SW_LKUP_MAC_VLAN:
+      type = LKUP_MAC_VLAN;
+      break;
+    case ICE_SW_LKUP_VLAN:
+      type = LKUP_VLAN;
+      break;
+    default:
+      return false; // lookup type not supported by this emulator
+  }
+  if (add_sw_rules->pdata.lkup_tx_rx.hdr_len < 16)
+    return false;
+
+  // the same rule for drivers steering in hardware
+  struct vmux_flow_rule rule;
+  if (type == LKUP_ETHERTYPE) {
+    rule.ethertype = ethertype;
+  } else {
+    if (type != LKUP_VLAN) {
+      rule.dst_mac.emplace();
+      memcpy(rule.dst_mac->data(), hdr, 6);
+    }
+    if (type != LKUP_MAC)
+      rule.vlan = vlan;
+  }
+  if (action_type == ICE_SINGLE_ACT_TO_Q) {
+    rule.queue = queue_id - this->dev.vsi0_first_queue;
+    rule.nr_queues = 1 << queue_region;
+  } else {
+    rule.nr_queues = 0; // the guest has a single VSI: all its queues
+  }
+
+  if (action_type == ICE_SINGLE_ACT_TO_Q) {
+    // frames to the VSI get the default queue anyways
+    uint64_t key;
+    if (type == LKUP_ETHERTYPE)
+      key = rule_key(type, ethertype, 0);
+    else if (type == LKUP_VLAN)
+      key = rule_key(type, 0, vlan);
+    else
+      key = rule_key(type, dst_mac, type == LKUP_MAC_VLAN ? vlan : 0);
+    this->rules.insert(key, queue_id, queue_region); // the lan spreads the group by rss hash
+    this->nr_rules[type]++;
+    this->dev.lanmgr.switch_rules_updated(); // flows may be switched differently now
+  }
+
   auto driver = this->dev.vmux->device->driver;
   auto device_id = this->dev.vmux->device->device_id;
-  bool result = driver->add_switch_rule(device_id, hdr->h_dest, queue_id - this->dev.vsi0_first_queue);
+  bool result = driver->add_flow_rule(device_id, rule);
+  if (auto localSwitch = this->dev.vmux->device->localSwitch; localSwitch && rule.dst_mac)
+    localSwitch->add_mac(device_id, hdr);
 
   return true;
 }
 
+/**
+ * The guest subscribes its VSI to a multicast (or broadcast) MAC. Frames to it
+ * are replicated to every subscribed device (see Driver::add_multicast).
+ */
+bool e810_switch::add_multicast_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
+  uint32_t action_type = (add_sw_rules->pdata.lkup_tx_rx.act & ICE_SINGLE_ACT_TYPE_M) >> ICE_SINGLE_ACT_TYPE_S;
+  struct ethhdr *hdr = (struct ethhdr*)(add_sw_rules->pdata.lkup_tx_rx.hdr);
+  if (
+      add_sw_rules->type != ICE_AQC_SW_RULES_T_LKUP_RX ||
+      action_type != ICE_SINGLE_ACT_VSI_FORWARDING ||
+      add_sw_rules->pdata.lkup_tx_rx.recipe_id != 0 ||
+      add_sw_rules->pdata.lkup_tx_rx.hdr_len != 56 ||
+      !(hdr->h_dest[0] & 1) // not multicast
+      ) {
+    return false;
+  }
+
+  auto driver = this->dev.vmux->device->driver;
+  auto device_id = this->dev.vmux->device->device_id;
+  driver->add_multicast(device_id, hdr->h_dest);
+  if (auto localSwitch = this->dev.vmux->device->localSwitch)
+    localSwitch->join(device_id, hdr->h_dest);
+  return true;
+}
+
 /**
  * set queue if a switching rule applies
  */
-void e810_switch::select_queue(const void* data, size_t len, uint16_t* queue) {
-  // assume firmware recipe 0
-  // match ethertype, src_mac, dst_ac, vlan, logical port, ...
-  if (len < sizeof(struct ethhdr)) {
+void e810_switch::select_queue(const pkt_meta &meta, uint16_t* queue, uint8_t *region) {
+  this->select_queues(&meta, queue, region, 1);
+}
+
+/**
+ * Looks up all frames of a burst in two passes: the first one computes the
+ * keys and prefetches their buckets, the second one probes them. Frames
+ * without a matching rule keep their queue. Frames with one get the first
+ * queue of the rule's queue group, and regions[i] its size (1 << region).
+ */
+void e810_switch::select_queues(const pkt_meta *metas, uint16_t *queues, uint8_t *regions, size_t n) {
+  if (this->rules.empty())
     return;
+  n = std::min(n, BURST_SIZE);
+  // keys[i][type] of frame i, 0 if the type has no rules
+  uint64_t keys[BURST_SIZE][LKUP_NUM];
+  size_t buckets[BURST_SIZE][LKUP_NUM];
+
+  for (size_t i = 0; i < n; i++) {
+    const pkt_meta &m = metas[i];
+    memset(keys[i], 0, sizeof(keys[i]));
+    if (m.ptype == 0)
+      continue; // too short for an ethernet header
+    if (this->nr_rules[LKUP_MAC_VLAN])
+      keys[i][LKUP_MAC_VLAN] = rule_key(LKUP_MAC_VLAN, m.dst_mac, m.vlan);
+    if (this->nr_rules[LKUP_MAC])
+      keys[i][LKUP_MAC] = rule_key(LKUP_MAC, m.dst_mac, 0);
+    if (this->nr_rules[LKUP_VLAN])
+      keys[i][LKUP_VLAN] = rule_key(LKUP_VLAN, 0, m.vlan);
+    if (this->nr_rules[LKUP_ETHERTYPE])
+      keys[i][LKUP_ETHERTYPE] = rule_key(LKUP_ETHERTYPE, m.ethertype, 0);
+    for (int type = LKUP_MAC_VLAN; type < LKUP_NUM; type++) {
+      if (keys[i][type] == 0)
+        continue;
+      buckets[i][type] = this->rules.bucket(keys[i][type]);
+      this->rules.prefetch(buckets[i][type]);
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    for (int type = LKUP_MAC_VLAN; type < LKUP_NUM; type++) {
+      if (keys[i][type] != 0 && this->rules.find(keys[i][type], buckets[i][type], &queues[i], &regions[i]))
+        break; // most specific rule wins
+    }
   }
-  struct ethhdr* packet_hdr = (struct ethhdr*) data;
-  uint64_t dst_mac = 0xFFFFFFFFFFFF & *(uint64_t*)(packet_hdr->h_dest);
-  if (auto search = this->mac_rules.find(dst_mac); search != this->mac_rules.end())
-    *queue = search->second; // return map entry, if it exists
-  return;
 }
 
 void e810_switch::print_sw_rule(struct ice_aqc_sw_rules_elem *add_sw_rules) {
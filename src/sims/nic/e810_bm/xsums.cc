@@ -14,6 +14,7 @@
 #include <iostream>
 
 #include "sims/nic/e810_bm/e810_bm.h"
+#include "sims/nic/e810_bm/headers.h"
 
 namespace e810 {
 
@@ -153,6 +154,103 @@ void xsum_tcpip_tso(void *iphdr, uint8_t iplen, uint8_t l4len,
   tcph->cksum = cksum;
 }
 
+void xsum_tcpip_tso_partial(void *iphdr, uint8_t iplen, uint32_t l4len) {
+  struct ipv4_hdr *ih = (struct ipv4_hdr *)iphdr;
+  struct rte_tcp_hdr *tcph = (struct rte_tcp_hdr *)((uint8_t *)iphdr + iplen);
+  uint32_t cksum;
+
+  // the segmenting party rewrites total_length and the ip xsum per segment
+  uint32_t total_length = iplen + l4len;
+  ih->total_length = htons(total_length > 0xffff ? 0xffff : total_length);
+  ih->hdr_checksum = 0;
+  cksum = rte_raw_cksum(iphdr, iplen);
+  cksum = ((cksum & 0xffff0000) >> 16) + (cksum & 0xffff);
+  cksum = (~cksum) & 0xffff;
+  ih->hdr_checksum = cksum;
+
+  // pseudo header with the length of the whole unit (not inverted)
+  cksum = __rte_raw_cksum(&ih->src_addr, 2 * sizeof(uint32_t), 0);
+  cksum += htons(ih->next_proto_id);
+  cksum += htons(l4len >> 16) + htons(l4len & 0xffff);
+  tcph->cksum = __rte_raw_cksum_reduce(cksum);
+}
+
+/*
+ * Ones' complement sum of buf in native byte order, not folded yet. Adds 32
+ * bit words up in 64 bits: no carries to fold in the loop, so the compiler
+ * vectorizes it.
+ */
+static inline uint64_t raw_sum64(const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+  uint64_t sum = 0;
+  for (; len >= 4; len -= 4, p += 4) {
+    uint32_t w;
+    memcpy(&w, p, sizeof(w));
+    sum += w;
+  }
+  if (len >= 2) {
+    uint16_t w;
+    memcpy(&w, p, sizeof(w));
+    sum += w;
+    len -= 2;
+    p += 2;
+  }
+  if (len == 1) {
+    uint16_t left = 0;
+    *(uint8_t *)&left = *p;
+    sum += left;
+  }
+  return sum;
+}
+
+static inline uint16_t raw_sum64_reduce(uint64_t sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+uint8_t xsum_verify_rx(const void *frame, size_t len, const pkt_meta &meta, uint8_t known) {
+  if ((known & VMUX_RX_CSUM_L3) && (known & VMUX_RX_CSUM_L4))
+    return known;
+  const uint8_t *pkt = (const uint8_t *)frame;
+  const uint8_t *ip = pkt + meta.l3_off;
+  size_t ip_len; // header and payload, without ethernet padding
+  uint64_t sum; // pseudo header addresses
+  if (meta.l3_off == 0) {
+    return known;
+  } else if (meta.is_ipv4()) {
+    size_t ihl = (ip[0] & 0xf) * 4;
+    ip_len = pkt_load16(ip + 2);
+    if (ip_len < ihl || meta.l3_off + ip_len > len)
+      return known; // truncated
+    if (!(known & VMUX_RX_CSUM_L3))
+      known |= raw_sum64_reduce(raw_sum64(ip, ihl)) == 0xffff ? VMUX_RX_CSUM_L3_GOOD : VMUX_RX_CSUM_L3_BAD;
+    sum = raw_sum64(ip + 12, 8);
+  } else {
+    ip_len = 40 + pkt_load16(ip + 4);
+    if (meta.l3_off + ip_len > len)
+      return known;
+    sum = raw_sum64(ip + 8, 32);
+  }
+
+  // fragments (MF or offset set) don't have the complete l4 payload
+  if ((meta.ptype & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_FRAG)
+    return known;
+  if (meta.l4_off == 0 || (known & VMUX_RX_CSUM_L4))
+    return known;
+  const uint8_t *l4 = pkt + meta.l4_off;
+  size_t l4_len = meta.l3_off + ip_len - meta.l4_off;
+  if (l4_len < (meta.l4_proto == IP_PROTO_TCP ? 20u : 8u))
+    return known;
+  if (meta.l4_proto == IP_PROTO_UDP && meta.is_ipv4() && pkt_load16(l4 + 6) == 0)
+    return known | VMUX_RX_CSUM_L4_GOOD; // the sender computed no checksum
+  sum += htons(meta.l4_proto) + htons(l4_len >> 16) + htons(l4_len & 0xffff);
+  sum += raw_sum64(l4, l4_len);
+  return known | (raw_sum64_reduce(sum) == 0xffff ? VMUX_RX_CSUM_L4_GOOD : VMUX_RX_CSUM_L4_BAD);
+}
+
 void tso_postupdate_header(void *iphdr, uint8_t iplen, uint8_t l4len,
                            uint16_t paylen) {
   struct ipv4_hdr *ih = (struct ipv4_hdr *)iphdr;
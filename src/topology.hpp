@@ -0,0 +1,305 @@
+#pragma once
+
+#include "src/util.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <mutex>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * CPU and memory topology of the host as exposed by sysfs.
+ *
+ * Used to place vMux threads (and the memory they allocate) on the NUMA node
+ * of the NIC and of the guest memory. Hands out whole physical cores (all
+ * SMT siblings) so that an rx poller and the runner of the same VM share
+ * their L1/L2 caches, but no other VM's threads.
+ */
+class Topology {
+public:
+  struct Core {
+    int node;
+    std::vector<int> cpus; // SMT siblings
+    bool used = false;
+  };
+
+private:
+  // from linux/mempolicy.h. We don't want to depend on libnuma for two syscalls.
+  static const int MPOL_DEFAULT_ = 0;
+  static const int MPOL_PREFERRED_ = 1;
+  static const unsigned long MPOL_F_NODE_ = 1 << 0;
+  static const unsigned long MPOL_F_ADDR_ = 1 << 1;
+
+  std::vector<Core> cores;
+  int nr_nodes = 0;
+  std::mutex lock; // protects Core::used
+
+  static std::string read_sysfs(const std::string &path) {
+    std::ifstream file(path);
+    if (!file.is_open())
+      return "";
+    std::string content;
+    std::getline(file, content);
+    return content;
+  }
+
+  static bool read_cpulist(const std::string &path, cpu_set_t &cpus) {
+    std::string list = read_sysfs(path);
+    CPU_ZERO(&cpus);
+    if (list.empty())
+      return false;
+    return Util::parse_cpuset(list, cpus);
+  }
+
+  bool allocate_core_locked(int node, Core &core_out, std::string purpose) {
+    Core *fallback = NULL;
+    Core *shared = NULL;
+    for (auto &core : this->cores) {
+      if (core.used) {
+        if (shared == NULL && (core.node == node || node < 0))
+          shared = &core;
+        continue;
+      }
+      if (core.node == node || node < 0) {
+        core.used = true;
+        core_out = core;
+        return true;
+      }
+      if (fallback == NULL)
+        fallback = &core;
+    }
+    if (fallback != NULL) {
+      printf("WARN: Topology: no free core on NUMA node %d left. Placing %s "
+             "on node %d instead (cross-node)\n", node, purpose.c_str(), fallback->node);
+      fallback->used = true;
+      core_out = *fallback;
+      return true;
+    }
+    if (shared != NULL) {
+      printf("WARN: Topology: no free core left. %s shares cpu %d\n",
+             purpose.c_str(), shared->cpus[0]);
+      core_out = *shared;
+      return true;
+    }
+    return false;
+  }
+
+  void discover() {
+    cpu_set_t online;
+    if (!read_cpulist("/sys/devices/system/cpu/online", online))
+      return;
+
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &online) || CPU_ISSET(cpu, &seen))
+        continue;
+      Core core;
+      core.node = cpu_numa_node(cpu);
+      cpu_set_t siblings;
+      std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                         "/topology/thread_siblings_list";
+      if (!read_cpulist(path, siblings)) {
+        CPU_ZERO(&siblings);
+        CPU_SET(cpu, &siblings);
+      }
+      for (int sibling = 0; sibling < CPU_SETSIZE; sibling++) {
+        if (!CPU_ISSET(sibling, &siblings) || !CPU_ISSET(sibling, &online))
+          continue;
+        core.cpus.push_back(sibling);
+        CPU_SET(sibling, &seen);
+      }
+      this->nr_nodes = std::max(this->nr_nodes, core.node + 1);
+      this->cores.push_back(core);
+    }
+  }
+
+public:
+  Topology() { this->discover(); }
+
+  bool discovered() { return !this->cores.empty(); }
+
+  int get_nr_nodes() { return this->nr_nodes; }
+
+  // NUMA node of a PCI device (e.g. 0000:18:00.0). -1 if unknown.
+  static int pci_numa_node(const std::string &pci_address) {
+    std::string node = read_sysfs("/sys/bus/pci/devices/" + pci_address + "/numa_node");
+    if (node.empty() || !Util::is_valid_number(node))
+      return -1; // also covers "-1" on non-NUMA systems
+    return std::stoi(node);
+  }
+
+  // NUMA node of a cpu. 0 if the kernel doesn't know about NUMA.
+  static int cpu_numa_node(int cpu) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL)
+      return 0;
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      // cpuN/nodeM links to the node the cpu belongs to
+      std::string name = entry->d_name;
+      if (name.rfind("node", 0) == 0 && Util::is_valid_number(name.substr(4))) {
+        node = std::stoi(name.substr(4));
+        break;
+      }
+    }
+    closedir(dir);
+    return node;
+  }
+
+  // NUMA node backing the page at addr. -1 if unknown.
+  static int addr_numa_node(void *addr) {
+    int node = -1;
+    long ret = syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE_ | MPOL_F_ADDR_);
+    if (ret != 0)
+      return -1;
+    return node;
+  }
+
+  /**
+   * Let the calling thread allocate new memory on node (first touch). Pass
+   * -1 to restore the default policy.
+   */
+  static void prefer_node(int node) {
+    long ret;
+    if (node < 0) {
+      ret = syscall(SYS_set_mempolicy, MPOL_DEFAULT_, NULL, 0);
+    } else {
+      unsigned long nodemask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {};
+      nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+      ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED_, nodemask, CPU_SETSIZE);
+    }
+    if (ret != 0)
+      printf("WARN: Topology: cannot set memory policy for node %d\n", node);
+  }
+
+  // NUMA node of all cpus in the set. -1 if they span several nodes.
+  int cpuset_numa_node(const cpu_set_t &cpus) {
+    int node = -1;
+    for (auto &core : this->cores) {
+      for (int cpu : core.cpus) {
+        if (!CPU_ISSET(cpu, &cpus))
+          continue;
+        if (node >= 0 && node != core.node)
+          return -1;
+        node = core.node;
+      }
+    }
+    return node;
+  }
+
+  /**
+   * Reserve a physical core, preferably on node. Falls back to other nodes
+   * (and reports it) if node has no unused cores left, and to sharing an
+   * already used core of node if all cores are used.
+   * Returns false if the topology is unknown.
+   */
+  bool allocate_core(int node, Core &core_out, std::string purpose) {
+    std::lock_guard guard(this->lock);
+    return this->allocate_core_locked(node, core_out, purpose);
+  }
+
+  /**
+   * cpus sharing the cache of the given level (2: L2, 3: LLC) with cpu.
+   * Empty if unknown.
+   */
+  static cpu_set_t cache_siblings(int cpu, int level) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/index";
+    for (int index = 0; index < 8; index++) {
+      std::string lvl = read_sysfs(base + std::to_string(index) + "/level");
+      if (lvl.empty())
+        break;
+      std::string type = read_sysfs(base + std::to_string(index) + "/type");
+      if (lvl == std::to_string(level) && type != "Instruction") {
+        read_cpulist(base + std::to_string(index) + "/shared_cpu_list", cpus);
+        break;
+      }
+    }
+    return cpus;
+  }
+
+  /**
+   * Reserve a physical core close to the cpus in target (e.g. a vCPU thread):
+   * sharing its L2, or else its LLC, or else its NUMA node. Returns in
+   * cpus_out the cpus of that core which are not in target (if possible).
+   */
+  bool allocate_core_near(const cpu_set_t &target, cpu_set_t &cpus_out, std::string purpose) {
+    std::lock_guard guard(this->lock);
+    int node = -1;
+    for (int level : { 2, 3 }) {
+      cpu_set_t near;
+      CPU_ZERO(&near);
+      for (auto &core : this->cores) {
+        for (int cpu : core.cpus) {
+          if (!CPU_ISSET(cpu, &target))
+            continue;
+          cpu_set_t siblings = cache_siblings(cpu, level);
+          CPU_OR(&near, &near, &siblings);
+          node = core.node;
+        }
+      }
+      for (auto &core : this->cores) {
+        if (core.used)
+          continue;
+        bool is_near = false;
+        for (int cpu : core.cpus)
+          is_near |= CPU_ISSET(cpu, &near);
+        if (!is_near)
+          continue;
+        // we take the core, even if target runs on one of its siblings
+        core.used = true;
+        CPU_ZERO(&cpus_out);
+        for (int cpu : core.cpus) {
+          if (!CPU_ISSET(cpu, &target))
+            CPU_SET(cpu, &cpus_out);
+        }
+        if (CPU_COUNT(&cpus_out) == 0)
+          cpus_out = core_cpu(core, 0);
+        return true;
+      }
+    }
+    Core core;
+    bool found = this->allocate_core_locked(node, core, purpose);
+    if (found) {
+      printf("WARN: Topology: no free core shares a cache with cpus %s. Placing %s on cpu %d\n",
+             cpuset_str(target).c_str(), purpose.c_str(), core.cpus[0]);
+      cpus_out = core_cpu(core, 0);
+    }
+    return found;
+  }
+
+  // cpus of core sibling idx (wraps around for cores without SMT)
+  static cpu_set_t core_cpu(const Core &core, size_t idx) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core.cpus[idx % core.cpus.size()], &cpus);
+    return cpus;
+  }
+
+  static std::string cpuset_str(const cpu_set_t &cpus) {
+    std::stringstream ss;
+    bool first = true;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &cpus))
+        continue;
+      int end = cpu;
+      while (end + 1 < CPU_SETSIZE && CPU_ISSET(end + 1, &cpus))
+        end++;
+      ss << (first ? "" : ",") << cpu;
+      if (end != cpu)
+        ss << "-" << end;
+      first = false;
+      cpu = end;
+    }
+    return ss.str();
+  }
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <dirent.h>
 #include <err.h>
@@ -20,6 +21,7 @@
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <thread>
@@ -27,6 +29,7 @@
 
 #include "src/caps.hpp"
 #include "src/devices/vmux-device.hpp"
+#include "src/topology.hpp"
 #include "src/util.hpp"
 #include "src/vfio-consumer.hpp"
 
@@ -56,6 +59,9 @@ public:
   std::set<void *> mapped;
   std::map<void *, dma_sg_t *> sgs;
   std::map<void *, iovec *> mappings;
+  // NUMA node backing the largest mapped DMA region (i.e. most guest memory). -1 if unknown.
+  std::atomic<int> guest_numa_node = -1;
+  size_t guest_numa_region_len = 0;
 
   /** In the constructor, we leak the raw device pointer into vfu to be
    * used as private context passed into callbacks. This variable makes
@@ -295,6 +301,16 @@ public:
     return &this->pollfds[this->run_ctx_pollfd_idx.value()];
   }
 
+  // pid of the connected vfio-user client (qemu). -1 if unknown.
+  pid_t peer_pid() {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd = vfu_get_poll_fd(this->vfu_ctx);
+    if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+      return -1;
+    return cred.pid;
+  }
+
   // TODO probably this should be defined in the PassthroughDevice
   void
   setup_passthrough_callbacks(std::shared_ptr<VfioConsumer> callback_context) {
@@ -373,6 +389,13 @@ public:
       die("Failed to populate iovec array");
     }
 
+    int node = Topology::addr_numa_node(mapping->iov_base);
+    if (node >= 0 && mapping->iov_len > vfu->guest_numa_region_len) {
+      vfu->guest_numa_region_len = mapping->iov_len;
+      vfu->guest_numa_node.store(node);
+      printf("Guest memory region of %zu bytes is on NUMA node %d\n", mapping->iov_len, node);
+    }
+
     printf("Add Address to mapped addresses\n");
     vfu->sgs[info->vaddr] = sgl;
     vfu->mappings[info->iova.iov_base] = mapping;